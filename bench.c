@@ -0,0 +1,511 @@
+// SPDX-License-Identifier: EUPL-1.2
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "utils.h"
+#include "structs.h"
+#include "list.h"
+#include "htable.h"
+#include "topic_key.h"
+#include "codec.h"
+#include "poll_funcs.h"
+#include "server.h"
+#include "lanes.h"
+
+// Number of distinct topics the topic key benchmarks go through
+#define TOPICS 1024
+
+// Default number of operations per benchmark
+#define DEFAULT_OPS 1000000
+
+// Number of sockets already in the pollfd array
+#define BENCH_NFDS 1024
+
+// Number of nodes of the list that is iterated over
+#define LIST_NODES 1024
+
+// Number of messages stored and replayed at once (their TCP messages must fit
+// in the socket's buffer)
+#define BACKLOG_BATCH 32
+
+// A topic stored as a string, as the server did before topic keys
+typedef struct str_topic_t {
+	char name[TOPICSIZ];
+} str_topic_t;
+
+// Topic fields as they come in datagrams (followed by the rest of the
+// datagram), their string and key forms, and a copy of the keys at other
+// addresses, so that comparisons do not short-circuit on equal pointers
+static char fields[TOPICS][TOPIC_KEY_SIZE];
+static str_topic_t strs[TOPICS], strs_copy[TOPICS];
+static topic_key_t keys[TOPICS], keys_copy[TOPICS];
+
+// Keeps the compiler from optimizing the benchmarked calls away
+static volatile unsigned int sink;
+
+// Results are not printed while warming up
+static bool warmup;
+
+// Gets the current time (monotonic, in ns)
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Prints the result of a benchmark, given the time it took
+static void report_ns(const char *name, uint64_t elapsed, unsigned int ops) {
+	if (!warmup)
+		printf("%s ops=%u ns_per_op=%.2f\n", name, ops,
+				(double)elapsed / ops);
+}
+
+// Prints the result of a benchmark that started at the given time
+static void report(const char *name, uint64_t start, unsigned int ops) {
+	report_ns(name, now_ns() - start, ops);
+}
+
+static unsigned int str_hash(const void *data) {
+	const str_topic_t *topic = data;
+
+	return ht_hash_bytes(topic->name, strlen(topic->name), HT_SEED);
+}
+
+static bool str_equal(const void *a, const void *b) {
+	return !strcmp(((str_topic_t *)a)->name, ((str_topic_t *)b)->name);
+}
+
+static unsigned int key_hash_ht(const void *data) {
+	return key_hash(data);
+}
+
+static bool key_equal_ht(const void *a, const void *b) {
+	return key_equal(a, b);
+}
+
+// Hashes a client's topic, as the server does
+static unsigned int topic_hash_ht(const void *data) {
+	return key_hash(&((topic_t *)data)->name);
+}
+
+static bool topic_equal_ht(const void *a, const void *b) {
+	return key_equal(&((topic_t *)a)->name, &((topic_t *)b)->name);
+}
+
+// Generates topics of various lengths, some of them filling their field
+static void gen_topics(void) {
+	srand(42);
+
+	for (unsigned int i = 0; i < TOPICS; ++i) {
+		char topic[TOPIC_KEY_SIZE];
+		int len = snprintf(topic, sizeof(topic), "upb/building_%u/floor_%u/%s",
+							i / 64, i / 8 % 8,
+							i % 3 ? "temperature" : "humidity_sensor_precis");
+		if (i % 16 == 0)
+			len = TOPICSIZ - 1;
+		if (len > TOPICSIZ - 1)
+			len = TOPICSIZ - 1;
+
+		// The rest of the datagram is not zeroed
+		for (unsigned int j = 0; j < TOPIC_KEY_SIZE; ++j)
+			fields[i][j] = 'a' + rand() % 26;
+		memcpy(fields[i], topic, len);
+		if (len < TOPICSIZ - 1)
+			fields[i][len] = '\0';
+
+		memcpy(strs[i].name, fields[i], TOPICSIZ - 1);
+		strs[i].name[TOPICSIZ - 1] = '\0';
+		strs_copy[i] = strs[i];
+
+		key_load(&keys[i], fields[i], TOPICSIZ - 1);
+		keys_copy[i] = keys[i];
+	}
+}
+
+// Extracting the topic of a datagram
+static void bench_parse(unsigned int ops) {
+	str_topic_t str;
+	topic_key_t key;
+	uint64_t start = now_ns();
+
+	for (unsigned int i = 0; i < ops; ++i) {
+		memcpy(str.name, fields[i % TOPICS], TOPICSIZ - 1);
+		str.name[TOPICSIZ - 1] = '\0';
+		sink += strlen(str.name);
+	}
+	report("topic_parse_strcmp", start, ops);
+
+	start = now_ns();
+	for (unsigned int i = 0; i < ops; ++i)
+		sink += key_load(&key, fields[i % TOPICS], TOPICSIZ - 1);
+	report("topic_parse_key", start, ops);
+}
+
+static void bench_hash(unsigned int ops) {
+	uint64_t start = now_ns();
+
+	for (unsigned int i = 0; i < ops; ++i)
+		sink += str_hash(&strs[i % TOPICS]);
+	report("topic_hash_strcmp", start, ops);
+
+	start = now_ns();
+	for (unsigned int i = 0; i < ops; ++i)
+		sink += key_hash(&keys[i % TOPICS]);
+	report("topic_hash_key", start, ops);
+}
+
+// Comparing equal topics (the common case in a hash table hit) and distinct
+// topics sharing a prefix
+static void bench_equal(unsigned int ops) {
+	uint64_t start = now_ns();
+
+	for (unsigned int i = 0; i < ops; ++i)
+		sink += str_equal(&strs[i % TOPICS], &strs_copy[i % TOPICS]);
+	report("topic_equal_strcmp", start, ops);
+
+	start = now_ns();
+	for (unsigned int i = 0; i < ops; ++i)
+		sink += key_equal(&keys[i % TOPICS], &keys_copy[i % TOPICS]);
+	report("topic_equal_key", start, ops);
+
+	start = now_ns();
+	for (unsigned int i = 0; i < ops; ++i)
+		sink += str_equal(&strs[i % TOPICS], &strs_copy[(i + 1) % TOPICS]);
+	report("topic_differ_strcmp", start, ops);
+
+	start = now_ns();
+	for (unsigned int i = 0; i < ops; ++i)
+		sink += key_equal(&keys[i % TOPICS], &keys_copy[(i + 1) % TOPICS]);
+	report("topic_differ_key", start, ops);
+}
+
+// Looking up the topic of a datagram in a hash table, from its field
+static void bench_lookup(unsigned int ops) {
+	htable_t *str_ht = ht_create(sizeof(str_topic_t), str_hash, str_equal);
+	htable_t *key_ht = ht_create(sizeof(topic_key_t), key_hash_ht,
+									key_equal_ht);
+
+	// Half of the topics are in the tables, so half of the lookups miss
+	for (unsigned int i = 0; i < TOPICS; i += 2) {
+		ht_put(str_ht, &strs[i]);
+		ht_put(key_ht, &keys[i]);
+	}
+
+	str_topic_t str;
+	topic_key_t key;
+	uint64_t start = now_ns();
+
+	for (unsigned int i = 0; i < ops; ++i) {
+		memcpy(str.name, fields[i % TOPICS], TOPICSIZ - 1);
+		str.name[TOPICSIZ - 1] = '\0';
+		sink += !!ht_get(str_ht, &str);
+	}
+	report("topic_lookup_strcmp", start, ops);
+
+	start = now_ns();
+	for (unsigned int i = 0; i < ops; ++i) {
+		key_load(&key, fields[i % TOPICS], TOPICSIZ - 1);
+		sink += !!ht_get(key_ht, &key);
+	}
+	report("topic_lookup_key", start, ops);
+
+	ht_free(&str_ht);
+	ht_free(&key_ht);
+}
+
+// Matching a message's topic against the topics of a client, for clients
+// subscribed to more and more topics
+static void bench_match(unsigned int ops) {
+	static const unsigned int counts[] = {1, 16, 256, 4096};
+
+	for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+		unsigned int subs = counts[c];
+		htable_t *topics = ht_create(sizeof(topic_t), topic_hash_ht,
+										topic_equal_ht);
+
+		// Every other topic is subscribed to, so half of the lookups miss
+		topic_t *probes = calloc(2 * subs, sizeof(topic_t));
+		DIE(!probes, "probes calloc() failed");
+		for (unsigned int i = 0; i < 2 * subs; ++i) {
+			char name[TOPICSIZ];
+			snprintf(name, TOPICSIZ, "upb/match/%u/sensor", i);
+			key_set(&probes[i].name, name, TOPICSIZ - 1);
+			if (i % 2 == 0)
+				ht_put(topics, &probes[i]);
+		}
+
+		uint64_t start = now_ns();
+		for (unsigned int i = 0; i < ops; ++i)
+			sink += !!ht_get(topics, &probes[i % (2 * subs)]);
+
+		char name[64];
+		snprintf(name, sizeof(name), "topic_match_subs_%u", subs);
+		report(name, start, ops);
+
+		free(probes);
+		ht_free(&topics);
+	}
+}
+
+// Adding nodes to a list, going through it and removing them, as done with
+// the list of clients
+static void bench_list(unsigned int ops) {
+	list_t *list = list_create(sizeof(client_t));
+	client_t data;
+	memset(&data, 0, sizeof(client_t));
+
+	uint64_t start = now_ns();
+	for (unsigned int i = 0; i < ops; ++i)
+		list_add_head(list, &data);
+	report("list_add_head", start, ops);
+
+	// Removing the head takes constant time, other nodes are searched for
+	start = now_ns();
+	for (unsigned int i = 0; i < ops; ++i)
+		list_remove(list, list->head->data);
+	report("list_remove_head", start, ops);
+
+	for (unsigned int i = 0; i < LIST_NODES; ++i)
+		list_add_head(list, &data);
+
+	unsigned int rounds = ops / LIST_NODES ? ops / LIST_NODES : 1;
+	start = now_ns();
+	for (unsigned int r = 0; r < rounds; ++r)
+		for (node_t *it = list->head; it; it = it->next)
+			sink += ((client_t *)it->data)->online;
+	report("list_iterate_node", start, rounds * LIST_NODES);
+
+	list_free(&list);
+}
+
+// Adding a socket to the pollfd array, finding it and removing it, next to
+// other sockets
+static void bench_socket(unsigned int ops) {
+	static struct pollfd pfds[MAX_PFDS];
+	int nfds = 0;
+
+	for (int i = 0; i < BENCH_NFDS; ++i)
+		add_socket(pfds, &nfds, 1000 + i);
+
+	uint64_t start = now_ns();
+	for (unsigned int i = 0; i < ops; ++i) {
+		add_socket(pfds, &nfds, 42);
+		remove_socket(pfds, &nfds, nfds - 1);
+	}
+	report("socket_add_remove", start, ops);
+
+	// Looks for the sockets in turn, so on average half of the array is
+	// scanned
+	start = now_ns();
+	for (unsigned int i = 0; i < ops; ++i)
+		sink += find_socket(pfds, nfds, 1000 + i % BENCH_NFDS);
+	report("socket_find_nfds_1024", start, ops);
+
+	// Removing a socket from the middle moves the last one in its place
+	start = now_ns();
+	for (unsigned int i = 0; i < ops; ++i) {
+		int idx = i % BENCH_NFDS;
+		int fd = pfds[idx].fd;
+		remove_socket(pfds, &nfds, idx);
+		add_socket(pfds, &nfds, fd);
+	}
+	report("socket_remove_middle", start, ops);
+}
+
+// Builds a datagram of the given type, returning its length
+static int build_datagram(uint8_t type, char *buffer) {
+	udp_msg_t *udp = (udp_msg_t *)buffer;
+	memset(udp, 0, sizeof(udp_msg_t));
+	strcpy(udp->topic, "upb/precis/100/temperature");
+	udp->type = type;
+
+	uint32_t val = htonl(123456789);
+	uint16_t short_val = htons(2345);
+	size_t len;
+
+	if (type == INT) {
+		udp->content[0] = 1;
+		memcpy(udp->content + 1, &val, sizeof(uint32_t));
+		len = INT_LEN;
+	} else if (type == SHORT_REAL) {
+		memcpy(udp->content, &short_val, sizeof(uint16_t));
+		len = SHORT_REAL_LEN;
+	} else if (type == FLOAT) {
+		memcpy(udp->content + 1, &val, sizeof(uint32_t));
+		udp->content[5] = 4;
+		len = FLOAT_LEN;
+	} else {
+		len = 64;
+		memset(udp->content, 's', len);
+	}
+
+	return offsetof(udp_msg_t, content) + len;
+}
+
+// Decoding a datagram of each type, then formatting it as a TCP message
+static void bench_payload(unsigned int ops) {
+	static const char *names[] = {"int", "short_real", "float", "string"};
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(4242);
+
+	for (uint8_t type = INT; type <= STRING; ++type) {
+		// The datagram's buffer is as large as the server's
+		char buffer[BUFSIZ];
+		int len = build_datagram(type, buffer);
+		msg_t msg;
+		char name[64];
+
+		uint64_t start = now_ns();
+		for (unsigned int i = 0; i < ops; ++i)
+			sink += parse_msg(buffer, len, &addr, &msg);
+		snprintf(name, sizeof(name), "payload_decode_%s", names[type]);
+		report(name, start, ops);
+
+		tcp_msg_t tcp;
+		start = now_ns();
+		for (unsigned int i = 0; i < ops; ++i) {
+			build_tcp_msg(&msg, &tcp);
+			sink += tcp.content[0];
+		}
+		snprintf(name, sizeof(name), "payload_format_%s", names[type]);
+		report(name, start, ops);
+	}
+}
+
+// Storing messages for an offline client and sending them when it comes back
+// (over a local socket, read after each batch)
+static void bench_backlog(unsigned int ops) {
+	server_t *srv = calloc(1, sizeof(server_t));
+	client_t *client = calloc(1, sizeof(client_t));
+	DIE(!srv || !client, "calloc() failed");
+	wheel_init(&srv->wheel, now_ms());
+	srv->ttl = DEFAULT_TTL * 1000;
+
+	int sv[2];
+	DIE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0, "socketpair() failed");
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	client->socket = sv[0];
+	client->online = true;
+
+	// The client is subscribed to the topic, with store and forward
+	topic_t topic;
+	memset(&topic, 0, sizeof(topic_t));
+	key_set(&topic.name, "upb/precis/100/temperature", TOPICSIZ - 1);
+	topic.sf = 1;
+	client->topics = ht_create(sizeof(topic_t), topic_hash_ht,
+								topic_equal_ht);
+	ht_put(client->topics, &topic);
+
+	char buffer[BUFSIZ];
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	msg_t msg;
+	parse_msg(buffer, build_datagram(STRING, buffer), &addr, &msg);
+
+	unsigned int batches = ops / BACKLOG_BATCH ? ops / BACKLOG_BATCH : 1;
+	uint64_t add_ns = 0, replay_ns = 0;
+	static char drain[1 << 16];
+
+	for (unsigned int b = 0; b < batches; ++b) {
+		uint64_t start = now_ns();
+		for (unsigned int i = 0; i < BACKLOG_BATCH; ++i) {
+			msg.seq = b * BACKLOG_BATCH + i + 1;
+			backlog_add(srv, client, &msg);
+		}
+		add_ns += now_ns() - start;
+
+		// The replay goes on as the socket drains
+		start = now_ns();
+		DIE(!backlog_replay(srv, client), "backlog_replay() failed");
+		replay_ns += now_ns() - start;
+
+		while (read(sv[1], drain, sizeof(drain)) > 0 || client->replay ||
+				client->out_len) {
+			start = now_ns();
+			DIE(!lanes_flush(srv, client), "lanes_flush() failed");
+			replay_ns += now_ns() - start;
+		}
+	}
+
+	report_ns("backlog_add", add_ns, batches * BACKLOG_BATCH);
+	report_ns("backlog_replay", replay_ns, batches * BACKLOG_BATCH);
+
+	close(sv[0]);
+	close(sv[1]);
+	lanes_clear(srv, client);
+	ht_free(&client->topics);
+	free(client);
+	free(srv);
+}
+
+// A group of benchmarks, selected by its name
+typedef struct bench_t {
+	const char *name;
+	void (*run)(unsigned int ops);
+} bench_t;
+
+static const bench_t benches[] = {
+	{"topic", bench_parse},
+	{"topic", bench_hash},
+	{"topic", bench_equal},
+	{"topic", bench_lookup},
+	{"match", bench_match},
+	{"list", bench_list},
+	{"socket", bench_socket},
+	{"payload", bench_payload},
+	{"backlog", bench_backlog},
+};
+
+int main(int argc, char **argv) {
+	unsigned int ops = DEFAULT_OPS;
+	const char *only = NULL;
+
+	// Parses the options
+	// -n <OPS>: number of operations per benchmark
+	// -b <GROUP>: runs only a group of benchmarks (topic, match, list, socket,
+	// payload or backlog)
+	int opt;
+	while ((opt = getopt(argc, argv, "n:b:")) != -1) {
+		if (opt == 'n') {
+			ops = atoi(optarg);
+		} else if (opt == 'b') {
+			only = optarg;
+		} else {
+			fprintf(stderr, "Usage: %s [-n OPS] [-b GROUP]\n", argv[0]);
+			return 1;
+		}
+	}
+	DIE(!ops, "invalid number of operations");
+
+	gen_topics();
+
+	// Each benchmark first runs a tenth of its operations, so that caches and
+	// allocators are warm
+	for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); ++i) {
+		if (only && strcmp(only, benches[i].name))
+			continue;
+
+		warmup = true;
+		benches[i].run(ops / 10 ? ops / 10 : 1);
+		warmup = false;
+		benches[i].run(ops);
+	}
+
+	return 0;
+}
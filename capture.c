@@ -0,0 +1,120 @@
+// SPDX-License-Identifier: EUPL-1.2
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <endian.h>
+
+#include "capture.h"
+#include "utils.h"
+
+// Buffer of the capture file being written (a process writes only one)
+static char cap_buf[CAP_BUFSIZ];
+
+FILE *cap_create(const char *path) {
+	FILE *cap = fopen(path, "wb");
+	DIE(!cap, "capture fopen() failed");
+	setvbuf(cap, cap_buf, _IOFBF, CAP_BUFSIZ);
+
+	DIE(fwrite(CAP_MAGIC, CAP_MAGIC_LEN, 1, cap) != 1,
+		"capture fwrite() failed");
+
+	return cap;
+}
+
+FILE *cap_open(const char *path) {
+	FILE *cap = fopen(path, "rb");
+	DIE(!cap, "capture fopen() failed");
+
+	char magic[CAP_MAGIC_LEN];
+	if (fread(magic, CAP_MAGIC_LEN, 1, cap) != 1 ||
+		memcmp(magic, CAP_MAGIC, CAP_MAGIC_LEN)) {
+		fclose(cap);
+		return NULL;
+	}
+
+	return cap;
+}
+
+// Writes a record, whose data comes in two parts
+static void cap_write(FILE *cap, uint8_t kind, const struct sockaddr_in *addr,
+						const void *a, size_t a_len, const void *b,
+						size_t b_len) {
+	// The wall clock may be stepped, so the records are paced by the
+	// monotonic one
+	struct timespec mono, wall;
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &wall);
+
+	uint8_t hdr[CAP_HDR];
+	uint64_t when = htobe64((uint64_t)mono.tv_sec * 1000000000 + mono.tv_nsec);
+	uint64_t when_wall = htobe64((uint64_t)wall.tv_sec * 1000000000 +
+									wall.tv_nsec);
+	uint16_t len = htons(a_len + b_len);
+	memcpy(hdr, &when, sizeof(uint64_t));
+	memcpy(hdr + 8, &when_wall, sizeof(uint64_t));
+	hdr[16] = kind;
+	memset(hdr + 17, 0, sizeof(uint32_t) + sizeof(uint16_t));
+	if (addr) {
+		memcpy(hdr + 17, &addr->sin_addr.s_addr, sizeof(uint32_t));
+		memcpy(hdr + 21, &addr->sin_port, sizeof(uint16_t));
+	}
+	memcpy(hdr + 23, &len, sizeof(uint16_t));
+
+	DIE(fwrite(hdr, CAP_HDR, 1, cap) != 1 ||
+		(a_len && fwrite(a, a_len, 1, cap) != 1) ||
+		(b_len && fwrite(b, b_len, 1, cap) != 1), "capture fwrite() failed");
+}
+
+void cap_datagram(FILE *cap, const struct sockaddr_in *addr, const void *data,
+					size_t len) {
+	cap_write(cap, CAP_DATAGRAM, addr, data, len, NULL, 0);
+}
+
+void cap_event(FILE *cap, uint8_t kind, const struct sockaddr_in *addr,
+				const char *id, const void *extra, size_t extra_len) {
+	uint8_t head[1 + IDSIZ];
+	head[0] = strnlen(id, IDSIZ - 1);
+	memcpy(head + 1, id, head[0]);
+
+	cap_write(cap, kind, addr, head, 1 + head[0], extra, extra_len);
+}
+
+int cap_read(FILE *cap, cap_record_t *rec) {
+	uint8_t hdr[CAP_HDR];
+	size_t got = fread(hdr, 1, CAP_HDR, cap);
+	if (!got)
+		return 0;
+	if (got < CAP_HDR)
+		return -1;
+
+	uint64_t when, when_wall;
+	uint16_t len;
+	memcpy(&when, hdr, sizeof(uint64_t));
+	memcpy(&when_wall, hdr + 8, sizeof(uint64_t));
+	memcpy(&len, hdr + 23, sizeof(uint16_t));
+
+	rec->ts = be64toh(when);
+	rec->wall = be64toh(when_wall);
+	rec->kind = hdr[16];
+	memset(&rec->addr, 0, sizeof(struct sockaddr_in));
+	rec->addr.sin_family = AF_INET;
+	memcpy(&rec->addr.sin_addr.s_addr, hdr + 17, sizeof(uint32_t));
+	memcpy(&rec->addr.sin_port, hdr + 21, sizeof(uint16_t));
+	rec->len = ntohs(len);
+
+	if (rec->kind < CAP_DATAGRAM || rec->kind > CAP_DISCONNECT ||
+		rec->len > CAP_DATA_MAX)
+		return -1;
+	if (rec->len && fread(rec->data, rec->len, 1, cap) != 1)
+		return -1;
+
+	// Subscriber events start with a whole ID
+	if (rec->kind != CAP_DATAGRAM &&
+		(!rec->len || !rec->data[0] || rec->data[0] > IDSIZ - 1 ||
+		rec->data[0] >= rec->len))
+		return -1;
+
+	return 1;
+}
@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: EUPL-1.2 */
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "structs.h"
+
+// The start of a capture file, followed by its records
+#define CAP_MAGIC "PCOMCAP2"
+#define CAP_MAGIC_LEN 8
+
+// Kinds of records
+// The data of the subscriber events starts with the length of the client's
+// ID and the ID, followed by the connection flags (CAP_CONNECT), the flags
+// byte of a bulk entry (sf and priority class) and the topic (CAP_SUBSCRIBE)
+// or the topic (CAP_UNSUBSCRIBE)
+#define CAP_DATAGRAM 1 // a datagram, as received
+#define CAP_CONNECT 2
+#define CAP_SUBSCRIBE 3
+#define CAP_UNSUBSCRIBE 4
+#define CAP_DISCONNECT 5
+
+// Size of a record's header: the monotonic and the wall clock timestamps (8
+// bytes each), the kind, the source address (4 and 2 bytes) and the length of
+// the data (2 bytes), all in network order
+#define CAP_HDR 25
+
+// Maximum length of a record's data
+#define CAP_DATA_MAX sizeof(udp_msg_t)
+
+// Size of the buffer of a capture file, so that records are written in large
+// chunks
+#define CAP_BUFSIZ (1 << 20)
+
+// Time between two flushes of the capture file, so that little is lost if the
+// server is killed (ms)
+#define CAP_FLUSH_INTERVAL 1000
+
+// A record of a capture file
+typedef struct cap_record_t {
+	uint64_t ts; // when it was received (CLOCK_MONOTONIC ns), for pacing
+	uint64_t wall; // when it was received (CLOCK_REALTIME ns)
+	uint8_t kind;
+	struct sockaddr_in addr; // the publisher's or the subscriber's address
+	uint16_t len;
+	uint8_t data[CAP_DATA_MAX];
+} cap_record_t;
+
+/**
+ * @brief Creates a capture file, replacing any existing one.
+ *
+ * @param path The path of the file.
+ *
+ * @return The open file.
+ */
+FILE *cap_create(const char *path);
+
+/**
+ * @brief Opens a capture file for reading, checking its magic.
+ *
+ * @param path The path of the file.
+ *
+ * @return The open file, or NULL if it is not a capture file.
+ */
+FILE *cap_open(const char *path);
+
+/**
+ * @brief Records a received datagram.
+ *
+ * @param cap The capture file.
+ * @param addr The publisher's address.
+ * @param data The datagram.
+ * @param len Its length (at most CAP_DATA_MAX).
+ */
+void cap_datagram(FILE *cap, const struct sockaddr_in *addr, const void *data,
+					size_t len);
+
+/**
+ * @brief Records a subscriber event.
+ *
+ * @param cap The capture file.
+ * @param kind The kind of the event (CAP_CONNECT to CAP_DISCONNECT).
+ * @param addr The subscriber's address, or NULL if unknown.
+ * @param id The subscriber's ID.
+ * @param extra What follows the ID in the record's data (see CAP_CONNECT).
+ * @param extra_len Its length.
+ */
+void cap_event(FILE *cap, uint8_t kind, const struct sockaddr_in *addr,
+				const char *id, const void *extra, size_t extra_len);
+
+/**
+ * @brief Reads the next record of a capture file.
+ *
+ * @param cap The capture file.
+ * @param rec Where to store the record.
+ *
+ * @return 1 if a record was read, 0 at the end of the file and -1 if the
+ * record is truncated or malformed.
+ */
+int cap_read(FILE *cap, cap_record_t *rec);
+
+#endif /* _CAPTURE_H_ */
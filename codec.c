@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: EUPL-1.2
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "codec.h"
+
+size_t varint_encode(uint8_t *buf, uint32_t val) {
+	size_t i = 0;
+
+	// Writes seven bits at a time, the high bit marking a continuation
+	while (val >= 0x80) {
+		buf[i++] = (uint8_t)(val | 0x80);
+		val >>= 7;
+	}
+	buf[i++] = (uint8_t)val;
+
+	return i;
+}
+
+int varint_decode(const uint8_t *buf, size_t len, uint32_t *val) {
+	uint32_t res = 0;
+
+	for (size_t i = 0; i < VARINT_MAX; ++i) {
+		// Not all of the bytes have arrived yet
+		if (i == len)
+			return 0;
+
+		res |= (uint32_t)(buf[i] & 0x7f) << (7 * i);
+		if (!(buf[i] & 0x80)) {
+			*val = res;
+			return i + 1;
+		}
+	}
+
+	// Too many continuation bytes
+	return -1;
+}
+
+bool seq_after(uint32_t a, uint32_t b) {
+	return (int32_t)(a - b) > 0;
+}
+
+int content_len(uint8_t type, const char *content, size_t len) {
+	int need;
+
+	if (type == INT)
+		need = INT_LEN;
+	else if (type == SHORT_REAL)
+		need = SHORT_REAL_LEN;
+	else if (type == FLOAT)
+		need = FLOAT_LEN;
+	else if (type == STRING)
+		// Strings end at the first null byte or at the end of the datagram
+		return strnlen(content, len < CONTENTSIZ - 1 ? len : CONTENTSIZ - 1);
+	else
+		return -1;
+
+	return (size_t)need <= len ? need : -1;
+}
+
+void format_content(uint8_t type, const char *content, size_t len,
+					char *type_str, char *out) {
+	if (type == INT) {
+		// Converts to host order
+		uint32_t int_num;
+		memcpy(&int_num, content + 1, sizeof(uint32_t));
+		int_num = ntohl(int_num);
+
+		// Changes the sign, if necessary
+		if (content[0] == 1)
+			int_num = int_num * (-1);
+
+		sprintf(out, "%d", int_num);
+
+		strcpy(type_str, "INT");
+	} else if (type == SHORT_REAL) {
+		// Converts to host order
+		uint16_t raw;
+		memcpy(&raw, content, sizeof(uint16_t));
+		double short_real = ntohs(raw);
+
+		// Converts the number to a short real
+		// Also shifts the decimal point two places
+		short_real = short_real / 100;
+
+		strcpy(type_str, "SHORT_REAL");
+
+		sprintf(out, "%.2f", short_real);
+	} else if (type == FLOAT) {
+		// Converts to host order
+		uint32_t raw;
+		memcpy(&raw, content + 1, sizeof(uint32_t));
+		double float_num = ntohl(raw);
+
+		// Gets the decimal point's position
+		int floating_point = 1;
+		for (int i = 0; i < content[5]; ++i)
+			floating_point *= 10;
+
+		// Converts the number to a float, also shifts the decimal point
+		float_num = float_num / floating_point;
+
+		strcpy(type_str, "FLOAT");
+
+		// Changes the sign, if necessary
+		if (content[0] == 1)
+			float_num = float_num * (-1);
+
+		sprintf(out, "%lf", float_num);
+	} else if (type == STRING) {
+		strcpy(type_str, "STRING");
+		memcpy(out, content, len);
+		out[len] = '\0';
+	}
+}
@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: EUPL-1.2 */
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#ifndef _CODEC_H_
+#define _CODEC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "structs.h"
+
+// Maximum number of bytes a 32-bit varint can take
+#define VARINT_MAX 5
+
+// Compact wire mode frame kinds (first byte of every frame)
+// Data frames use the content type (INT, SHORT_REAL, FLOAT or STRING) as kind
+#define FRAME_DICT 0x10
+#define FRAME_HEARTBEAT 0x11 // a single byte, sent on idle connections
+#define FRAME_EPOCH 0x12 // the server's epoch (4 bytes, network order)
+#define FRAME_REJECT 0x13 // a refused subscription (the topic, length first)
+
+// Size of an epoch frame
+#define EPOCH_FRAME_LEN 5
+
+// Sizes of the binary payloads of the fixed-width content types
+#define INT_LEN 5
+#define SHORT_REAL_LEN 2
+#define FLOAT_LEN 6
+
+// Maximum size of a compact data frame (a STRING data frame): the kind, the
+// dictionary ID, the sequence number, the length and the content
+#define FRAME_MAX (1 + 3 * VARINT_MAX + CONTENTSIZ - 1)
+
+// Maximum size of a compact dictionary frame: the kind, the ID, the topic
+// (prefixed by its length) and the publisher's IPv4 address and port
+#define DICT_FRAME_MAX (1 + VARINT_MAX + 1 + TOPICSIZ - 1 + 4 + 2)
+
+/**
+ * @brief Encodes an unsigned integer as a LEB128 varint.
+ *
+ * @param buf The buffer to write to (at least VARINT_MAX bytes)
+ * @param val The value to encode
+ *
+ * @return The number of bytes written
+ */
+size_t varint_encode(uint8_t *buf, uint32_t val);
+
+/**
+ * @brief Decodes a LEB128 varint.
+ *
+ * @param buf The buffer to read from
+ * @param len The number of bytes available in the buffer
+ * @param val Where to store the decoded value
+ *
+ * @return The number of bytes read, 0 if the varint is incomplete or -1 if it
+ * is malformed
+ */
+int varint_decode(const uint8_t *buf, size_t len, uint32_t *val);
+
+/**
+ * @brief Compares two sequence numbers of a topic, which may have wrapped
+ * around.
+ *
+ * @param a The first sequence number
+ * @param b The second sequence number
+ *
+ * @return True if a comes after b
+ */
+bool seq_after(uint32_t a, uint32_t b);
+
+/**
+ * @brief Gets the length of a datagram's binary payload.
+ *
+ * @param type The content type
+ * @param content The binary payload
+ * @param len The number of payload bytes available
+ *
+ * @return The payload length or -1 if the type is unknown or it is truncated
+ */
+int content_len(uint8_t type, const char *content, size_t len);
+
+/**
+ * @brief Converts a binary payload to the textual form printed by subscribers.
+ *
+ * @param type The content type
+ * @param content The binary payload
+ * @param len The payload length (as returned by content_len())
+ * @param type_str Where to store the type's name (TYPESIZ bytes)
+ * @param out Where to store the formatted content (CONTENTSIZ bytes)
+ */
+void format_content(uint8_t type, const char *content, size_t len,
+					char *type_str, char *out);
+
+#endif /* _CODEC_H_ */
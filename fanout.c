@@ -0,0 +1,208 @@
+// SPDX-License-Identifier: EUPL-1.2
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <getopt.h>
+
+#include "structs.h"
+#include "utils.h"
+
+// Topic the messages are published on
+#define FANOUT_TOPIC "fanout_bench"
+
+// Number of messages published before waiting for all subscribers to get them
+#define BURST 32
+
+// How long to wait for a burst before counting the rest as lost (ms)
+#define BURST_TIMEOUT 1000
+
+// Gets the current time (monotonic, in ns)
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Gets the CPU time used by a process (user and system, in ns)
+static uint64_t cpu_ns(int pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+	FILE *file = fopen(path, "r");
+	DIE(!file, "fopen() failed");
+
+	// The fields after the command (which may contain spaces)
+	char line[1024];
+	char *ret = fgets(line, sizeof(line), file);
+	fclose(file);
+	DIE(!ret, "fgets() failed");
+
+	unsigned long utime, stime;
+	char *fields = strrchr(line, ')') + 2;
+	sscanf(fields, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			&utime, &stime);
+
+	return (uint64_t)(utime + stime) * 1000000000 / sysconf(_SC_CLK_TCK);
+}
+
+// Connects a subscriber of the benchmark topic
+static int subscribe(struct sockaddr_in *addr, int n) {
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	DIE(sock < 0, "socket() failed");
+
+	int ret = connect(sock, (struct sockaddr *)addr, sizeof(*addr));
+	DIE(ret < 0, "connect() failed");
+
+	conn_packet_t conn;
+	memset(&conn, 0, CONNLEN);
+	snprintf(conn.id, IDSIZ, "f%05u%03u", (unsigned int)getpid() % 100000,
+			(unsigned int)n % 1000);
+	ret = send(sock, &conn, CONNLEN, 0);
+	DIE(ret < 0, "send() failed");
+
+	sub_packet_t pack;
+	memset(&pack, 0, PACKLEN);
+	pack.type = SUBSCRIBE;
+	strcpy(pack.topic, FANOUT_TOPIC);
+	ret = send(sock, &pack, PACKLEN, 0);
+	DIE(ret < 0, "send() failed");
+
+	return sock;
+}
+
+int main(int argc, char **argv) {
+	unsigned int count = 20000, subs = 16, len = CONTENTSIZ - 1;
+	int pid = 0;
+
+	// Parses the options
+	// -n <COUNT>: number of messages published
+	// -s <SUBS>: number of subscribers
+	// -l <LEN>: length of the STRING content
+	// -p <PID>: the server's process ID, to report its CPU time
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:l:p:")) != -1) {
+		DIE(opt == '?', "Invalid option (argv).");
+		if (opt == 'n')
+			count = atoi(optarg);
+		else if (opt == 's')
+			subs = atoi(optarg);
+		else if (opt == 'l')
+			len = atoi(optarg);
+		else if (opt == 'p')
+			pid = atoi(optarg);
+	}
+
+	DIE(argc - optind < 2 || !count || !subs || subs > MAX_CLIENTS ||
+		len > CONTENTSIZ - 1, "Usage: ./fanout [-n COUNT] [-s SUBS] [-l LEN] "
+		"[-p PID] <IP> <PORT>");
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(argv[optind + 1]));
+	DIE(!inet_aton(argv[optind], &addr.sin_addr), "Invalid IP (argv).");
+
+	struct pollfd *pfds = calloc(subs, sizeof(struct pollfd));
+	size_t *got = calloc(subs, sizeof(size_t));
+	DIE(!pfds || !got, "calloc() failed");
+
+	for (unsigned int i = 0; i < subs; ++i) {
+		pfds[i].fd = subscribe(&addr, i);
+		pfds[i].events = POLLIN;
+	}
+
+	// Leaves time for the subscriptions to be handled
+	usleep(200000);
+
+	int udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	DIE(udp_sock < 0, "udp socket() failed");
+
+	udp_msg_t msg;
+	memset(&msg, 0, sizeof(udp_msg_t));
+	strcpy(msg.topic, FANOUT_TOPIC);
+	msg.type = STRING;
+	memset(msg.content, 'x', len);
+
+	static char buf[1 << 16];
+	unsigned long lost = 0;
+	uint64_t start = now_ns(), cpu_start = pid ? cpu_ns(pid) : 0;
+
+	// Publishes in bursts, so that no datagram is dropped for lack of buffer
+	// space, waiting for every subscriber to get each burst
+	for (unsigned int sent = 0; sent < count;) {
+		unsigned int burst = count - sent < BURST ? count - sent : BURST;
+		for (unsigned int i = 0; i < burst; ++i) {
+			int ret = sendto(udp_sock, &msg, TOPICSIZ + len, 0,
+								(struct sockaddr *)&addr, sizeof(addr));
+			DIE(ret < 0, "sendto() failed");
+		}
+		sent += burst;
+
+		size_t want = (size_t)sent * sizeof(tcp_msg_t);
+		unsigned int done = 0;
+		for (unsigned int i = 0; i < subs; ++i)
+			done += got[i] >= want;
+
+		while (done < subs) {
+			int ret = poll(pfds, subs, BURST_TIMEOUT);
+			DIE(ret < 0, "poll() failed");
+			if (!ret)
+				break;
+
+			for (unsigned int i = 0; i < subs; ++i) {
+				if (!(pfds[i].revents & POLLIN))
+					continue;
+
+				ret = recv(pfds[i].fd, buf, sizeof(buf), 0);
+				DIE(ret <= 0, "recv() failed");
+
+				bool before = got[i] >= want;
+				got[i] += ret;
+				done += !before && got[i] >= want;
+			}
+		}
+
+		// Counts the missing messages and moves on
+		for (unsigned int i = 0; i < subs; ++i) {
+			if (got[i] < want) {
+				lost += (want - got[i]) / sizeof(tcp_msg_t);
+				got[i] = want;
+			}
+		}
+	}
+
+	uint64_t elapsed = now_ns() - start;
+	double deliveries = (double)count * subs - lost;
+
+	printf("fanout count=%u subs=%u len=%u lost=%lu deliveries_per_s=%.0f",
+			count, subs, len, lost, deliveries / (elapsed / 1e9));
+	if (pid)
+		printf(" server_cpu_ns_per_delivery=%.0f",
+				(cpu_ns(pid) - cpu_start) / deliveries);
+	printf("\n");
+
+	// Disconnects the subscribers
+	for (unsigned int i = 0; i < subs; ++i) {
+		sub_packet_t pack;
+		memset(&pack, 0, PACKLEN);
+		pack.type = EXIT;
+		send(pfds[i].fd, &pack, PACKLEN, 0);
+		close(pfds[i].fd);
+	}
+
+	close(udp_sock);
+	free(pfds);
+	free(got);
+
+	return 0;
+}
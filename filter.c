@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: EUPL-1.2
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+#include "structs.h"
+#include "htable.h"
+#include "timer.h"
+#include "utils.h"
+#include "server.h"
+#include "filter.h"
+
+// Return value of a filter accepting a datagram (its whole length)
+#define ACCEPT 0xffffffff
+
+// Attaches a program to the UDP socket. If the kernel refuses it, the socket
+// is left without a filter, so no datagram is ever dropped by mistake.
+static bool filter_attach(server_t *srv, struct sock_filter *prog,
+							unsigned int len) {
+	struct sock_fprog fprog = { .len = len, .filter = prog };
+
+	if (!setsockopt(srv->socks->udp_sock, SOL_SOCKET, SO_ATTACH_FILTER,
+					&fprog, sizeof(fprog)))
+		return true;
+
+	// The option is checked for an int, even if it is not used
+	int unused = 0;
+	setsockopt(srv->socks->udp_sock, SOL_SOCKET, SO_DETACH_FILTER, &unused,
+				sizeof(int));
+	return false;
+}
+
+// Lets all datagrams in, until the next rebuild
+static void filter_open(server_t *srv) {
+	struct sock_filter accept_all = BPF_STMT(BPF_RET | BPF_K, ACCEPT);
+
+	filter_attach(srv, &accept_all, 1);
+	srv->filter.open = true;
+}
+
+// Appends the instructions accepting the datagrams for a topic, which compare
+// the topic field to the topic and the null byte ending it (unless it fills
+// the whole field), 4, 2 or 1 bytes at a time
+// Returns false if the program would not fit the instruction limit.
+static bool filter_topic(struct sock_filter *prog, unsigned int *len,
+							const char *topic) {
+	uint8_t field[TOPICSIZ - 1];
+	memset(field, 0, sizeof(field));
+
+	size_t topic_len = strlen(topic);
+	memcpy(field, topic, topic_len);
+
+	size_t cmp_len = topic_len + 1;
+	if (cmp_len > sizeof(field))
+		cmp_len = sizeof(field);
+
+	// Counts the comparisons: a load and a jump to the next topic each, then
+	// the final accept
+	unsigned int count = 0;
+	for (size_t off = 0; off < cmp_len; ++count)
+		off += cmp_len - off >= 4 ? 4 : cmp_len - off >= 2 ? 2 : 1;
+
+	unsigned int block = 2 * count + 1;
+
+	// Leaves room for the final drop
+	if (*len + block + 1 > FILTER_MAX_INSNS)
+		return false;
+
+	unsigned int end = *len + block;
+	size_t off = 0;
+	while (off < cmp_len) {
+		size_t size = cmp_len - off >= 4 ? 4 : cmp_len - off >= 2 ? 2 : 1;
+		uint16_t width = size == 4 ? BPF_W : size == 2 ? BPF_H : BPF_B;
+
+		// Loads are in network order
+		uint32_t k = 0;
+		for (size_t i = 0; i < size; ++i)
+			k = k << 8 | field[off + i];
+
+		prog[*len] = (struct sock_filter)BPF_STMT(BPF_LD | width | BPF_ABS,
+													FILTER_PAYLOAD + off);
+		++*len;
+		prog[*len] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+													k, 0, end - *len - 1);
+		++*len;
+
+		off += size;
+	}
+
+	prog[*len] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, ACCEPT);
+	++*len;
+
+	return true;
+}
+
+// Adds the topics of an interest table to a set
+static void add_topics(htable_t *topics, htable_t *interest) {
+	for (unsigned int b = 0; b < interest->nbuckets; ++b) {
+		for (node_t *it = interest->buckets[b]; it; it = it->next) {
+			if (!ht_get(topics, it->data))
+				ht_put(topics, it->data);
+		}
+	}
+}
+
+// Rebuilds the filter, once the delay between two rebuilds passed
+static void filter_rebuild(void *ctx, wtimer_t *timer) {
+	(void)timer;
+	filter_build(ctx);
+}
+
+void filter_init(server_t *srv) {
+	timer_init(&srv->filter.rebuild, filter_rebuild, NULL);
+
+	// A capture records every datagram, subscribed to or not
+	if (srv->capture) {
+		filter_open(srv);
+		return;
+	}
+
+	filter_build(srv);
+}
+
+void filter_build(server_t *srv) {
+	timer_cancel(&srv->wheel, &srv->filter.rebuild);
+	srv->filter.last = now_ms();
+
+	// The topics of this server's clients and those forwarded to federated
+	// servers, each matched once
+	htable_t *topics = ht_create(sizeof(interest_t), interest_hash,
+									interest_equal);
+	add_topics(topics, srv->interest);
+	for (node_t *it = srv->fed.peers->head; it; it = it->next)
+		add_topics(topics, ((peer_t *)it->data)->interest);
+
+	struct sock_filter *prog = malloc(FILTER_MAX_INSNS *
+										sizeof(struct sock_filter));
+	DIE(!prog, "filter malloc() failed");
+
+	unsigned int len = 0;
+	bool fits = true;
+	for (unsigned int b = 0; b < topics->nbuckets && fits; ++b) {
+		for (node_t *it = topics->buckets[b]; it && fits; it = it->next)
+			fits = filter_topic(prog, &len, ((interest_t *)it->data)->topic.str);
+	}
+
+	// Datagrams matching no topic are dropped
+	if (fits) {
+		prog[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+		srv->filter.open = !filter_attach(srv, prog, len);
+	} else {
+		filter_open(srv);
+	}
+
+	free(prog);
+	ht_free(&topics);
+}
+
+void filter_update(server_t *srv, bool grow) {
+	filter_t *filter = &srv->filter;
+	uint64_t now = now_ms();
+
+	// Stays open while capturing
+	if (srv->capture)
+		return;
+
+	if (now >= filter->last + FILTER_INTERVAL) {
+		filter_build(srv);
+		return;
+	}
+
+	// New topics must not be dropped while waiting
+	if (grow && !filter->open)
+		filter_open(srv);
+
+	if (!timer_pending(&filter->rebuild))
+		timer_arm(&srv->wheel, &filter->rebuild,
+					filter->last + FILTER_INTERVAL);
+}
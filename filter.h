@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: EUPL-1.2 */
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include "server.h"
+
+// Minimum time between two rebuilds of the filter (ms)
+#define FILTER_INTERVAL 100
+
+// Maximum number of instructions of a classic BPF program (BPF_MAXINSNS)
+#define FILTER_MAX_INSNS 4096
+
+// Offset of the datagram's payload in the data seen by the filter (the UDP
+// header comes first)
+#define FILTER_PAYLOAD 8
+
+/**
+ * @brief Attaches the filter to the UDP socket, which drops all datagrams
+ * while no topic is subscribed to. While capturing (-w), all datagrams are
+ * accepted instead, and the filter is never rebuilt.
+ *
+ * @param srv Pointer to the server state
+ */
+void filter_init(server_t *srv);
+
+/**
+ * @brief Rebuilds the filter from the topics the clients of this server and
+ * of the federated servers are subscribed to. If they do not fit in a single
+ * program, the filter accepts all datagrams.
+ *
+ * @param srv Pointer to the server state
+ */
+void filter_build(server_t *srv);
+
+/**
+ * @brief Updates the filter after the subscribed topics changed. Rebuilds are
+ * at least FILTER_INTERVAL ms apart; until a delayed rebuild, a filter that
+ * must let new topics in accepts all datagrams, while one that lets too many
+ * in stays as it is.
+ *
+ * @param srv Pointer to the server state
+ * @param grow Whether topics may have been added
+ */
+void filter_update(server_t *srv, bool grow);
+
+#endif /* _FILTER_H_ */
@@ -0,0 +1,151 @@
+// SPDX-License-Identifier: EUPL-1.2
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "htable.h"
+#include "utils.h"
+
+// Number of buckets of a new hash table
+#define HT_INIT 16
+
+htable_t *ht_create(unsigned int data_size, ht_hash_t hash, ht_equal_t equal)
+{
+	htable_t *ht = malloc(sizeof(htable_t));
+	DIE(!ht, "hash table malloc() failed");
+
+	ht->buckets = calloc(HT_INIT, sizeof(node_t *));
+	DIE(!ht->buckets, "hash table buckets calloc() failed");
+
+	ht->nbuckets = HT_INIT;
+	ht->size = 0;
+	ht->data_size = data_size;
+	ht->hash = hash;
+	ht->equal = equal;
+
+	return ht;
+}
+
+// Doubles the number of buckets, moving the nodes to their new chains
+static void ht_grow(htable_t *ht)
+{
+	unsigned int nbuckets = ht->nbuckets * 2;
+	node_t **buckets = calloc(nbuckets, sizeof(node_t *));
+	DIE(!buckets, "hash table buckets calloc() failed");
+
+	for (unsigned int i = 0; i < ht->nbuckets; ++i) {
+		node_t *it = ht->buckets[i], *next;
+		while (it) {
+			next = it->next;
+
+			unsigned int b = ht->hash(it->data) & (nbuckets - 1);
+			it->next = buckets[b];
+			buckets[b] = it;
+
+			it = next;
+		}
+	}
+
+	free(ht->buckets);
+	ht->buckets = buckets;
+	ht->nbuckets = nbuckets;
+}
+
+void *ht_get(htable_t *ht, const void *key)
+{
+	node_t *it = ht->buckets[ht->hash(key) & (ht->nbuckets - 1)];
+	while (it) {
+		if (ht->equal(it->data, key))
+			return it->data;
+		it = it->next;
+	}
+
+	return NULL;
+}
+
+void *ht_put(htable_t *ht, const void *data)
+{
+	// Keeps the load factor under one
+	if (ht->size >= ht->nbuckets)
+		ht_grow(ht);
+
+	node_t *new = malloc(sizeof(node_t));
+	DIE(!new, "new node malloc() failed");
+
+	new->data = malloc(ht->data_size);
+	DIE(!new->data, "new node's data malloc() failed");
+	memcpy(new->data, data, ht->data_size);
+
+	// Adds the node to the head of its chain
+	unsigned int b = ht->hash(data) & (ht->nbuckets - 1);
+	new->next = ht->buckets[b];
+	ht->buckets[b] = new;
+	++ht->size;
+
+	return new->data;
+}
+
+bool ht_remove(htable_t *ht, const void *key)
+{
+	node_t **link = &ht->buckets[ht->hash(key) & (ht->nbuckets - 1)];
+	while (*link) {
+		node_t *it = *link;
+		if (ht->equal(it->data, key)) {
+			*link = it->next;
+			free(it->data);
+			free(it);
+			--ht->size;
+			return true;
+		}
+		link = &it->next;
+	}
+
+	return false;
+}
+
+void ht_clear(htable_t *ht)
+{
+	for (unsigned int i = 0; i < ht->nbuckets; ++i) {
+		node_t *it = ht->buckets[i], *next;
+		while (it) {
+			next = it->next;
+			free(it->data);
+			free(it);
+			it = next;
+		}
+		ht->buckets[i] = NULL;
+	}
+
+	ht->size = 0;
+}
+
+void ht_free(htable_t **ht)
+{
+	if (!(*ht))
+		return;
+
+	ht_clear(*ht);
+	free((*ht)->buckets);
+	free(*ht);
+	*ht = NULL;
+}
+
+size_t ht_mem(const htable_t *ht)
+{
+	return sizeof(htable_t) + ht->nbuckets * sizeof(node_t *) +
+			ht->size * (sizeof(node_t) + ht->data_size);
+}
+
+unsigned int ht_hash_bytes(const void *data, size_t len, unsigned int seed)
+{
+	const unsigned char *bytes = data;
+
+	for (size_t i = 0; i < len; ++i) {
+		seed ^= bytes[i];
+		seed *= 16777619u;
+	}
+
+	return seed;
+}
@@ -0,0 +1,109 @@
+/* SPDX-License-Identifier: EUPL-1.2 */
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#ifndef _HTABLE_H_
+#define _HTABLE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "list.h"
+
+// Hashes the key part of an entry
+typedef unsigned int (*ht_hash_t)(const void *data);
+
+// Checks whether two entries have the same key
+typedef bool (*ht_equal_t)(const void *a, const void *b);
+
+// A hash table with separate chaining
+// Entries are copied into the table, like the data of a linked list
+typedef struct htable_t {
+	node_t **buckets; // chains of entries
+	unsigned int nbuckets; // number of buckets (a power of two)
+	unsigned int size; // number of entries
+	unsigned int data_size; // size of each entry
+	ht_hash_t hash;
+	ht_equal_t equal;
+} htable_t;
+
+/**
+ * @brief Creates a new hash table.
+ *
+ * @param data_size The size of each entry.
+ * @param hash The function hashing the key of an entry.
+ * @param equal The function comparing the keys of two entries.
+ *
+ * @return A pointer to the newly created hash table.
+ */
+htable_t *ht_create(unsigned int data_size, ht_hash_t hash, ht_equal_t equal);
+
+/**
+ * @brief Looks up the entry with the same key as the given one.
+ *
+ * @param ht A pointer to the hash table.
+ * @param key An entry (only its key fields need to be set).
+ *
+ * @return A pointer to the stored entry, or NULL if it is not found.
+ */
+void *ht_get(htable_t *ht, const void *key);
+
+/**
+ * @brief Adds a copy of an entry to the hash table. The caller must make sure
+ * that no entry with the same key is already stored.
+ *
+ * @param ht A pointer to the hash table.
+ * @param data A pointer to the entry.
+ *
+ * @return A pointer to the stored copy.
+ */
+void *ht_put(htable_t *ht, const void *data);
+
+/**
+ * @brief Removes the entry with the same key as the given one.
+ *
+ * @param ht A pointer to the hash table.
+ * @param key An entry (only its key fields need to be set).
+ *
+ * @return True if an entry was removed, false otherwise.
+ */
+bool ht_remove(htable_t *ht, const void *key);
+
+/**
+ * @brief Removes all entries, keeping the table allocated.
+ *
+ * @param ht A pointer to the hash table.
+ */
+void ht_clear(htable_t *ht);
+
+/**
+ * @brief Frees the memory allocated for the hash table.
+ *
+ * @param ht A pointer to the pointer to the hash table.
+ */
+void ht_free(htable_t **ht);
+
+/**
+ * @brief Computes the memory used by a hash table: the table, its buckets, and
+ * the nodes and copies of its entries (as requested from the allocator).
+ *
+ * @param ht The hash table.
+ *
+ * @return The number of bytes.
+ */
+size_t ht_mem(const htable_t *ht);
+
+/**
+ * @brief Hashes a sequence of bytes (FNV-1a).
+ *
+ * @param data The bytes to hash.
+ * @param len The number of bytes.
+ * @param seed The initial hash value (chains several calls).
+ *
+ * @return The hash value.
+ */
+unsigned int ht_hash_bytes(const void *data, size_t len, unsigned int seed);
+
+// Initial value for ht_hash_bytes()
+#define HT_SEED 2166136261u
+
+#endif /* _HTABLE_H_ */
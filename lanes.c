@@ -0,0 +1,252 @@
+// SPDX-License-Identifier: EUPL-1.2
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "utils.h"
+#include "poll_funcs.h"
+#include "lanes.h"
+#include "mem.h"
+
+// Names of the priority classes, as printed
+static const char *prio_names[PRIO_CLASSES] = {"normal", "urgent", "bulk"};
+
+// The classes in the order they are drained, and their weights
+static const uint8_t drain_order[PRIO_CLASSES] = {PRIO_URGENT, PRIO_NORMAL,
+													PRIO_BULK};
+static const unsigned int drain_weight[PRIO_CLASSES] = {WEIGHT_URGENT,
+														WEIGHT_NORMAL,
+														WEIGHT_BULK};
+
+// Watches a client's connection for room to send, or stops doing so
+static void lanes_watch(server_t *srv, client_t *client, bool out) {
+	struct pollfd *pfd = &srv->pfds[srv->fds[client->socket].idx];
+	pfd->events = out ? POLLIN | POLLOUT : POLLIN;
+}
+
+// Sends as much of a message as the connection takes
+// Returns the number of bytes sent, or -1 if the connection failed.
+static ssize_t lane_write(client_t *client, const void *data, size_t len,
+							zc_buf_t *zc) {
+	ssize_t sent = 0;
+
+	if (len) {
+		int flags = (zc ? MSG_MORE : 0) | MSG_DONTWAIT | MSG_NOSIGNAL;
+		sent = send(client->socket, data, len, flags);
+		if (sent < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		if ((size_t)sent < len)
+			return sent;
+	}
+
+	if (!zc)
+		return sent;
+
+	ssize_t ret = zc_send(&client->zc, client->socket, zc);
+	return ret < 0 ? -1 : sent + ret;
+}
+
+bool lane_send(server_t *srv, client_t *client, uint8_t prio,
+				const void *data, size_t len, zc_buf_t *zc, uint64_t due) {
+	size_t total = len + (zc ? zc->len : 0);
+	ssize_t sent = 0;
+
+	// Nothing goes ahead of the messages already waiting
+	if (!client->out_len) {
+		sent = lane_write(client, data, len, zc);
+		if (sent < 0)
+			return false;
+
+		if (sent)
+			client->last_tx = now_ms();
+
+		if ((size_t)sent == total) {
+			lane_record(srv, prio, due, false);
+			return true;
+		}
+	}
+
+	// The client does not keep up
+	if (client->out_len + total > LANES_MAX)
+		return false;
+
+	// The message is copied whole, even if a part of it was sent already
+	out_msg_t *out = malloc(sizeof(out_msg_t) + total);
+	DIE(!out, "lane message malloc() failed");
+	if (len)
+		memcpy(out->data, data, len);
+	if (zc)
+		memcpy(out->data + len, zc->data, zc->len);
+	out->next = NULL;
+	out->due = due;
+	out->len = total;
+	out->sent = sent;
+
+	out_lane_t *lane = &client->lanes[prio];
+	if (lane->tail)
+		lane->tail->next = out;
+	else
+		lane->head = out;
+	lane->tail = out;
+
+	client->out_len += total;
+	mem_charge(srv, client, MEM_BUFFERS, sizeof(out_msg_t) + total);
+	lanes_watch(srv, client, true);
+
+	return true;
+}
+
+void lane_record(server_t *srv, uint8_t prio, uint64_t due, bool queued) {
+	if (!due)
+		return;
+
+	// Messages sent at once do not read the clock, which would cost as much
+	// as the send for every client of a fanout
+	lane_stats_t *stats = &srv->lanes[prio];
+	uint64_t lat = 0;
+	if (queued) {
+		uint64_t now = now_us();
+		lat = now > due ? now - due : 0;
+	}
+
+	// Bucket b holds the latencies of b significant bits
+	unsigned int bucket = lat ? 64 - __builtin_clzll(lat) : 0;
+	if (bucket >= LAT_BUCKETS)
+		bucket = LAT_BUCKETS - 1;
+
+	++stats->sent;
+	stats->queued += queued;
+	stats->total_us += lat;
+	if (lat > stats->max_us)
+		stats->max_us = lat;
+	++stats->hist[bucket];
+}
+
+// Picks the lane the next message is sent from
+// Returns its priority class, or EMPTY if all lanes are empty.
+static int lanes_next(client_t *client) {
+	// The message sent in part is finished first, whatever its class
+	for (int prio = 0; prio < PRIO_CLASSES; ++prio)
+		if (client->lanes[prio].head && client->lanes[prio].head->sent)
+			return prio;
+
+	// Each class sends up to its weight of messages, then gives way to the
+	// next one (which may be itself again, after a full round)
+	for (int i = 0; i <= PRIO_CLASSES; ++i) {
+		uint8_t prio = drain_order[client->lane];
+		if (client->quota && client->lanes[prio].head)
+			return prio;
+
+		client->lane = (client->lane + 1) % PRIO_CLASSES;
+		client->quota = drain_weight[client->lane];
+	}
+
+	return EMPTY;
+}
+
+bool lanes_flush(server_t *srv, client_t *client) {
+	bool fed = false;
+
+	while (true) {
+		// The stored messages are moved to the lanes in batches, so that the
+		// urgent ones are never stuck behind the whole backlog
+		if (client->replay && !fed && !client->lanes[PRIO_NORMAL].head &&
+			!client->lanes[PRIO_BULK].head) {
+			if (!backlog_feed(srv, client))
+				return false;
+			fed = true;
+		}
+
+		int prio = lanes_next(client);
+		if (prio == EMPTY)
+			break;
+
+		out_lane_t *lane = &client->lanes[prio];
+		out_msg_t *out = lane->head;
+		ssize_t ret = send(client->socket, out->data + out->sent,
+							out->len - out->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return false;
+		}
+
+		client->last_tx = now_ms();
+		out->sent += ret;
+		if (out->sent < out->len)
+			break;
+
+		lane->head = out->next;
+		if (!lane->head)
+			lane->tail = NULL;
+		client->out_len -= out->len;
+		mem_charge(srv, client, MEM_BUFFERS,
+					-(long)(sizeof(out_msg_t) + out->len));
+		lane_record(srv, prio, out->due, true);
+		free(out);
+
+		if (prio == drain_order[client->lane] && client->quota)
+			--client->quota;
+	}
+
+	// Waits for room as long as something is left to send
+	lanes_watch(srv, client, client->out_len || client->replay);
+
+	return true;
+}
+
+void lanes_clear(server_t *srv, client_t *client) {
+	for (int prio = 0; prio < PRIO_CLASSES; ++prio) {
+		out_lane_t *lane = &client->lanes[prio];
+		while (lane->head) {
+			out_msg_t *out = lane->head;
+			lane->head = out->next;
+			mem_charge(srv, client, MEM_BUFFERS,
+						-(long)(sizeof(out_msg_t) + out->len));
+			free(out);
+		}
+		lane->tail = NULL;
+	}
+
+	client->out_len = 0;
+	client->lane = 0;
+	client->quota = drain_weight[0];
+	client->replay = NULL;
+}
+
+// Finds the upper bound of the histogram bucket holding a percentile of the
+// latencies
+static uint64_t lat_percentile(const lane_stats_t *stats, unsigned int pct) {
+	unsigned long rank = (stats->sent * pct + 99) / 100;
+	unsigned long seen = 0;
+
+	for (int b = 0; b < LAT_BUCKETS && rank; ++b) {
+		seen += stats->hist[b];
+		if (seen >= rank) {
+			uint64_t bound = ((uint64_t)1 << b) - 1;
+			return bound < stats->max_us ? bound : stats->max_us;
+		}
+	}
+
+	return 0;
+}
+
+void lanes_print(server_t *srv) {
+	for (int i = 0; i < PRIO_CLASSES; ++i) {
+		uint8_t prio = drain_order[i];
+		const lane_stats_t *stats = &srv->lanes[prio];
+
+		printf("prio class=%s sent=%lu queued=%lu avg_us=%.1f p50_us=%lu "
+				"p99_us=%lu max_us=%lu\n", prio_names[prio], stats->sent,
+				stats->queued,
+				stats->sent ? (double)stats->total_us / stats->sent : 0.0,
+				(unsigned long)lat_percentile(stats, 50),
+				(unsigned long)lat_percentile(stats, 99),
+				(unsigned long)stats->max_us);
+	}
+}
@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: EUPL-1.2 */
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#ifndef _LANES_H_
+#define _LANES_H_
+
+#include "server.h"
+
+// Number of messages each class sends in turn while the lanes are drained,
+// in the drain order: urgent, normal, then bulk
+#define WEIGHT_URGENT 16
+#define WEIGHT_NORMAL 4
+#define WEIGHT_BULK 1
+
+// Maximum number of bytes waiting in a client's lanes, above which it is
+// disconnected as too slow
+#define LANES_MAX (16 << 20)
+
+// Number of stored messages moved to the lanes at once during a replay
+#define REPLAY_BATCH 64
+
+/**
+ * @brief Sends a message to a client's connection, without blocking. It goes
+ * straight to the socket while nothing is waiting in the client's lanes, and
+ * whatever does not fit waits in the lane of its priority class, until
+ * lanes_flush() sends it.
+ *
+ * @param srv Pointer to the server state
+ * @param client The client
+ * @param prio The message's priority class
+ * @param data The message (or the part of it that is copied)
+ * @param len The length of data
+ * @param zc The rest of the message, sent with MSG_ZEROCOPY, or NULL
+ * @param due When the message was ready to be sent (monotonic us), or 0 if
+ * it is not accounted for in the statistics (heartbeats and epochs)
+ *
+ * @return False if the connection failed, or if the client is too slow
+ */
+bool lane_send(server_t *srv, client_t *client, uint8_t prio,
+				const void *data, size_t len, zc_buf_t *zc, uint64_t due);
+
+/**
+ * @brief Accounts for a message delivered to a client in the latency
+ * statistics of its priority class. Only the messages that waited in a lane
+ * have a latency, the others count as sent at once.
+ *
+ * @param srv Pointer to the server state
+ * @param prio The priority class
+ * @param due When the message was ready to be sent (monotonic us), or 0 to
+ * skip it
+ * @param queued Whether it waited in a lane
+ */
+void lane_record(server_t *srv, uint8_t prio, uint64_t due, bool queued);
+
+/**
+ * @brief Sends the messages waiting in a client's lanes, once its connection
+ * has room for them. The message sent in part goes first, then each class
+ * sends up to its weight of messages in turn. During a replay, the next
+ * stored messages are moved to the lanes once the normal and bulk lanes are
+ * empty. POLLOUT is watched as long as something is left.
+ *
+ * @param srv Pointer to the server state
+ * @param client The client
+ *
+ * @return False if the connection failed
+ */
+bool lanes_flush(server_t *srv, client_t *client);
+
+/**
+ * @brief Frees the messages waiting in a client's lanes and ends its replay,
+ * when its connection is closed.
+ *
+ * @param srv Pointer to the server state
+ * @param client The client
+ */
+void lanes_clear(server_t *srv, client_t *client);
+
+/**
+ * @brief Prints the delivery statistics of each priority class: the number
+ * of messages sent, how many waited in a lane, and their latency (the
+ * percentiles are the upper bounds of their histogram buckets).
+ *
+ * @param srv Pointer to the server state
+ */
+void lanes_print(server_t *srv);
+
+#endif /* _LANES_H_ */
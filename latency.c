@@ -0,0 +1,248 @@
+// SPDX-License-Identifier: EUPL-1.2
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <getopt.h>
+
+#include "structs.h"
+#include "utils.h"
+
+// Topic the probes are published on
+#define PROBE_TOPIC "latency_probe"
+
+// How long to wait for a probe before counting it as lost (ms)
+#define PROBE_TIMEOUT 1000
+
+// Latency statistics of one phase (us)
+typedef struct stats_t {
+	unsigned int count;
+	unsigned int lost;
+	double min, avg, p50, p90, p99, max;
+} stats_t;
+
+// Gets the current time (monotonic, in ns)
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+// Connects to a server as a subscriber of the probe topic
+static int subscribe(struct sockaddr_in *addr) {
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	DIE(sock < 0, "socket() failed");
+
+	int optval = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(int));
+
+	int ret = connect(sock, (struct sockaddr *)addr, sizeof(*addr));
+	DIE(ret < 0, "connect() failed");
+
+	conn_packet_t conn;
+	memset(&conn, 0, CONNLEN);
+	snprintf(conn.id, IDSIZ, "lat%d", getpid() % 100000);
+	ret = send(sock, &conn, CONNLEN, 0);
+	DIE(ret < 0, "send() failed");
+
+	sub_packet_t pack;
+	memset(&pack, 0, PACKLEN);
+	pack.type = SUBSCRIBE;
+	strcpy(pack.topic, PROBE_TOPIC);
+	ret = send(sock, &pack, PACKLEN, 0);
+	DIE(ret < 0, "send() failed");
+
+	return sock;
+}
+
+// Disconnects from a server
+static void disconnect(int sub) {
+	sub_packet_t pack;
+	memset(&pack, 0, PACKLEN);
+	pack.type = EXIT;
+	send(sub, &pack, PACKLEN, 0);
+	close(sub);
+}
+
+// Sends probes to a server and waits for each of them on the subscriber's
+// connection, one at a time
+static stats_t run_phase(int sub, struct sockaddr_in *pub, unsigned int count,
+							unsigned int interval) {
+	int udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	DIE(udp_sock < 0, "udp socket() failed");
+
+	uint64_t *samples = malloc(count * sizeof(uint64_t));
+	DIE(!samples, "samples malloc() failed");
+
+	stats_t stats;
+	memset(&stats, 0, sizeof(stats_t));
+
+	struct pollfd pfd = { .fd = sub, .events = POLLIN };
+	tcp_msg_t msg;
+	uint64_t last_tx = now_ns();
+
+	for (unsigned int i = 0; i < count; ++i) {
+		// Keeps the subscriber's connection alive during long runs
+		if (now_ns() - last_tx >= HEARTBEAT_INTERVAL * 1000000ULL) {
+			sub_packet_t pack;
+			memset(&pack, 0, PACKLEN);
+			pack.type = HEARTBEAT;
+			send(sub, &pack, PACKLEN, 0);
+			last_tx = now_ns();
+		}
+
+		udp_msg_t probe;
+		memset(&probe, 0, sizeof(udp_msg_t));
+		strcpy(probe.topic, PROBE_TOPIC);
+		probe.type = STRING;
+
+		uint64_t sent = now_ns();
+		int len = snprintf(probe.content, CONTENTSIZ - 1, "%u %llu", i,
+							(unsigned long long)sent);
+
+		int ret = sendto(udp_sock, &probe, TOPICSIZ + len, 0,
+							(struct sockaddr *)pub, sizeof(*pub));
+		DIE(ret < 0, "sendto() failed");
+
+		// Waits for this probe, skipping late ones from previous iterations
+		// (and heartbeats)
+		bool got = false;
+		while (!got) {
+			ret = poll(&pfd, 1, PROBE_TIMEOUT);
+			DIE(ret < 0, "poll() failed");
+			if (!ret)
+				break;
+
+			ret = recv(sub, &msg, sizeof(tcp_msg_t), MSG_WAITALL);
+			DIE(ret <= 0, "recv() failed");
+
+			unsigned int seq;
+			if (sscanf(msg.content, "%u", &seq) == 1 && seq == i) {
+				samples[stats.count++] = now_ns() - sent;
+				got = true;
+			}
+		}
+
+		if (!got)
+			++stats.lost;
+
+		if (interval)
+			usleep(interval);
+	}
+
+	if (stats.count) {
+		qsort(samples, stats.count, sizeof(uint64_t), cmp_u64);
+
+		double sum = 0;
+		for (unsigned int i = 0; i < stats.count; ++i)
+			sum += samples[i];
+
+		stats.min = samples[0] / 1e3;
+		stats.avg = sum / stats.count / 1e3;
+		stats.p50 = samples[stats.count * 50 / 100] / 1e3;
+		stats.p90 = samples[stats.count * 90 / 100] / 1e3;
+		stats.p99 = samples[stats.count * 99 / 100] / 1e3;
+		stats.max = samples[stats.count - 1] / 1e3;
+	}
+
+	free(samples);
+	close(udp_sock);
+
+	return stats;
+}
+
+static void print_stats(const char *phase, stats_t *stats) {
+	printf("%s count=%u lost=%u min_us=%.1f avg_us=%.1f p50_us=%.1f "
+			"p90_us=%.1f p99_us=%.1f max_us=%.1f\n", phase, stats->count,
+			stats->lost, stats->min, stats->avg, stats->p50, stats->p90,
+			stats->p99, stats->max);
+}
+
+int main(int argc, char **argv) {
+	unsigned int count = 10000, interval = 0, busy_port = 0;
+
+	// Parses the options
+	// -n <COUNT>: number of probes per phase
+	// -i <US>: pause between two probes
+	// -b <PORT>: port of a server in busy-poll mode, compared with the first
+	// one (in blocking mode)
+	int opt;
+	while ((opt = getopt(argc, argv, "n:i:b:")) != -1) {
+		DIE(opt == '?', "Invalid option (argv).");
+		if (opt == 'n')
+			count = atoi(optarg);
+		else if (opt == 'i')
+			interval = atoi(optarg);
+		else if (opt == 'b')
+			busy_port = atoi(optarg);
+	}
+
+	// Checks if there are enough arguments
+	// (the server's IP, the subscriber's server port and, optionally, the
+	// port of a federated server the probes are published to)
+	DIE(argc - optind < 2 || !count, "Usage: ./latency [-n COUNT] [-i US] "
+		"[-b BUSY_PORT] <IP> <PORT> [PEER_PORT]");
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(argv[optind + 1]));
+	DIE(!inet_aton(argv[optind], &addr.sin_addr), "Invalid IP (argv).");
+
+	int sub = subscribe(&addr);
+
+	// Leaves time for the subscription to reach the federated servers
+	usleep(200000);
+
+	// Publishes to the subscriber's server
+	stats_t direct = run_phase(sub, &addr, count, interval);
+	print_stats("direct", &direct);
+
+	// Publishes to a federated server, adding one hop between servers
+	if (argc - optind > 2) {
+		struct sockaddr_in peer = addr;
+		peer.sin_port = htons(atoi(argv[optind + 2]));
+
+		stats_t hop = run_phase(sub, &peer, count, interval);
+		print_stats("federated", &hop);
+
+		printf("hop p50_us=%.1f p99_us=%.1f\n", hop.p50 - direct.p50,
+				hop.p99 - direct.p99);
+	}
+
+	// Publishes to a server in busy-poll mode, through its own subscriber
+	if (busy_port) {
+		struct sockaddr_in busy_addr = addr;
+		busy_addr.sin_port = htons(busy_port);
+
+		int busy_sub = subscribe(&busy_addr);
+		usleep(200000);
+
+		stats_t busy = run_phase(busy_sub, &busy_addr, count, interval);
+		print_stats("busy", &busy);
+
+		printf("busy_vs_blocking p50_us=%.1f p99_us=%.1f\n",
+				busy.p50 - direct.p50, busy.p99 - direct.p99);
+
+		disconnect(busy_sub);
+	}
+
+	disconnect(sub);
+
+	return 0;
+}
@@ -44,6 +44,26 @@ void list_add_head(list_t* list, void* new_data)
 	list->head = new;
 }
 
+void list_remove(list_t* list, void* data)
+{
+	// If list is NULL, returns.
+	if (!list)
+		return;
+
+	// Searches for the node, keeping the link that points to it.
+	node_t **link = &list->head;
+	while (*link && (*link)->data != data)
+		link = &(*link)->next;
+
+	// If the node was found, unlinks it and frees it and its data.
+	if (*link) {
+		node_t *it = *link;
+		*link = it->next;
+		free(it->data);
+		free(it);
+	}
+}
+
 void list_free(list_t** list)
 {
 	// If the list is NULL, returns.
@@ -33,6 +33,14 @@ list_t* list_create(unsigned int data_size);
  */
 void list_add_head(list_t* list, void* new_data);
 
+/**
+ * @brief Removes the node holding the specified data from the list.
+ *
+ * @param list A pointer to the list.
+ * @param data A pointer to the data of the node (as stored in the list).
+ */
+void list_remove(list_t* list, void* data);
+
 /**
  * @brief Frees the memory allocated for the list.
  *
@@ -0,0 +1,144 @@
+// SPDX-License-Identifier: EUPL-1.2
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+
+// Names of the subsystems, as printed
+static const char *mem_names[MEM_KINDS] = {"clients", "subs", "backlog",
+											"buffers"};
+
+void mem_charge(server_t *srv, client_t *client, int kind, long delta) {
+	srv->mem.used[kind] += delta;
+	if (client)
+		client->mem[kind] += delta;
+}
+
+void mem_charge_ht(server_t *srv, client_t *client, int kind, size_t before,
+					const htable_t *ht) {
+	mem_charge(srv, client, kind, (long)ht_mem(ht) - (long)before);
+}
+
+size_t mem_total(const size_t *used) {
+	size_t total = 0;
+	for (int i = 0; i < MEM_KINDS; ++i)
+		total += used[i];
+
+	return total;
+}
+
+bool mem_admit(server_t *srv) {
+	return !srv->mem.cap ||
+			mem_total(srv->mem.used) < srv->mem.cap / 100 * MEM_ADMIT;
+}
+
+// Finds the client with the most memory used by stored messages
+static client_t *largest_backlog(server_t *srv) {
+	client_t *largest = NULL;
+
+	for (node_t *it = srv->clients->head; it; it = it->next) {
+		client_t *client = it->data;
+		if (client->unsent && (!largest ||
+			client->mem[MEM_BACKLOG] > largest->mem[MEM_BACKLOG]))
+			largest = client;
+	}
+
+	return largest;
+}
+
+bool mem_store(server_t *srv, size_t need) {
+	size_t cap = srv->mem.cap;
+	if (!cap || mem_total(srv->mem.used) + need <= cap)
+		return true;
+
+	if (srv->mem.policy == MEM_REFUSE) {
+		++srv->mem.refused;
+		return false;
+	}
+
+	// Makes some room at once, so that the next messages fit too
+	size_t target = cap / 100 * MEM_SHED_TARGET;
+	while (mem_total(srv->mem.used) + need > target) {
+		client_t *victim = largest_backlog(srv);
+		if (!victim)
+			break;
+
+		backlog_pop(srv, victim);
+		++srv->mem.shed;
+	}
+
+	// Only the other subsystems are left
+	if (mem_total(srv->mem.used) + need > cap) {
+		++srv->mem.refused;
+		return false;
+	}
+
+	return true;
+}
+
+size_t mem_parse(const char *str) {
+	char *end;
+	unsigned long long bytes = strtoull(str, &end, 10);
+
+	if (*end == 'K' || *end == 'k')
+		bytes <<= 10;
+	else if (*end == 'M' || *end == 'm')
+		bytes <<= 20;
+	else if (*end == 'G' || *end == 'g')
+		bytes <<= 30;
+	else if (*end)
+		return 0;
+
+	if (*end && end[1])
+		return 0;
+
+	return bytes;
+}
+
+// Prints the memory used by each subsystem
+static void print_used(const size_t *used) {
+	printf(" total=%zu", mem_total(used));
+	for (int i = 0; i < MEM_KINDS; ++i)
+		printf(" %s=%zu", mem_names[i], used[i]);
+}
+
+void mem_print(server_t *srv) {
+	printf("mem");
+	print_used(srv->mem.used);
+	printf(" cap=%zu shed=%lu refused=%lu rejected_clients=%lu "
+			"rejected_subs=%lu\n", srv->mem.cap, srv->mem.shed,
+			srv->mem.refused, srv->mem.rejected_clients,
+			srv->mem.rejected_subs);
+
+	// Keeps the clients using the most memory, largest first
+	client_t *top[MEM_TOP];
+	size_t top_used[MEM_TOP];
+	int ntop = 0;
+
+	for (node_t *it = srv->clients->head; it; it = it->next) {
+		client_t *client = it->data;
+		size_t used = mem_total(client->mem);
+
+		int pos = ntop < MEM_TOP ? ntop++ : MEM_TOP;
+		while (pos > 0 && top_used[pos - 1] < used) {
+			if (pos < MEM_TOP) {
+				top[pos] = top[pos - 1];
+				top_used[pos] = top_used[pos - 1];
+			}
+			--pos;
+		}
+		if (pos < MEM_TOP) {
+			top[pos] = client;
+			top_used[pos] = used;
+		}
+	}
+
+	for (int i = 0; i < ntop; ++i) {
+		printf("mem client=%s online=%d", top[i]->id, top[i]->online);
+		print_used(top[i]->mem);
+		printf("\n");
+	}
+}
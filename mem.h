@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: EUPL-1.2 */
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#ifndef _MEM_H_
+#define _MEM_H_
+
+#include "server.h"
+
+// Share of the cap (%) from which new clients and subscriptions are refused
+#define MEM_ADMIT 90
+
+// Share of the cap (%) down to which stored messages are shed, so that the
+// largest backlog is not searched for every new message
+#define MEM_SHED_TARGET 95
+
+// Number of clients using the most memory that the "mem" command prints
+#define MEM_TOP 10
+
+/**
+ * @brief Accounts for memory allocated (or freed, if negative) by a
+ * subsystem.
+ *
+ * @param srv Pointer to the server state
+ * @param client The client it is used for, or NULL if it is shared
+ * @param kind The subsystem (MEM_CLIENTS to MEM_BUFFERS)
+ * @param delta The number of bytes
+ */
+void mem_charge(server_t *srv, client_t *client, int kind, long delta);
+
+/**
+ * @brief Accounts for the change in size of a hash table.
+ *
+ * @param srv Pointer to the server state
+ * @param client The client it is used for, or NULL if it is shared
+ * @param kind The subsystem
+ * @param before The memory used by the table before the change (ht_mem())
+ * @param ht The hash table
+ */
+void mem_charge_ht(server_t *srv, client_t *client, int kind, size_t before,
+					const htable_t *ht);
+
+/**
+ * @brief Computes the memory used by all subsystems.
+ *
+ * @param used The bytes used, per subsystem
+ *
+ * @return The number of bytes.
+ */
+size_t mem_total(const size_t *used);
+
+/**
+ * @brief Checks whether a new client or subscription may be admitted, which
+ * is the case until MEM_ADMIT percent of the cap is used.
+ *
+ * @param srv Pointer to the server state
+ *
+ * @return True if it may be admitted
+ */
+bool mem_admit(server_t *srv);
+
+/**
+ * @brief Makes room for a message to store, shedding the oldest messages of
+ * the largest backlogs with the MEM_SHED policy.
+ *
+ * @param srv Pointer to the server state
+ * @param need The size of the stored message
+ *
+ * @return True if the message may be stored
+ */
+bool mem_store(server_t *srv, size_t need);
+
+/**
+ * @brief Parses a number of bytes, optionally followed by a K, M or G
+ * suffix.
+ *
+ * @param str The string
+ *
+ * @return The number of bytes, 0 if invalid
+ */
+size_t mem_parse(const char *str);
+
+/**
+ * @brief Prints the memory used by each subsystem, the admission control
+ * counters and the clients using the most memory.
+ *
+ * @param srv Pointer to the server state
+ */
+void mem_print(server_t *srv);
+
+#endif /* _MEM_H_ */
@@ -0,0 +1,708 @@
+// SPDX-License-Identifier: EUPL-1.2
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#include <sys/random.h>
+#include <poll.h>
+
+#include "structs.h"
+#include "list.h"
+#include "htable.h"
+#include "utils.h"
+#include "poll_funcs.h"
+#include "server.h"
+#include "peer.h"
+#include "filter.h"
+#include "mem.h"
+
+// Size of the header of a data batch: the frame header, the origin node ID
+// and the number of messages
+#define DATA_HDR (PEER_HDR + 4 + 2)
+
+// Size of the header of a message in a data batch: the publisher's IP and
+// port, the content type, the topic's length and the content's length
+#define ENTRY_HDR (4 + 2 + 1 + 1 + 2)
+
+// Size of the buffer the data frame being built is kept in
+#define PEER_TX_SIZE (PEER_BATCH + ENTRY_HDR + TOPICSIZ + CONTENTSIZ)
+
+// Watches a federation link for room to send, or stops doing so
+static void peer_watch(server_t *srv, peer_t *peer, bool out) {
+	struct pollfd *pfd = &srv->pfds[srv->fds[peer->socket].idx];
+	pfd->events = out ? POLLIN | POLLOUT : POLLIN;
+}
+
+// Sends a buffer on a federation link, without blocking. It goes straight to
+// the socket while nothing is waiting, and what does not fit waits in the
+// link's transmit queue until fed_event() sees room for it.
+// Returns false if the link failed, or if the peer does not keep up.
+static bool peer_write(server_t *srv, peer_t *peer, const void *buf,
+						size_t len) {
+	size_t sent = 0;
+
+	// Nothing goes ahead of the bytes already waiting
+	if (peer->out_pos == peer->out_len) {
+		ssize_t ret = send(peer->socket, buf, len,
+							MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			return false;
+
+		sent = ret < 0 ? 0 : ret;
+		if (sent == len)
+			return true;
+
+		peer->out_pos = 0;
+		peer->out_len = 0;
+	}
+
+	size_t rest = len - sent;
+	if (peer->out_len - peer->out_pos + rest > PEER_OUT_MAX)
+		return false;
+
+	// Moves the unsent bytes to the start of the queue, then grows it if
+	// they still do not fit
+	if (peer->out_len + rest > peer->out_cap) {
+		memmove(peer->out, peer->out + peer->out_pos,
+				peer->out_len - peer->out_pos);
+		peer->out_len -= peer->out_pos;
+		peer->out_pos = 0;
+	}
+
+	if (peer->out_len + rest > peer->out_cap) {
+		size_t cap = peer->out_cap ? 2 * peer->out_cap : 4 * PEER_BATCH;
+		while (cap < peer->out_len + rest)
+			cap *= 2;
+
+		peer->out = realloc(peer->out, cap);
+		DIE(!peer->out, "peer out realloc() failed");
+		mem_charge(srv, NULL, MEM_BUFFERS, cap - peer->out_cap);
+		peer->out_cap = cap;
+	}
+
+	memcpy(peer->out + peer->out_len, (const uint8_t *)buf + sent, rest);
+	peer->out_len += rest;
+	peer_watch(srv, peer, true);
+
+	return true;
+}
+
+// Sends the bytes waiting in a link's transmit queue, once it has room
+// Returns false if the link failed.
+static bool peer_drain(server_t *srv, peer_t *peer) {
+	while (peer->out_pos < peer->out_len) {
+		ssize_t ret = send(peer->socket, peer->out + peer->out_pos,
+							peer->out_len - peer->out_pos,
+							MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+			return false;
+		}
+
+		peer->out_pos += ret;
+	}
+
+	peer->out_pos = 0;
+	peer->out_len = 0;
+	peer_watch(srv, peer, false);
+
+	return true;
+}
+
+// Writes a frame header at the start of a buffer
+static void put_hdr(uint8_t *buf, size_t len, uint8_t kind) {
+	uint32_t net_len = htonl(len - 4);
+	memcpy(buf, &net_len, sizeof(uint32_t));
+	buf[4] = kind;
+}
+
+// Checks whether the federation link is established
+static bool peer_up(peer_t *peer) {
+	return peer->socket != EMPTY && !peer->connecting;
+}
+
+// Adds a federated server to the list, returning the stored copy
+static peer_t *peer_new(server_t *srv, bool outgoing) {
+	peer_t new;
+	memset(&new, 0, sizeof(peer_t));
+	new.outgoing = outgoing;
+	new.socket = EMPTY;
+	new.interest = ht_create(sizeof(interest_t), interest_hash,
+								interest_equal);
+	new.tx = malloc(PEER_TX_SIZE);
+	DIE(!new.tx, "peer tx malloc() failed");
+	mem_charge(srv, NULL, MEM_SUBS, ht_mem(new.interest));
+	mem_charge(srv, NULL, MEM_BUFFERS, PEER_TX_SIZE);
+
+	list_add_head(srv->fed.peers, &new);
+
+	return srv->fed.peers->head->data;
+}
+
+// Closes a federation link. Outgoing links are reconnected later, the others
+// are forgotten.
+static void peer_down(server_t *srv, peer_t *peer) {
+	if (peer->socket != EMPTY) {
+		unwatch_socket(srv, peer->socket);
+		close(peer->socket);
+	}
+
+	peer->socket = EMPTY;
+	peer->connecting = false;
+	peer->rx_len = 0;
+	peer->tx_len = 0;
+	peer->tx_count = 0;
+	peer->out_pos = 0;
+	peer->out_len = 0;
+
+	// The topics the peer needed may now be dropped by the UDP socket filter
+	if (peer->interest->size) {
+		size_t before = ht_mem(peer->interest);
+		ht_clear(peer->interest);
+		mem_charge_ht(srv, NULL, MEM_SUBS, before, peer->interest);
+		filter_update(srv, false);
+	}
+
+	if (peer->outgoing) {
+		peer->retry = now_ms() + PEER_RETRY_MS;
+		return;
+	}
+
+	mem_charge(srv, NULL, MEM_SUBS, -(long)ht_mem(peer->interest));
+	mem_charge(srv, NULL, MEM_BUFFERS,
+				-(long)(peer->rx_cap + PEER_TX_SIZE + peer->out_cap));
+	ht_free(&peer->interest);
+	free(peer->rx);
+	free(peer->tx);
+	free(peer->out);
+	list_remove(srv->fed.peers, peer);
+}
+
+// Sends the interest of this server, in frames of at most PEER_BATCH bytes
+static bool peer_send_interest(server_t *srv, peer_t *peer) {
+	uint8_t *frame = malloc(PEER_BATCH + TOPICSIZ);
+	DIE(!frame, "interest frame malloc() failed");
+
+	uint8_t kind = PEER_INTEREST;
+	size_t len = PEER_HDR;
+	bool ok = true;
+
+	for (unsigned int b = 0; b < srv->interest->nbuckets && ok; ++b) {
+		for (node_t *it = srv->interest->buckets[b]; it; it = it->next) {
+			interest_t *entry = it->data;
+			size_t topic_len = key_len(&entry->topic);
+
+			frame[len++] = topic_len;
+			memcpy(frame + len, entry->topic.str, topic_len);
+			len += topic_len;
+
+			// The next topics are added by another frame
+			if (len >= PEER_BATCH) {
+				put_hdr(frame, len, kind);
+				ok = peer_write(srv, peer, frame, len);
+				kind = PEER_INTEREST_MORE;
+				len = PEER_HDR;
+				if (!ok)
+					break;
+			}
+		}
+	}
+
+	// The first frame is always sent, since it clears the previous interest
+	if (ok && (len > PEER_HDR || kind == PEER_INTEREST)) {
+		put_hdr(frame, len, kind);
+		ok = peer_write(srv, peer, frame, len);
+	}
+
+	free(frame);
+	return ok;
+}
+
+// Sends the pending data batch
+static bool peer_send_batch(server_t *srv, peer_t *peer) {
+	if (!peer->tx_count)
+		return true;
+
+	put_hdr(peer->tx, peer->tx_len, PEER_DATA);
+
+	uint32_t origin = htonl(srv->fed.node);
+	memcpy(peer->tx + PEER_HDR, &origin, sizeof(uint32_t));
+
+	uint16_t count = htons(peer->tx_count);
+	memcpy(peer->tx + PEER_HDR + 4, &count, sizeof(uint16_t));
+
+	bool ok = peer_write(srv, peer, peer->tx, peer->tx_len);
+	peer->tx_len = 0;
+	peer->tx_count = 0;
+
+	return ok;
+}
+
+// Starts the exchange on an established link: the connection packet (for
+// outgoing links), the node ID and the interest of this server
+static void peer_link_up(server_t *srv, peer_t *peer) {
+	bool ok = true;
+
+	if (peer->outgoing) {
+		conn_packet_t conn;
+		memset(&conn, 0, CONNLEN);
+		snprintf(conn.id, IDSIZ, "%08x", srv->fed.node);
+		conn.flags = CONN_PEER;
+		ok = peer_write(srv, peer, &conn, CONNLEN);
+	}
+
+	uint8_t hello[PEER_HDR + 4];
+	put_hdr(hello, sizeof(hello), PEER_HELLO);
+	uint32_t node = htonl(srv->fed.node);
+	memcpy(hello + PEER_HDR, &node, sizeof(uint32_t));
+
+	ok = ok && peer_write(srv, peer, hello, sizeof(hello));
+	ok = ok && peer_send_interest(srv, peer);
+
+	if (!ok)
+		peer_down(srv, peer);
+}
+
+// Starts a non-blocking connection to an outgoing federated server
+static void peer_connect(server_t *srv, peer_t *peer) {
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	DIE(sock < 0, "peer socket() failed");
+
+	// The pollfd array is full, tries again later
+	if (sock >= MAX_PFDS || srv->nfds == MAX_PFDS) {
+		close(sock);
+		peer->retry = now_ms() + PEER_RETRY_MS;
+		return;
+	}
+
+	// Sets TCP_NODELAY socket option to disable the Nagle algorithm
+	int optval = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(int));
+
+	peer->socket = sock;
+	peer->connecting = true;
+
+	int ret = connect(sock, (struct sockaddr *)&peer->addr,
+						sizeof(struct sockaddr_in));
+	if (ret < 0 && errno != EINPROGRESS) {
+		close(sock);
+		peer->socket = EMPTY;
+		peer->connecting = false;
+		peer->retry = now_ms() + PEER_RETRY_MS;
+		return;
+	}
+
+	// Waits for the connection to be established
+	watch_socket(srv, sock, FD_PEER, peer);
+	srv->pfds[srv->fds[sock].idx].events = POLLOUT;
+}
+
+// Checks whether another link to the same node is established
+static bool peer_shadowed(server_t *srv, peer_t *peer) {
+	if (!peer->node)
+		return false;
+
+	for (node_t *it = srv->fed.peers->head; it; it = it->next) {
+		peer_t *other = it->data;
+		if (other != peer && peer_up(other) && other->node == peer->node)
+			return true;
+	}
+
+	return false;
+}
+
+// Handles the hello of a federated server, dropping links to this server
+// and duplicate links. Returns false if the link was closed.
+static bool peer_hello(server_t *srv, peer_t *peer, uint32_t node) {
+	peer->node = node;
+
+	// A link to this server itself
+	if (node == srv->fed.node) {
+		bool outgoing = peer->outgoing;
+		peer_down(srv, peer);
+		if (outgoing)
+			peer->retry = UINT64_MAX;
+		return false;
+	}
+
+	for (node_t *it = srv->fed.peers->head; it; it = it->next) {
+		peer_t *other = it->data;
+		if (other == peer || !peer_up(other) || other->node != node)
+			continue;
+
+		// Both servers keep the link initiated by the lower node ID (and the
+		// older one, if both were initiated by the same server)
+		uint32_t mine = peer->outgoing ? srv->fed.node : node;
+		uint32_t theirs = other->outgoing ? srv->fed.node : node;
+
+		if (mine < theirs) {
+			peer_down(srv, other);
+			return true;
+		}
+
+		peer_down(srv, peer);
+		return false;
+	}
+
+	return true;
+}
+
+// Handles a batch of messages published to a federated server
+static bool peer_data(server_t *srv, const uint8_t *body, size_t len) {
+	if (len < 6)
+		return false;
+
+	uint32_t origin;
+	memcpy(&origin, body, sizeof(uint32_t));
+
+	// Messages published to this server never come back to it
+	if (ntohl(origin) == srv->fed.node)
+		return true;
+
+	uint16_t count;
+	memcpy(&count, body + 4, sizeof(uint16_t));
+	count = ntohs(count);
+
+	size_t pos = 6;
+	for (uint16_t i = 0; i < count; ++i) {
+		if (len - pos < ENTRY_HDR)
+			return false;
+
+		msg_t msg;
+		memset(&msg.addr, 0, sizeof(struct sockaddr_in));
+		msg.addr.sin_family = AF_INET;
+		memcpy(&msg.addr.sin_addr.s_addr, body + pos, sizeof(uint32_t));
+		memcpy(&msg.addr.sin_port, body + pos + 4, sizeof(uint16_t));
+		msg.type = body[pos + 6];
+
+		size_t topic_len = body[pos + 7];
+		uint16_t content;
+		memcpy(&content, body + pos + 8, sizeof(uint16_t));
+		content = ntohs(content);
+		pos += ENTRY_HDR;
+
+		if (topic_len > TOPICSIZ - 1 || content > CONTENTSIZ - 1 ||
+			len - pos < topic_len + content)
+			return false;
+
+		key_set(&msg.topic, (const char *)body + pos, topic_len);
+		pos += topic_len;
+
+		msg.len = content;
+		memcpy(msg.content, body + pos, content);
+		pos += content;
+
+		route_msg(srv, &msg, true);
+	}
+
+	return true;
+}
+
+// Handles a list of topics the clients of a federated server subscribed to
+static bool peer_interest(server_t *srv, peer_t *peer, const uint8_t *body,
+							size_t len, bool replace) {
+	size_t before = ht_mem(peer->interest);
+	if (replace)
+		ht_clear(peer->interest);
+
+	size_t pos = 0;
+	while (pos < len) {
+		size_t topic_len = body[pos++];
+		if (topic_len > TOPICSIZ - 1 || len - pos < topic_len) {
+			mem_charge_ht(srv, NULL, MEM_SUBS, before, peer->interest);
+			return false;
+		}
+
+		interest_t entry;
+		memset(&entry, 0, sizeof(interest_t));
+		memcpy(entry.topic.str, body + pos, topic_len);
+		pos += topic_len;
+
+		if (!ht_get(peer->interest, &entry))
+			ht_put(peer->interest, &entry);
+	}
+
+	mem_charge_ht(srv, NULL, MEM_SUBS, before, peer->interest);
+	return true;
+}
+
+// Receives frames from a federated server. Returns false if the link was
+// closed.
+static bool peer_recv(server_t *srv, peer_t *peer) {
+	// Makes room for at least one more read
+	if (peer->rx_cap - peer->rx_len < BUFSIZ) {
+		size_t cap = peer->rx_cap ? 2 * peer->rx_cap : 4 * BUFSIZ;
+		mem_charge(srv, NULL, MEM_BUFFERS, cap - peer->rx_cap);
+		peer->rx_cap = cap;
+		peer->rx = realloc(peer->rx, peer->rx_cap);
+		DIE(!peer->rx, "peer rx realloc() failed");
+	}
+
+	int ret = recv(peer->socket, peer->rx + peer->rx_len,
+					peer->rx_cap - peer->rx_len, 0);
+
+	// A spurious wakeup or a signal is not a failure of the link
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return true;
+	if (ret <= 0) {
+		peer_down(srv, peer);
+		return false;
+	}
+	peer->rx_len += ret;
+
+	// Handles all complete frames
+	size_t pos = 0;
+	while (peer->rx_len - pos >= PEER_HDR) {
+		uint32_t len;
+		memcpy(&len, peer->rx + pos, sizeof(uint32_t));
+		len = ntohl(len);
+
+		if (!len || len > PEER_FRAME_MAX) {
+			peer_down(srv, peer);
+			return false;
+		}
+		if (peer->rx_len - pos < 4 + len)
+			break;
+
+		uint8_t kind = peer->rx[pos + 4];
+		const uint8_t *body = peer->rx + pos + PEER_HDR;
+		size_t body_len = len - 1;
+		pos += 4 + len;
+
+		bool ok = true;
+		if (kind == PEER_HELLO) {
+			uint32_t node;
+			ok = body_len == sizeof(uint32_t);
+			if (ok) {
+				memcpy(&node, body, sizeof(uint32_t));
+				if (!peer_hello(srv, peer, ntohl(node)))
+					return false;
+			}
+		} else if (kind == PEER_INTEREST || kind == PEER_INTEREST_MORE) {
+			ok = peer_interest(srv, peer, body, body_len,
+								kind == PEER_INTEREST);
+			if (ok)
+				filter_update(srv, true);
+		} else if (kind == PEER_DATA) {
+			ok = peer_data(srv, body, body_len);
+		}
+
+		if (!ok) {
+			peer_down(srv, peer);
+			return false;
+		}
+	}
+
+	// Keeps the incomplete frame for the next call
+	memmove(peer->rx, peer->rx + pos, peer->rx_len - pos);
+	peer->rx_len -= pos;
+
+	// Grows the buffer if the incomplete frame does not fit
+	if (peer->rx_len >= PEER_HDR) {
+		uint32_t len;
+		memcpy(&len, peer->rx, sizeof(uint32_t));
+		size_t need = 4 + ntohl(len);
+		if (need > peer->rx_cap) {
+			mem_charge(srv, NULL, MEM_BUFFERS, need - peer->rx_cap);
+			peer->rx_cap = need;
+			peer->rx = realloc(peer->rx, peer->rx_cap);
+			DIE(!peer->rx, "peer rx realloc() failed");
+		}
+	}
+
+	return true;
+}
+
+void fed_init(server_t *srv) {
+	srv->fed.peers = list_create(sizeof(peer_t));
+	srv->fed.dirty = false;
+
+	// The node ID marks the messages published to this server
+	do {
+		int ret = getrandom(&srv->fed.node, sizeof(uint32_t), 0);
+		DIE(ret < 0, "getrandom() failed");
+	} while (!srv->fed.node);
+}
+
+void fed_add_peer(server_t *srv, const char *addr) {
+	char ip[IPV4_LEN];
+
+	// Splits <IP>:<PORT>
+	const char *colon = strchr(addr, ':');
+	DIE(!colon || colon - addr >= IPV4_LEN, "Invalid peer address (argv).");
+	memcpy(ip, addr, colon - addr);
+	ip[colon - addr] = '\0';
+
+	peer_t *peer = peer_new(srv, true);
+	peer->addr.sin_family = AF_INET;
+	peer->addr.sin_port = htons(atoi(colon + 1));
+	DIE(!inet_aton(ip, &peer->addr.sin_addr), "Invalid peer address (argv).");
+
+	// Connects on the first tick
+	peer->retry = 0;
+}
+
+void fed_accept(server_t *srv, int socket) {
+	peer_t *peer = peer_new(srv, false);
+	peer->socket = socket;
+
+	// The socket is already polled, since its handshake
+	srv->fds[socket].kind = FD_PEER;
+	srv->fds[socket].ptr = peer;
+
+	peer_link_up(srv, peer);
+}
+
+peer_t *fed_find(server_t *srv, int socket) {
+	if (srv->fds[socket].kind != FD_PEER)
+		return NULL;
+
+	return srv->fds[socket].ptr;
+}
+
+void fed_event(server_t *srv, peer_t *peer, short revents) {
+	// The non-blocking connect() finished
+	if (peer->connecting) {
+		int err = 0;
+		socklen_t len = sizeof(int);
+		getsockopt(peer->socket, SOL_SOCKET, SO_ERROR, &err, &len);
+
+		if (err) {
+			peer_down(srv, peer);
+			return;
+		}
+
+		peer_watch(srv, peer, false);
+		peer->connecting = false;
+
+		peer_link_up(srv, peer);
+		return;
+	}
+
+	// Sends what waited for room on the link
+	if (revents & POLLOUT && !peer_drain(srv, peer)) {
+		peer_down(srv, peer);
+		return;
+	}
+
+	if (revents & (POLLIN | POLLHUP | POLLERR))
+		peer_recv(srv, peer);
+}
+
+void fed_forward(server_t *srv, const msg_t *msg) {
+	interest_t key;
+	key.topic = msg->topic;
+
+	size_t topic_len = key_len(&msg->topic);
+
+	node_t *it = srv->fed.peers->head, *next;
+	for (; it; it = next) {
+		next = it->next;
+		peer_t *peer = it->data;
+
+		if (!peer_up(peer) || !ht_get(peer->interest, &key))
+			continue;
+
+		// Sends the batch early if it is full
+		if (peer->tx_len >= PEER_BATCH || peer->tx_count == UINT16_MAX) {
+			if (!peer_send_batch(srv, peer)) {
+				peer_down(srv, peer);
+				continue;
+			}
+		}
+
+		// Leaves room for the header
+		if (!peer->tx_len)
+			peer->tx_len = DATA_HDR;
+
+		uint8_t *entry = peer->tx + peer->tx_len;
+		memcpy(entry, &msg->addr.sin_addr.s_addr, sizeof(uint32_t));
+		memcpy(entry + 4, &msg->addr.sin_port, sizeof(uint16_t));
+		entry[6] = msg->type;
+		entry[7] = topic_len;
+		uint16_t content = htons(msg->len);
+		memcpy(entry + 8, &content, sizeof(uint16_t));
+		memcpy(entry + ENTRY_HDR, msg->topic.str, topic_len);
+		memcpy(entry + ENTRY_HDR + topic_len, msg->content, msg->len);
+
+		peer->tx_len += ENTRY_HDR + topic_len + msg->len;
+		++peer->tx_count;
+	}
+}
+
+void fed_flush(server_t *srv) {
+	node_t *it = srv->fed.peers->head, *next;
+	for (; it; it = next) {
+		next = it->next;
+		peer_t *peer = it->data;
+
+		if (!peer_up(peer))
+			continue;
+
+		bool ok = peer_send_batch(srv, peer);
+		if (ok && srv->fed.dirty)
+			ok = peer_send_interest(srv, peer);
+
+		if (!ok)
+			peer_down(srv, peer);
+	}
+
+	srv->fed.dirty = false;
+}
+
+void fed_tick(server_t *srv) {
+	uint64_t now = now_ms();
+
+	for (node_t *it = srv->fed.peers->head; it; it = it->next) {
+		peer_t *peer = it->data;
+
+		if (!peer->outgoing || peer->socket != EMPTY || peer->retry > now)
+			continue;
+
+		// Another link to the same server replaced this one
+		if (peer_shadowed(srv, peer)) {
+			peer->retry = now + PEER_RETRY_MS;
+			continue;
+		}
+
+		peer_connect(srv, peer);
+	}
+}
+
+int fed_timeout(server_t *srv) {
+	uint64_t now = now_ms(), next = UINT64_MAX;
+
+	for (node_t *it = srv->fed.peers->head; it; it = it->next) {
+		peer_t *peer = it->data;
+		if (peer->outgoing && peer->socket == EMPTY && peer->retry < next)
+			next = peer->retry;
+	}
+
+	if (next == UINT64_MAX)
+		return -1;
+
+	return next > now ? (int)(next - now) : 0;
+}
+
+void fed_free(server_t *srv) {
+	node_t *it = srv->fed.peers->head;
+	while (it) {
+		peer_t *peer = it->data;
+		it = it->next;
+
+		// The sockets are closed along with the other ones in the pollfd array
+		ht_free(&peer->interest);
+		free(peer->rx);
+		free(peer->tx);
+		free(peer->out);
+	}
+
+	list_free(&srv->fed.peers);
+}
@@ -0,0 +1,116 @@
+/* SPDX-License-Identifier: EUPL-1.2 */
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#ifndef _PEER_H_
+#define _PEER_H_
+
+#include "server.h"
+
+// Time between two connection attempts to a federated server (ms)
+#define PEER_RETRY_MS 1000
+
+// Size after which a data batch is sent without waiting for the end of the
+// current wakeup
+#define PEER_BATCH 32768
+
+// Maximum size of a frame received from a federated server
+#define PEER_FRAME_MAX (1 << 20)
+
+// Maximum number of bytes waiting to be sent on a federation link, above
+// which the link is closed as too slow
+#define PEER_OUT_MAX (16 << 20)
+
+// Size of the header of every frame: the length of the rest of the frame
+// (network order) and the frame kind
+#define PEER_HDR 5
+
+// Federation frame kinds
+#define PEER_HELLO 0 // the sender's node ID
+#define PEER_INTEREST 1 // replaces the sender's interest with a list of topics
+#define PEER_INTEREST_MORE 2 // adds topics to the sender's interest
+#define PEER_DATA 3 // a batch of messages published to the sender
+
+/**
+ * @brief Initializes the federation state, choosing a random node ID.
+ *
+ * @param srv Pointer to the server state
+ */
+void fed_init(server_t *srv);
+
+/**
+ * @brief Adds a federated server this server connects to.
+ *
+ * @param srv Pointer to the server state
+ * @param addr The server's address, as <IP>:<PORT>
+ */
+void fed_add_peer(server_t *srv, const char *addr);
+
+/**
+ * @brief Takes over a connection from a federated server, after its connection
+ * packet was received. The socket stays in the pollfd array.
+ *
+ * @param srv Pointer to the server state
+ * @param socket The connection's socket
+ */
+void fed_accept(server_t *srv, int socket);
+
+/**
+ * @brief Finds the federated server using the given socket.
+ *
+ * @param srv Pointer to the server state
+ * @param socket The socket
+ *
+ * @return The federated server or NULL if the socket is not a federation link
+ */
+peer_t *fed_find(server_t *srv, int socket);
+
+/**
+ * @brief Handles poll events on a federation link.
+ *
+ * @param srv Pointer to the server state
+ * @param peer The federated server
+ * @param revents The events returned by poll
+ */
+void fed_event(server_t *srv, peer_t *peer, short revents);
+
+/**
+ * @brief Adds a message published to this server to the data batch of every
+ * federated server interested in its topic.
+ *
+ * @param srv Pointer to the server state
+ * @param msg The message
+ */
+void fed_forward(server_t *srv, const msg_t *msg);
+
+/**
+ * @brief Sends the pending data batches and, if it changed, the interest of
+ * this server to the federated servers. Called once per wakeup.
+ *
+ * @param srv Pointer to the server state
+ */
+void fed_flush(server_t *srv);
+
+/**
+ * @brief Reconnects to the federated servers whose links are down.
+ *
+ * @param srv Pointer to the server state
+ */
+void fed_tick(server_t *srv);
+
+/**
+ * @brief Computes how long poll may wait before fed_tick() has work to do.
+ *
+ * @param srv Pointer to the server state
+ *
+ * @return The timeout in ms, or -1 if there are no pending reconnections
+ */
+int fed_timeout(server_t *srv);
+
+/**
+ * @brief Closes all federation links and frees the federation state.
+ *
+ * @param srv Pointer to the server state
+ */
+void fed_free(server_t *srv);
+
+#endif /* _PEER_H_ */
@@ -20,10 +20,8 @@ void add_socket(struct pollfd *pfds, int *nfds, int socket) {
 }
 
 void remove_socket(struct pollfd *pfds, int *nfds, int i) {
-	// Shifts all elements in the array after the one being removed to the left
-	// by one
-	for (int j = i; j < *nfds - 1; ++j)
-		pfds[j] = pfds[j + 1];
+	// Moves the last element in the array in place of the one being removed
+	pfds[i] = pfds[*nfds - 1];
 
 	// Clears the last element in the array
 	pfds[*nfds - 1].fd = EMPTY;
@@ -32,3 +30,11 @@ void remove_socket(struct pollfd *pfds, int *nfds, int i) {
 	// Updates the number of fds
 	--(*nfds);
 }
+
+int find_socket(struct pollfd *pfds, int nfds, int socket) {
+	for (int i = 0; i < nfds; ++i)
+		if (pfds[i].fd == socket)
+			return i;
+
+	return EMPTY;
+}
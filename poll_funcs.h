@@ -16,7 +16,8 @@
 void add_socket(struct pollfd *pfds, int *nfds, int socket);
 
 /**
- * @brief Removes a socket from the pollfd array
+ * @brief Removes a socket from the pollfd array, moving the last socket in its
+ * place
  *
  * @param pfds pointer to the pollfd array
  * @param nfds pointer to the number of file descriptors in the pollfd array
@@ -24,4 +25,15 @@ void add_socket(struct pollfd *pfds, int *nfds, int socket);
  */
 void remove_socket(struct pollfd *pfds, int *nfds, int i);
 
+/**
+ * @brief Finds a socket in the pollfd array
+ *
+ * @param pfds pointer to the pollfd array
+ * @param nfds number of file descriptors in the pollfd array
+ * @param socket file descriptor to be searched for
+ *
+ * @return index of the file descriptor or EMPTY if it is not found
+ */
+int find_socket(struct pollfd *pfds, int nfds, int socket);
+
 #endif /* _POLL_FUNCS_H */
@@ -0,0 +1,304 @@
+// SPDX-License-Identifier: EUPL-1.2
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+// Needed for ppoll()
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <getopt.h>
+
+#include "structs.h"
+#include "utils.h"
+#include "htable.h"
+#include "capture.h"
+
+// Number of records replayed between two reads of the subscribers' sockets
+// when replaying as fast as possible
+#define DRAIN_EVERY 64
+
+// Time the subscribers keep reading after the last record (ns)
+#define DRAIN_TAIL 200000000
+
+// A subscriber of the capture, replayed over its own connection
+typedef struct replay_conn_t {
+	char id[IDSIZ];
+	unsigned int idx; // its position in the arrays of the replay
+} replay_conn_t;
+
+// The state of the replay
+typedef struct replay_t {
+	struct sockaddr_in addr; // the server's
+	int udp_sock;
+	htable_t *conns; // the subscribers (replay_conn_t), by ID
+	struct pollfd pfds[MAX_CLIENTS]; // their sockets
+	char ids[MAX_CLIENTS][IDSIZ];
+	uint64_t last_tx[MAX_CLIENTS]; // when they last sent a packet (ns)
+	unsigned int nconns;
+	unsigned int datagrams;
+	unsigned int events;
+	unsigned int dropped; // subscribers the server disconnected
+} replay_t;
+
+// Gets the current time (monotonic, in ns)
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int conn_hash(const void *data) {
+	const replay_conn_t *conn = data;
+
+	return ht_hash_bytes(conn->id, strlen(conn->id), HT_SEED);
+}
+
+static bool conn_equal(const void *a, const void *b) {
+	return !strcmp(((replay_conn_t *)a)->id, ((replay_conn_t *)b)->id);
+}
+
+// Finds the subscriber of an event
+static replay_conn_t *conn_find(replay_t *rp, const cap_record_t *rec) {
+	replay_conn_t key;
+	memcpy(key.id, rec->data + 1, rec->data[0]);
+	key.id[rec->data[0]] = '\0';
+
+	return ht_get(rp->conns, &key);
+}
+
+// Sends a packet to the server on behalf of a subscriber
+static void conn_send(replay_t *rp, unsigned int idx, uint8_t type,
+						const char *topic, size_t topic_len, uint8_t flags) {
+	sub_packet_t pack;
+	memset(&pack, 0, PACKLEN);
+	pack.type = type;
+	memcpy(pack.topic, topic, topic_len);
+	pack.sf = flags & BULK_SF;
+	pack.prio = flags >> BULK_PRIO_SHIFT;
+
+	// A failed send shows up as a closed connection when reading it
+	send(rp->pfds[idx].fd, &pack, PACKLEN, MSG_NOSIGNAL);
+	rp->last_tx[idx] = now_ns();
+}
+
+// Closes a subscriber's connection, moving the last one to its place
+static void conn_close(replay_t *rp, replay_conn_t *conn) {
+	unsigned int idx = conn->idx, last = --rp->nconns;
+
+	close(rp->pfds[idx].fd);
+	ht_remove(rp->conns, conn);
+
+	if (idx != last) {
+		rp->pfds[idx] = rp->pfds[last];
+		rp->last_tx[idx] = rp->last_tx[last];
+		strcpy(rp->ids[idx], rp->ids[last]);
+
+		replay_conn_t key;
+		strcpy(key.id, rp->ids[idx]);
+		((replay_conn_t *)ht_get(rp->conns, &key))->idx = idx;
+	}
+}
+
+// Connects a subscriber, in the wire mode it used (a shared memory ring or a
+// resume vector cannot be replayed)
+static void replay_connect(replay_t *rp, const cap_record_t *rec) {
+	size_t id_len = rec->data[0];
+	if (rec->len < 2 + id_len || conn_find(rp, rec) ||
+		rp->nconns == MAX_CLIENTS)
+		return;
+
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	DIE(sock < 0, "socket() failed");
+
+	int enable = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+
+	int ret = connect(sock, (struct sockaddr *)&rp->addr, sizeof(rp->addr));
+	DIE(ret < 0, "connect() failed");
+
+	conn_packet_t conn;
+	memset(&conn, 0, CONNLEN);
+	memcpy(conn.id, rec->data + 1, id_len);
+	conn.flags = rec->data[1 + id_len] & CONN_COMPACT;
+	ret = send(sock, &conn, CONNLEN, 0);
+	DIE(ret < 0, "send() failed");
+
+	replay_conn_t entry;
+	strcpy(entry.id, conn.id);
+	entry.idx = rp->nconns++;
+	ht_put(rp->conns, &entry);
+
+	strcpy(rp->ids[entry.idx], conn.id);
+	rp->pfds[entry.idx].fd = sock;
+	rp->pfds[entry.idx].events = POLLIN;
+	rp->last_tx[entry.idx] = now_ns();
+}
+
+// Replays a record
+static void replay_record(replay_t *rp, const cap_record_t *rec) {
+	if (rec->kind == CAP_DATAGRAM) {
+		// The datagram comes from the replay's address, not the publisher's
+		int ret = sendto(rp->udp_sock, rec->data, rec->len, 0,
+							(struct sockaddr *)&rp->addr, sizeof(rp->addr));
+		DIE(ret < 0, "sendto() failed");
+		++rp->datagrams;
+		return;
+	}
+
+	++rp->events;
+	if (rec->kind == CAP_CONNECT) {
+		replay_connect(rp, rec);
+		return;
+	}
+
+	replay_conn_t *conn = conn_find(rp, rec);
+	if (!conn)
+		return;
+
+	const uint8_t *extra = rec->data + 1 + rec->data[0];
+	size_t extra_len = rec->len - 1 - rec->data[0];
+
+	if (rec->kind == CAP_SUBSCRIBE && extra_len >= 2 &&
+		extra_len - 1 <= TOPICSIZ - 1)
+		conn_send(rp, conn->idx, SUBSCRIBE, (const char *)extra + 1,
+					extra_len - 1, extra[0]);
+	else if (rec->kind == CAP_UNSUBSCRIBE && extra_len &&
+				extra_len <= TOPICSIZ - 1)
+		conn_send(rp, conn->idx, UNSUBSCRIBE, (const char *)extra, extra_len,
+					0);
+	else if (rec->kind == CAP_DISCONNECT) {
+		conn_send(rp, conn->idx, EXIT, "", 0, 0);
+		conn_close(rp, conn);
+	}
+}
+
+// Reads (and discards) what the server sends to the subscribers until the
+// given time, keeping their connections alive
+static void drain(replay_t *rp, uint64_t until) {
+	static char buf[1 << 16];
+
+	do {
+		uint64_t now = now_ns();
+		uint64_t wait = until > now ? until - now : 0;
+		struct timespec ts = {wait / 1000000000, wait % 1000000000};
+
+		int ret = ppoll(rp->pfds, rp->nconns, &ts, NULL);
+		DIE(ret < 0, "ppoll() failed");
+
+		// Sockets closed on the way are replaced by the last one, which is
+		// then read on the next round
+		for (unsigned int i = 0; i < rp->nconns && ret > 0; ++i) {
+			if (!rp->pfds[i].revents)
+				continue;
+
+			if (recv(rp->pfds[i].fd, buf, sizeof(buf), MSG_DONTWAIT) <= 0) {
+				replay_conn_t key;
+				strcpy(key.id, rp->ids[i]);
+				conn_close(rp, ht_get(rp->conns, &key));
+				++rp->dropped;
+			}
+		}
+
+		now = now_ns();
+		for (unsigned int i = 0; i < rp->nconns; ++i)
+			if (now - rp->last_tx[i] >= (uint64_t)HEARTBEAT_INTERVAL * 1000000)
+				conn_send(rp, i, HEARTBEAT, "", 0, 0);
+	} while (now_ns() < until);
+}
+
+int main(int argc, char **argv) {
+	double speed = 1;
+
+	// Parses the options
+	// -s <SPEED>: replays that many times faster than the capture (0 for as
+	// fast as possible)
+	int opt;
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		DIE(opt == '?', "Invalid option (argv).");
+		if (opt == 's')
+			speed = atof(optarg);
+	}
+
+	DIE(argc - optind < 3 || speed < 0,
+		"Usage: ./replay [-s SPEED] <FILE> <IP> <PORT>");
+
+	FILE *cap = cap_open(argv[optind]);
+	DIE(!cap, "Not a capture file (argv).");
+
+	replay_t *rp = calloc(1, sizeof(replay_t));
+	DIE(!rp, "replay calloc() failed");
+	rp->addr.sin_family = AF_INET;
+	rp->addr.sin_port = htons(atoi(argv[optind + 2]));
+	DIE(!inet_aton(argv[optind + 1], &rp->addr.sin_addr), "Invalid IP (argv).");
+	rp->conns = ht_create(sizeof(replay_conn_t), conn_hash, conn_equal);
+
+	rp->udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	DIE(rp->udp_sock < 0, "udp socket() failed");
+
+	cap_record_t rec;
+	unsigned int records = 0;
+	uint64_t first = 0, last = 0, max_lag = 0;
+	uint64_t start = now_ns();
+
+	int ret;
+	while ((ret = cap_read(cap, &rec)) > 0) {
+		if (!records++)
+			first = rec.ts;
+		last = rec.ts;
+
+		// Waits for the record's time (scaled), reading the subscribers'
+		// sockets meanwhile
+		if (speed > 0) {
+			uint64_t due = start + (uint64_t)((rec.ts - first) / speed);
+			drain(rp, due);
+
+			uint64_t lag = now_ns() - due;
+			if (lag > max_lag)
+				max_lag = lag;
+		} else if (records % DRAIN_EVERY == 0) {
+			drain(rp, 0);
+		}
+
+		replay_record(rp, &rec);
+	}
+	fclose(cap);
+
+	uint64_t elapsed = now_ns() - start;
+	if (ret < 0)
+		fprintf(stderr, "Truncated capture, stopped after %u records.\n",
+				records);
+
+	printf("replay records=%u datagrams=%u events=%u dropped=%u "
+			"capture_s=%.3f elapsed_s=%.3f datagrams_per_s=%.0f",
+			records, rp->datagrams, rp->events, rp->dropped,
+			(last - first) / 1e9, elapsed / 1e9,
+			rp->datagrams / (elapsed / 1e9));
+	if (speed > 0)
+		printf(" max_lag_us=%.1f", max_lag / 1e3);
+	printf("\n");
+
+	// Lets the server deliver the last messages, then disconnects the
+	// subscribers
+	drain(rp, now_ns() + DRAIN_TAIL);
+	while (rp->nconns) {
+		replay_conn_t key;
+		strcpy(key.id, rp->ids[0]);
+		conn_send(rp, 0, EXIT, "", 0, 0);
+		conn_close(rp, ht_get(rp->conns, &key));
+	}
+
+	ht_free(&rp->conns);
+	close(rp->udp_sock);
+	free(rp);
+
+	return 0;
+}
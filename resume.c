@@ -0,0 +1,204 @@
+// SPDX-License-Identifier: EUPL-1.2
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "codec.h"
+#include "utils.h"
+#include "resume.h"
+
+// Gets the current time (monotonic, in ms)
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Hashes the topic of a position
+static unsigned int topic_hash(const void *data) {
+	const resume_topic_t *entry = data;
+
+	return ht_hash_bytes(entry->topic, strlen(entry->topic), HT_SEED);
+}
+
+// Compares the topics of two positions
+static bool topic_equal(const void *a, const void *b) {
+	return !strcmp(((resume_topic_t *)a)->topic,
+					((resume_topic_t *)b)->topic);
+}
+
+resume_t *resume_load(const char *path) {
+	resume_t *resume = calloc(1, sizeof(resume_t));
+	DIE(!resume, "resume calloc() failed");
+
+	resume->path = path;
+	pthread_mutex_init(&resume->lock, NULL);
+	resume->topics = ht_create(sizeof(resume_topic_t), topic_hash,
+								topic_equal);
+	resume->last_save = now_ms();
+
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return resume;
+
+	// The epoch, then per line the last sequence number processed, the
+	// topic's length and the topic, which may contain any whitespace
+	if (fscanf(file, "epoch %u", &resume->epoch) == 1) {
+		resume_topic_t entry;
+		unsigned int len;
+
+		while (fscanf(file, "%u %u", &entry.seq, &len) == 2) {
+			memset(entry.topic, 0, TOPICSIZ);
+			if (len > TOPICSIZ - 1 || fgetc(file) != ' ' ||
+				fread(entry.topic, 1, len, file) != len ||
+				fgetc(file) != '\n')
+				break;
+
+			// Everything in the file was acknowledged after being saved
+			entry.acked = entry.seq;
+			if (!ht_get(resume->topics, &entry))
+				ht_put(resume->topics, &entry);
+		}
+	}
+
+	fclose(file);
+	return resume;
+}
+
+void resume_send(resume_t *resume, int socket) {
+	pthread_mutex_lock(&resume->lock);
+
+	unsigned int count = resume->topics->size < RESUME_MAX ?
+							resume->topics->size : RESUME_MAX;
+
+	resume_hdr_t hdr;
+	memset(&hdr, 0, sizeof(resume_hdr_t));
+	hdr.epoch = htonl(resume->epoch);
+	hdr.count = htons(count);
+
+	resume_entry_t *entries = calloc(count + 1, sizeof(resume_entry_t));
+	DIE(!entries, "resume vector calloc() failed");
+
+	unsigned int n = 0;
+	for (unsigned int b = 0; b < resume->topics->nbuckets; ++b) {
+		for (node_t *it = resume->topics->buckets[b]; it && n < count;
+			it = it->next) {
+			resume_topic_t *entry = it->data;
+			strcpy(entries[n].topic, entry->topic);
+			entries[n].seq = htonl(entry->seq);
+			++n;
+		}
+	}
+
+	pthread_mutex_unlock(&resume->lock);
+
+	int ret = send(socket, &hdr, sizeof(resume_hdr_t), 0);
+	DIE(ret < 0, "send() failed");
+	ret = send(socket, entries, count * sizeof(resume_entry_t), 0);
+	DIE(ret < 0, "send() failed");
+
+	free(entries);
+}
+
+void resume_epoch(resume_t *resume, uint32_t epoch) {
+	pthread_mutex_lock(&resume->lock);
+
+	// The server restarted, so its numbering started over
+	if (epoch != resume->epoch) {
+		resume->epoch = epoch;
+		ht_clear(resume->topics);
+		resume->dirty = true;
+	}
+
+	pthread_mutex_unlock(&resume->lock);
+}
+
+bool resume_seen(resume_t *resume, const char *topic, uint32_t seq) {
+	bool seen = false;
+	resume_topic_t key;
+	memset(&key, 0, sizeof(resume_topic_t));
+	strcpy(key.topic, topic);
+
+	pthread_mutex_lock(&resume->lock);
+
+	resume_topic_t *entry = ht_get(resume->topics, &key);
+	if (!entry)
+		entry = ht_put(resume->topics, &key);
+	else if (!seq_after(seq, entry->seq))
+		seen = true;
+
+	if (!seen) {
+		entry->seq = seq;
+		resume->dirty = true;
+	}
+
+	pthread_mutex_unlock(&resume->lock);
+	return seen;
+}
+
+// Writes the positions to the state file, replacing it at once, so that a
+// crash never leaves a partial file behind
+static void resume_save(resume_t *resume) {
+	char tmp[BUFSIZ];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", resume->path);
+
+	FILE *file = fopen(tmp, "w");
+	DIE(!file, "state file fopen() failed");
+
+	fprintf(file, "epoch %u\n", resume->epoch);
+	for (unsigned int b = 0; b < resume->topics->nbuckets; ++b) {
+		for (node_t *it = resume->topics->buckets[b]; it; it = it->next) {
+			resume_topic_t *entry = it->data;
+			fprintf(file, "%u %zu %s\n", entry->seq, strlen(entry->topic),
+					entry->topic);
+		}
+	}
+
+	DIE(fclose(file), "state file fclose() failed");
+	DIE(rename(tmp, resume->path) < 0, "state file rename() failed");
+}
+
+bool resume_flush(resume_t *resume, int socket) {
+	bool ok = true;
+
+	pthread_mutex_lock(&resume->lock);
+	resume->last_save = now_ms();
+
+	if (resume->dirty) {
+		resume_save(resume);
+		resume->dirty = false;
+
+		// Acknowledges the topics whose position moved
+		for (unsigned int b = 0; b < resume->topics->nbuckets && ok; ++b) {
+			for (node_t *it = resume->topics->buckets[b]; it && ok;
+				it = it->next) {
+				resume_topic_t *entry = it->data;
+				if (socket < 0 || entry->acked == entry->seq)
+					continue;
+
+				sub_packet_t pack;
+				memset(&pack, 0, PACKLEN);
+				pack.type = ACK;
+				strcpy(pack.topic, entry->topic);
+				pack.seq = htonl(entry->seq);
+
+				ok = send(socket, &pack, PACKLEN, MSG_NOSIGNAL) >= 0;
+				entry->acked = entry->seq;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&resume->lock);
+	return ok;
+}
+
+void resume_free(resume_t *resume) {
+	pthread_mutex_destroy(&resume->lock);
+	ht_free(&resume->topics);
+	free(resume);
+}
@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: EUPL-1.2 */
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#ifndef _RESUME_H_
+#define _RESUME_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "structs.h"
+#include "htable.h"
+
+// Time between two saves of the state file, each followed by the
+// acknowledgements of the messages processed since the last one (ms)
+#define RESUME_INTERVAL 1000
+
+// The position of a subscriber in a topic
+typedef struct resume_topic_t {
+	char topic[TOPICSIZ];
+	uint32_t seq; // the last message processed
+	uint32_t acked; // the last message acknowledged to the server
+} resume_topic_t;
+
+// The state of a resuming subscriber, kept in its state file so that it
+// survives crashes
+typedef struct resume_t {
+	const char *path; // the state file
+	pthread_mutex_t lock; // the ring reader updates the positions too
+	uint32_t epoch; // the server's epoch of the positions, 0 if unknown
+	htable_t *topics; // the positions (resume_topic_t)
+	bool dirty; // the positions changed since they were last saved
+	uint64_t last_save; // when they were last saved (monotonic ms)
+} resume_t;
+
+/**
+ * @brief Loads the state of a resuming subscriber. A missing state file
+ * means that nothing was processed yet.
+ *
+ * @param path The state file.
+ *
+ * @return A pointer to the state.
+ */
+resume_t *resume_load(const char *path);
+
+/**
+ * @brief Sends the resume vector (the position in every topic), right after
+ * the connection packet.
+ *
+ * @param resume The state.
+ * @param socket The connection to the server.
+ */
+void resume_send(resume_t *resume, int socket);
+
+/**
+ * @brief Records the epoch the server numbers its messages with. Positions
+ * from another epoch are dropped.
+ *
+ * @param resume The state.
+ * @param epoch The server's epoch.
+ */
+void resume_epoch(resume_t *resume, uint32_t epoch);
+
+/**
+ * @brief Checks if a message was already processed, and records it as
+ * processed otherwise.
+ *
+ * @param resume The state.
+ * @param topic The message's topic.
+ * @param seq The message's sequence number.
+ *
+ * @return True if the message is a duplicate, which must be ignored.
+ */
+bool resume_seen(resume_t *resume, const char *topic, uint32_t seq);
+
+/**
+ * @brief Saves the state file if the positions changed, then acknowledges
+ * them to the server, so that it frees the messages it kept. The file is
+ * written first, so that the server never forgets a message the file does not
+ * account for.
+ *
+ * @param resume The state.
+ * @param socket The connection to the server, or -1 to only save the file.
+ *
+ * @return False if an acknowledgement could not be sent.
+ */
+bool resume_flush(resume_t *resume, int socket);
+
+/**
+ * @brief Frees the state of a resuming subscriber.
+ *
+ * @param resume The state.
+ */
+void resume_free(resume_t *resume);
+
+#endif /* _RESUME_H_ */
@@ -1,6 +1,9 @@
 // SPDX-License-Identifier: EUPL-1.2
 /* Copyright Mitran Andrei-Gabriel 2023 */
 
+// Needed for accept4()
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -9,22 +12,122 @@
 #include <unistd.h>
 #include <netinet/tcp.h>
 #include <poll.h>
+#include <stddef.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sched.h>
 
 #include "structs.h"
 #include "list.h"
+#include "htable.h"
+#include "codec.h"
+#include "shm_ring.h"
 #include "utils.h"
 #include "poll_funcs.h"
 #include "server.h"
+#include "peer.h"
+#include "timer.h"
+#include "filter.h"
+#include "capture.h"
+#include "mem.h"
+#include "lanes.h"
+
+uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int wait_events(server_t *srv, int timeout) {
+	busy_t *busy = &srv->busy;
+
+	if (!busy->max)
+		return poll(srv->pfds, srv->nfds, timeout);
+
+	// Spins while the last events are recent, checking the sockets without
+	// sleeping (until a timer is due)
+	uint64_t start = now_us(), now = start;
+	while (now - busy->last < busy->spin) {
+		int ret = poll(srv->pfds, srv->nfds, 0);
+		now = now_us();
+		if (ret) {
+			busy->last = now;
+			return ret;
+		}
+
+		if (timeout >= 0 && now - start >= (uint64_t)timeout * 1000)
+			return 0;
+	}
+
+	// Idle for too long, sleeps
+	if (timeout >= 0) {
+		uint64_t spent = (now - start) / 1000;
+		timeout = spent < (uint64_t)timeout ? timeout - (int)spent : 0;
+	}
+
+	int ret = poll(srv->pfds, srv->nfds, timeout);
+	if (ret <= 0)
+		return ret;
+
+	// Spins long enough to catch the next event if it comes after a gap that
+	// would not have been too long to spin through, and less after long ones
+	now = now_us();
+	uint64_t gap = now - busy->last;
+	if (gap <= busy->max) {
+		uint64_t spin = 2 * (gap > busy->spin ? gap : busy->spin);
+		busy->spin = spin < busy->max ? spin : busy->max;
+	} else if (busy->spin / 2 >= BUSY_MIN) {
+		busy->spin /= 2;
+	}
+	busy->last = now;
+
+	return ret;
+}
+
+void watch_socket(server_t *srv, int socket, uint8_t kind, void *ptr) {
+	srv->fds[socket].kind = kind;
+	srv->fds[socket].idx = srv->nfds;
+	srv->fds[socket].ptr = ptr;
+
+	add_socket(srv->pfds, &srv->nfds, socket);
+}
+
+void unwatch_socket(server_t *srv, int socket) {
+	int i = srv->fds[socket].idx;
+
+	remove_socket(srv->pfds, &srv->nfds, i);
+
+	// The socket that was moved in its place
+	if (i < srv->nfds)
+		srv->fds[srv->pfds[i].fd].idx = i;
+
+	memset(&srv->fds[socket], 0, sizeof(fd_info_t));
+}
 
 sockets_t *setup_server(struct pollfd *pfds, int *nfds, char *port) {
-	 // Creates a new TCP socket
-	int tcp_sock = socket(AF_INET, SOCK_STREAM, 0);
+	 // Creates a new TCP socket (non-blocking, so that all pending connections
+	 // can be accepted at once)
+	int tcp_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
 	DIE(tcp_sock < 0, "tcp socket() failed");
 
 	// Sets TCP_NODELAY socket option to disable the Nagle algorithm
 	int optval = 1;
 	setsockopt(tcp_sock, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(int));
 
+	// Allows restarting the server while old connections are in TIME_WAIT
+	setsockopt(tcp_sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+
 	// Creates a new UDP socket
 	int udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
 	DIE(udp_sock < 0, "udp socket() failed");
@@ -76,7 +179,7 @@ sockets_t *setup_server(struct pollfd *pfds, int *nfds, char *port) {
 	return socks;
 }
 
-bool stdin_cmd(char *buffer) {
+bool stdin_cmd(server_t *srv, char *buffer) {
 	// Clears the buffer
 	memset(buffer, 0, BUFSIZ);
 
@@ -87,332 +190,1414 @@ bool stdin_cmd(char *buffer) {
 	if (!strncmp(buffer, "exit", 4))
 		return false;
 
+	if (!strncmp(buffer, "mem", 3)) {
+		mem_print(srv);
+		return true;
+	}
+
+	if (!strncmp(buffer, "prio", 4)) {
+		lanes_print(srv);
+		return true;
+	}
+
 	// If input is invalid, prints error and exits
 	DIE(strncmp(buffer, "exit", 4), "Invalid input from STDIN.");
 
 	return true;
 }
 
-void tcp(struct pollfd *pfds, int *nfds, list_t *clients, sockets_t *socks,
-			char *buffer) {
-	// Clears the buffer
-	memset(buffer, 0, BUFSIZ);
+// Hashes the key of a topic dictionary entry
+static unsigned int dict_hash(const void *data) {
+	const dict_entry_t *entry = data;
 
-	// Accepts a new connection on the TCP socket
-	struct sockaddr_in new_tcp;
-	int socket = accept(socks->tcp_sock, (struct sockaddr *)&new_tcp,
-						&socks->len);
-	DIE(socket < 0, "new socket accept() failed");
+	unsigned int hash = key_hash(&entry->topic);
+	hash = ht_hash_bytes(&entry->ip, sizeof(entry->ip), hash);
+	return ht_hash_bytes(&entry->port, sizeof(entry->port), hash);
+}
 
-	// Receives the ID of the client
-	int ret = recv(socket, buffer, IDSIZ, 0);
-	DIE(ret < 0, "recv() failed");
+// Compares the keys of two topic dictionary entries
+static bool dict_equal(const void *a, const void *b) {
+	const dict_entry_t *x = a, *y = b;
 
-	// Checks if the client already exists in the clients list
-	client_t *found = NULL;
-	node_t *client_node = clients->head;
-	while (client_node) {
-		client_t *client = (client_t *)client_node->data;
-		if (!strcmp(client->id, buffer)) {
-			found = client;
+	return x->ip == y->ip && x->port == y->port &&
+			key_equal(&x->topic, &y->topic);
+}
+
+// Empties a client's topic dictionary
+static void dict_clear(server_t *srv, client_t *client) {
+	size_t before = ht_mem(client->dict);
+	ht_clear(client->dict);
+	mem_charge_ht(srv, client, MEM_BUFFERS, before, client->dict);
+}
+
+void build_tcp_msg(const msg_t *msg, tcp_msg_t *tcp_msg) {
+	memset(tcp_msg, 0, sizeof(tcp_msg_t));
+
+	// Copies the UDP client's IP and port (in network order)
+	strcpy(tcp_msg->ip, inet_ntoa(msg->addr.sin_addr));
+	tcp_msg->port = msg->addr.sin_port;
+
+	strcpy(tcp_msg->topic, msg->topic.str);
+	tcp_msg->seq = htonl(msg->seq);
+
+	// Converts the content to its textual form
+	format_content(msg->type, msg->content, msg->len, tcp_msg->type,
+					tcp_msg->content);
+}
+
+size_t encode_compact(server_t *srv, client_t *client, const msg_t *msg,
+						uint8_t *out) {
+	size_t len = 0;
+
+	// Looks up the topic and publisher pair in the client's dictionary
+	dict_entry_t key;
+	memset(&key, 0, sizeof(dict_entry_t));
+	key.topic = msg->topic;
+	key.ip = msg->addr.sin_addr.s_addr;
+	key.port = msg->addr.sin_port;
+
+	dict_entry_t *entry = ht_get(client->dict, &key);
+
+	// If the pair was never sent on this connection, sends a dictionary entry
+	// first (IDs are given in order, starting from 0)
+	if (!entry) {
+		size_t before = ht_mem(client->dict);
+		key.id = client->dict->size;
+		entry = ht_put(client->dict, &key);
+		mem_charge_ht(srv, client, MEM_BUFFERS, before, client->dict);
+
+		size_t topic_len = key_len(&entry->topic);
+
+		out[len++] = FRAME_DICT;
+		len += varint_encode(out + len, entry->id);
+		out[len++] = topic_len;
+		memcpy(out + len, entry->topic.str, topic_len);
+		len += topic_len;
+		memcpy(out + len, &entry->ip, sizeof(entry->ip));
+		len += sizeof(entry->ip);
+		memcpy(out + len, &entry->port, sizeof(entry->port));
+		len += sizeof(entry->port);
+	}
+
+	// The data frame: the content type, the dictionary ID, the sequence
+	// number and the binary content (strings are prefixed by their length)
+	out[len++] = msg->type;
+	len += varint_encode(out + len, entry->id);
+	len += varint_encode(out + len, msg->seq);
+	if (msg->type == STRING)
+		len += varint_encode(out + len, msg->len);
+	memcpy(out + len, msg->content, msg->len);
+	len += msg->len;
+
+	return len;
+}
+
+void cache_init(msg_cache_t *cache) {
+	cache->tcp.type[0] = '\0';
+	cache->zc_tcp = NULL;
+	cache->zc_content = NULL;
+	cache->due = now_us();
+}
+
+void cache_free(msg_cache_t *cache) {
+	zc_buf_put(cache->zc_tcp);
+	zc_buf_put(cache->zc_content);
+}
+
+bool send_msg(server_t *srv, client_t *client, const msg_t *msg, uint8_t prio,
+				msg_cache_t *cache) {
+	// Same host clients may read the messages from a shared memory ring
+	if (client->ring) {
+		bool written;
+		if (client->flags & CONN_COMPACT) {
+			uint8_t frame[DICT_FRAME_MAX + FRAME_MAX];
+			size_t len = encode_compact(srv, client, msg, frame);
+			written = ring_write(client->ring, frame, len);
+		} else {
+			if (!cache->tcp.type[0])
+				build_tcp_msg(msg, &cache->tcp);
+			written = ring_write(client->ring, &cache->tcp, sizeof(tcp_msg_t));
+		}
+
+		if (written) {
+			lane_record(srv, prio, cache->due, false);
+			return true;
+		}
+
+		// The client does not keep up with the ring (which is never waited
+		// for), so it falls back to its TCP connection, which starts with an
+		// empty dictionary
+		ring_detach(&client->ring);
+		dict_clear(srv, client);
+	}
+
+	// Large strings are not copied to the kernel for every client (unless
+	// they have to wait in a lane, which copies them anyway)
+	bool zerocopy = client->zerocopy && srv->zc_min && msg->type == STRING &&
+					msg->len >= srv->zc_min && !client->out_len;
+
+	// Compact mode clients receive variable-sized frames
+	if (client->flags & CONN_COMPACT) {
+		uint8_t frame[DICT_FRAME_MAX + FRAME_MAX];
+		size_t len = encode_compact(srv, client, msg, frame);
+
+		if (!zerocopy)
+			return lane_send(srv, client, prio, frame, len, NULL, cache->due);
+
+		// Only the content is shared by all clients, the frame's header is
+		// copied
+		if (!cache->zc_content)
+			cache->zc_content = zc_buf_new(msg->content, msg->len);
+
+		return lane_send(srv, client, prio, frame, len - msg->len,
+							cache->zc_content, cache->due);
+	}
+
+	// The TCP message is built only once for all clients
+	if (!cache->tcp.type[0])
+		build_tcp_msg(msg, &cache->tcp);
+
+	if (!zerocopy)
+		return lane_send(srv, client, prio, &cache->tcp, sizeof(tcp_msg_t),
+							NULL, cache->due);
+
+	if (!cache->zc_tcp)
+		cache->zc_tcp = zc_buf_new(&cache->tcp, sizeof(tcp_msg_t));
+
+	return lane_send(srv, client, prio, NULL, 0, cache->zc_tcp, cache->due);
+}
+
+bool zc_drain(client_t *client) {
+	bool copied = false;
+	bool read = zc_complete(&client->zc, client->socket, &copied);
+
+	// Pinning the pages is only overhead if they are copied anyway
+	if (copied)
+		client->zerocopy = false;
+
+	return read;
+}
+
+bool send_heartbeat(server_t *srv, client_t *client) {
+	// Counts as sent even if it waits in a lane, as the connection is busy
+	// anyway
+	client->last_tx = now_ms();
+
+	if (client->flags & CONN_COMPACT) {
+		uint8_t frame = FRAME_HEARTBEAT;
+		return lane_send(srv, client, PRIO_URGENT, &frame, 1, NULL, 0);
+	}
+
+	tcp_msg_t tcp_msg;
+	memset(&tcp_msg, 0, sizeof(tcp_msg_t));
+	return lane_send(srv, client, PRIO_URGENT, &tcp_msg, sizeof(tcp_msg_t),
+						NULL, 0);
+}
+
+bool send_epoch(server_t *srv, client_t *client) {
+	uint32_t epoch = htonl(srv->epoch);
+	uint8_t frame[EPOCH_FRAME_LEN];
+	tcp_msg_t tcp_msg;
+	const void *data;
+	size_t len;
+
+	if (client->flags & CONN_COMPACT) {
+		frame[0] = FRAME_EPOCH;
+		memcpy(frame + 1, &epoch, sizeof(epoch));
+		data = frame;
+		len = EPOCH_FRAME_LEN;
+	} else {
+		memset(&tcp_msg, 0, sizeof(tcp_msg_t));
+		tcp_msg.seq = epoch;
+		data = &tcp_msg;
+		len = sizeof(tcp_msg_t);
+	}
+
+	// Goes the same way as the messages that follow it (the ring was just
+	// attached, so it has room)
+	if (client->ring)
+		return ring_write(client->ring, data, len);
+
+	return lane_send(srv, client, PRIO_URGENT, data, len, NULL, 0);
+}
+
+bool send_reject(server_t *srv, client_t *client, const topic_key_t *name) {
+	size_t topic_len = key_len(name);
+
+	if (client->flags & CONN_COMPACT) {
+		uint8_t frame[2 + TOPICSIZ - 1];
+		frame[0] = FRAME_REJECT;
+		frame[1] = topic_len;
+		memcpy(frame + 2, name->str, topic_len);
+		return lane_send(srv, client, PRIO_URGENT, frame, 2 + topic_len, NULL,
+							0);
+	}
+
+	// Told apart from heartbeats and epochs by its topic
+	tcp_msg_t tcp_msg;
+	memset(&tcp_msg, 0, sizeof(tcp_msg_t));
+	memcpy(tcp_msg.topic, name->str, topic_len);
+	return lane_send(srv, client, PRIO_URGENT, &tcp_msg, sizeof(tcp_msg_t),
+						NULL, 0);
+}
+
+// Hashes the topic of a numbering entry
+static unsigned int seq_hash(const void *data) {
+	return key_hash(&((topic_seq_t *)data)->topic);
+}
+
+// Compares the topics of two numbering entries
+static bool seq_equal(const void *a, const void *b) {
+	return key_equal(&((topic_seq_t *)a)->topic, &((topic_seq_t *)b)->topic);
+}
+
+uint32_t next_seq(server_t *srv, const topic_key_t *topic) {
+	topic_seq_t key;
+	key.topic = *topic;
+
+	topic_seq_t *entry = ht_get(srv->seqs, &key);
+	if (!entry) {
+		size_t before = ht_mem(srv->seqs);
+		key.last = 0;
+		entry = ht_put(srv->seqs, &key);
+		mem_charge_ht(srv, NULL, MEM_SUBS, before, srv->seqs);
+	}
+
+	// 0 means that nothing was acknowledged, even after wrapping around
+	if (!++entry->last)
+		entry->last = 1;
+
+	return entry->last;
+}
+
+uint32_t last_seq(server_t *srv, const topic_key_t *topic) {
+	topic_seq_t key;
+	key.topic = *topic;
+
+	topic_seq_t *entry = ht_get(srv->seqs, &key);
+	return entry ? entry->last : 0;
+}
+
+// Hashes the name of a topic
+static unsigned int topic_hash(const void *data) {
+	return key_hash(&((topic_t *)data)->name);
+}
+
+// Compares the names of two topics
+static bool topic_equal(const void *a, const void *b) {
+	return key_equal(&((topic_t *)a)->name, &((topic_t *)b)->name);
+}
+
+// Finds a topic a client is subscribed to
+static topic_t *client_topic(client_t *client, const topic_key_t *name) {
+	topic_t key;
+	key.name = *name;
+
+	return ht_get(client->topics, &key);
+}
+
+// Size of a stored message, as allocated
+static size_t stored_size(const stored_msg_t *stored) {
+	return offsetof(stored_msg_t, msg.content) + stored->msg.len;
+}
+
+// Frees the oldest stored message of a client, leaving its timer as it is
+static void backlog_shift(server_t *srv, client_t *client) {
+	stored_msg_t *stored = client->unsent;
+	client->unsent = stored->next;
+
+	// The replay goes on from the next one
+	if (client->replay == stored)
+		client->replay = stored->next;
+
+	mem_charge(srv, client, MEM_BACKLOG, -(long)stored_size(stored));
+	free(stored);
+}
+
+// Makes the expiry timer of a client follow its oldest stored message
+static void backlog_rearm(server_t *srv, client_t *client) {
+	if (client->unsent) {
+		if (client->unsent->expires)
+			timer_arm(&srv->wheel, &client->expiry, client->unsent->expires);
+	} else {
+		timer_cancel(&srv->wheel, &client->expiry);
+		client->unsent_tail = NULL;
+	}
+}
+
+// Drops the unsent messages of a client that expired, oldest first, and waits
+// for the next one to expire
+static void backlog_expire(void *ctx, wtimer_t *timer) {
+	server_t *srv = ctx;
+	client_t *client = timer->data;
+	uint64_t now = now_ms();
+
+	while (client->unsent && client->unsent->expires <= now)
+		backlog_shift(srv, client);
+
+	if (client->unsent)
+		timer_arm(&srv->wheel, timer, client->unsent->expires);
+	else
+		client->unsent_tail = NULL;
+}
+
+stored_msg_t *backlog_add(server_t *srv, client_t *client, const msg_t *msg) {
+	// Only the used part of the content is stored, if there is room for it
+	size_t len = offsetof(stored_msg_t, msg.content) + msg->len;
+	if (!mem_store(srv, len))
+		return NULL;
+
+	stored_msg_t *stored = malloc(len);
+	DIE(!stored, "stored message malloc() failed");
+	mem_charge(srv, client, MEM_BACKLOG, len);
+
+	memcpy(&stored->msg, msg, offsetof(msg_t, content) + msg->len);
+	stored->next = NULL;
+	stored->expires = srv->ttl ? now_ms() + srv->ttl : 0;
+	stored->early = false;
+
+	// All messages live as long, so they expire in the order they are stored
+	// and only the oldest one needs a timer
+	if (client->unsent_tail) {
+		client->unsent_tail->next = stored;
+	} else {
+		client->unsent = stored;
+		if (stored->expires)
+			timer_arm(&srv->wheel, &client->expiry, stored->expires);
+	}
+	client->unsent_tail = stored;
+
+	return stored;
+}
+
+void backlog_trim(server_t *srv, client_t *client) {
+	while (client->unsent) {
+		stored_msg_t *stored = client->unsent;
+		topic_t *topic = client_topic(client, &stored->msg.topic);
+		if (topic && seq_after(stored->msg.seq, topic->acked))
 			break;
+
+		backlog_shift(srv, client);
+	}
+
+	// The expiry timer follows the oldest message
+	backlog_rearm(srv, client);
+}
+
+void backlog_pop(server_t *srv, client_t *client) {
+	if (!client->unsent)
+		return;
+
+	backlog_shift(srv, client);
+	backlog_rearm(srv, client);
+}
+
+// Checks whether a stored message is still to be sent on the client's
+// connection, and finds its topic
+static bool backlog_due(client_t *client, const stored_msg_t *stored,
+						topic_t **topic) {
+	*topic = client_topic(client, &stored->msg.topic);
+
+	return !stored->early &&
+			(!*topic || seq_after(stored->msg.seq, (*topic)->acked));
+}
+
+// Sends a stored message, in the priority class of its topic
+static bool backlog_send(server_t *srv, client_t *client,
+							const stored_msg_t *stored, const topic_t *topic) {
+	msg_cache_t cache;
+	cache_init(&cache);
+	bool sent = send_msg(srv, client, &stored->msg,
+							topic ? topic->prio : PRIO_NORMAL, &cache);
+	cache_free(&cache);
+
+	return sent;
+}
+
+bool backlog_replay(server_t *srv, client_t *client) {
+	// Resuming clients acknowledge what they processed
+	if (client->flags & CONN_RESUME)
+		backlog_trim(srv, client);
+
+	// The messages of urgent topics do not wait for the others
+	bool resume = client->flags & CONN_RESUME;
+	stored_msg_t *it = client->urgent || resume ? client->unsent : NULL;
+	for (; it; it = it->next) {
+		// What was sent on an older connection is sent again, unless the
+		// client loses the messages once sent
+		if (resume)
+			it->early = false;
+
+		topic_t *topic;
+		if (!backlog_due(client, it, &topic) || !topic ||
+			topic->prio != PRIO_URGENT)
+			continue;
+
+		if (!backlog_send(srv, client, it, topic))
+			return false;
+		it->early = true;
+	}
+
+	// The others follow as the connection drains
+	client->replay = client->unsent;
+	return lanes_flush(srv, client);
+}
+
+bool backlog_feed(server_t *srv, client_t *client) {
+	unsigned int n = 0;
+
+	while (n < REPLAY_BATCH && client->replay) {
+		stored_msg_t *stored = client->replay;
+		topic_t *topic;
+
+		if (backlog_due(client, stored, &topic)) {
+			if (!backlog_send(srv, client, stored, topic))
+				return false;
+			++n;
 		}
-		client_node = client_node->next;
+		client->replay = stored->next;
+
+		// The others lose the messages once sent (even if they never read
+		// them), the replay being at the oldest one
+		if (!(client->flags & CONN_RESUME))
+			backlog_shift(srv, client);
 	}
 
-	// If the client does not exist, adds it to the clients list and
-	// sets up its fields
-	if (!found) {
-		add_socket(pfds, nfds, socket);
+	// The expiry timer follows the oldest message left
+	if (!(client->flags & CONN_RESUME))
+		backlog_rearm(srv, client);
 
-		client_t *new = calloc(1, sizeof(client_t));
-		DIE(!new, "new client calloc() failed");
+	return true;
+}
 
-		strcpy(new->id, buffer);
-		new->socket = socket;
-		new->online = true;
-		new->unsent = list_create(sizeof(tcp_msg_t));
-		new->topics = list_create(sizeof(topic_t));
+void backlog_clear(server_t *srv, client_t *client) {
+	timer_cancel(&srv->wheel, &client->expiry);
 
-		list_add_head(clients, new);
+	while (client->unsent)
+		backlog_shift(srv, client);
+	client->unsent_tail = NULL;
+}
 
-		// Prints a message indicating a new client has connected
-		printf("New client %s connected from %s:%hu.\n", new->id,
-			inet_ntoa(new_tcp.sin_addr), ntohs(new_tcp.sin_port));
+unsigned int interest_hash(const void *data) {
+	return key_hash(&((interest_t *)data)->topic);
+}
 
-		free(new);
+bool interest_equal(const void *a, const void *b) {
+	return key_equal(&((interest_t *)a)->topic, &((interest_t *)b)->topic);
+}
+
+void interest_add(server_t *srv, const topic_key_t *topic) {
+	interest_t key;
+	key.topic = *topic;
+
+	interest_t *entry = ht_get(srv->interest, &key);
+	if (entry) {
+		++entry->refs;
+		return;
+	}
+
+	// A new topic, the federated servers and the UDP socket filter must learn
+	// about it
+	size_t before = ht_mem(srv->interest);
+	key.refs = 1;
+	ht_put(srv->interest, &key);
+	mem_charge_ht(srv, NULL, MEM_SUBS, before, srv->interest);
+	srv->fed.dirty = true;
+	filter_update(srv, true);
+}
+
+void interest_del(server_t *srv, const topic_key_t *topic) {
+	interest_t key;
+	key.topic = *topic;
+
+	interest_t *entry = ht_get(srv->interest, &key);
+	if (!entry || --entry->refs)
+		return;
+
+	// No client is subscribed to the topic anymore
+	size_t before = ht_mem(srv->interest);
+	ht_remove(srv->interest, &key);
+	mem_charge_ht(srv, NULL, MEM_SUBS, before, srv->interest);
+	srv->fed.dirty = true;
+	filter_update(srv, false);
+}
+
+shm_ring_t *attach_ring(int socket, conn_packet_t *conn) {
+	if (!(conn->flags & CONN_SHM))
+		return NULL;
+
+	// Only clients on the same host share memory with the server, which is
+	// the case when both ends of the connection have the same address
+	struct sockaddr_in local, peer;
+	socklen_t len = sizeof(struct sockaddr_in);
+	if (getsockname(socket, (struct sockaddr *)&local, &len) < 0)
+		return NULL;
+	len = sizeof(struct sockaddr_in);
+	if (getpeername(socket, (struct sockaddr *)&peer, &len) < 0)
+		return NULL;
+	if (local.sin_addr.s_addr != peer.sin_addr.s_addr)
+		return NULL;
+
+	conn->shm[SHMNAMSIZ - 1] = '\0';
+	shm_ring_t *ring = ring_attach(conn->shm);
+
+	// The mapping is kept even if the client exits without cleaning up
+	if (ring)
+		shm_unlink(conn->shm);
+
+	return ring;
+}
+
+// Hashes the ID of a client index entry
+static unsigned int id_hash(const void *data) {
+	const client_ref_t *ref = data;
+
+	return ht_hash_bytes(ref->id, strlen(ref->id), HT_SEED);
+}
+
+// Compares the IDs of two client index entries
+static bool id_equal(const void *a, const void *b) {
+	return !strcmp(((client_ref_t *)a)->id, ((client_ref_t *)b)->id);
+}
+
+// Accounts for the memory of a pending connection, which is then freed (its
+// resume vector, if any, being counted as soon as it is allocated)
+static void handshake_uncharge(server_t *srv, const handshake_t *hs) {
+	long size = sizeof(handshake_t);
+	if (hs->resume)
+		size += ntohs(hs->hdr.count) * sizeof(resume_entry_t) + 1;
+
+	mem_charge(srv, NULL, MEM_CLIENTS, -size);
+}
+
+// Drops a connection that did not identify itself
+static void handshake_drop(server_t *srv, handshake_t *hs) {
+	handshake_uncharge(srv, hs);
+	timer_cancel(&srv->wheel, &hs->timeout);
+	unwatch_socket(srv, hs->socket);
+	close(hs->socket);
+	free(hs->resume);
+	free(hs);
+}
+
+// Drops a connection that did not identify itself in time
+static void handshake_timeout(void *ctx, wtimer_t *timer) {
+	handshake_drop(ctx, timer->data);
+}
+
+// Closes a connection whose zero-copy sends completed, resetting it if the
+// kernel still holds some of their buffers
+static void zc_close(server_t *srv, zc_closing_t *closing) {
+	if (closing->zc.count) {
+		struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+		setsockopt(closing->socket, SOL_SOCKET, SO_LINGER, &linger,
+					sizeof(linger));
 	}
-	// If the client exists and is offline, reconnects it and
-	// sends unsent messages
-	else if (found && !found->online) {
-		// Is back online
-		add_socket(pfds, nfds, socket);
-		found->socket = socket;
-		found->online = true;
 
-		// Prints a message indicating the client has reconnected
-		printf("New client %s connected from %s:%hu.\n", found->id,
-			inet_ntoa(new_tcp.sin_addr), ntohs(new_tcp.sin_port));
+	close(closing->socket);
+	zc_release(&closing->zc);
+	list_remove(srv->closing, closing);
+}
+
+// Writes the buffered records of the capture, so that a crash loses little
+static void capture_flush(void *ctx, wtimer_t *timer) {
+	server_t *srv = ctx;
+
+	DIE(fflush(srv->capture), "capture fflush() failed");
+	timer_arm(&srv->wheel, timer, now_ms() + CAP_FLUSH_INTERVAL);
+}
+
+// Checks whether the zero-copy sends of a closed connection completed
+static void zc_linger_check(void *ctx, wtimer_t *timer) {
+	server_t *srv = ctx;
+	zc_closing_t *closing = timer->data;
+	uint64_t now = now_ms();
+
+	bool copied = false;
+	zc_complete(&closing->zc, closing->socket, &copied);
+
+	if (closing->zc.count && now < closing->deadline) {
+		timer_arm(&srv->wheel, timer, now + ZC_LINGER_CHECK);
+		return;
+	}
+
+	zc_close(srv, closing);
+}
+
+void zc_linger(server_t *srv, int socket, zc_queue_t *zc) {
+	bool copied = false;
+	zc_complete(zc, socket, &copied);
+
+	if (!zc->count) {
+		close(socket);
+		zc_release(zc);
+		return;
+	}
+
+	// The client sees the connection closed at once, while the kernel still
+	// sends (and reads) what was queued
+	shutdown(socket, SHUT_RDWR);
+
+	zc_closing_t closing;
+	closing.socket = socket;
+	closing.zc = *zc;
+	closing.deadline = now_ms() + ZC_LINGER;
+	memset(zc, 0, sizeof(zc_queue_t));
+
+	list_add_head(srv->closing, &closing);
+	zc_closing_t *stored = srv->closing->head->data;
+	timer_init(&stored->check, zc_linger_check, stored);
+	timer_arm(&srv->wheel, &stored->check, now_ms() + ZC_LINGER_CHECK);
+}
+
+// Disconnects a client that stopped sending packets, or else sends it a
+// heartbeat if nothing else was sent to it lately
+static void client_heartbeat(void *ctx, wtimer_t *timer) {
+	server_t *srv = ctx;
+	client_t *client = timer->data;
+	uint64_t now = now_ms();
+
+	if (now - client->last_rx >= IDLE_TIMEOUT) {
+		client_disconnect(srv, client);
+		return;
+	}
+
+	if (now - client->last_tx >= HEARTBEAT_INTERVAL &&
+		!send_heartbeat(srv, client)) {
+		client_disconnect(srv, client);
+		return;
+	}
 
-		// Sends unsent messages, clearing the unsent messages list
-		node_t *unsent_node = found->unsent->head, *next;
-		while (unsent_node) {
-			tcp_msg_t unsent = *(tcp_msg_t *)unsent_node->data;
-			int ret = send(found->socket, &unsent, found->unsent->data_size, 0);
-			DIE(ret < 0, "unsent send() failed");
+	// Checks again when the next heartbeat is due, or when the client
+	// becomes idle
+	uint64_t next = client->last_tx + HEARTBEAT_INTERVAL;
+	if (client->last_rx + IDLE_TIMEOUT < next)
+		next = client->last_rx + IDLE_TIMEOUT;
+	timer_arm(&srv->wheel, timer, next);
+}
+
+// Watches the listening socket again, once some resources may be free
+static void accept_resume(void *ctx, wtimer_t *timer) {
+	(void)timer;
+	server_t *srv = ctx;
+
+	srv->pfds[1].events = POLLIN;
+}
+
+void tcp(server_t *srv) {
+	for (int n = 0; n < ACCEPT_BATCH; ++n) {
+		// Accepts a new connection on the TCP socket
+		struct sockaddr_in new_tcp;
+		socklen_t len = sizeof(struct sockaddr_in);
+		int socket = accept4(srv->socks->tcp_sock, (struct sockaddr *)&new_tcp,
+								&len, SOCK_NONBLOCK);
+		if (socket < 0) {
+			// The connection was reset before being accepted
+			if (errno == ECONNABORTED || errno == EINTR)
+				continue;
+
+			// No more pending connections
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
 
-			next = unsent_node->next;
+			// No more file descriptors or memory: the pending connections
+			// keep the listening socket readable, so it is not watched for a
+			// while
+			if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+				errno == ENOMEM) {
+				srv->pfds[1].events = 0;
+				timer_arm(&srv->wheel, &srv->accept_retry,
+							now_ms() + ACCEPT_RETRY);
+				break;
+			}
 
-			free(unsent_node->data);
-			free(unsent_node);
+			DIE(true, "new socket accept4() failed");
+		}
 
-			unsent_node = next;
+		// The pollfd array is full
+		if (socket >= MAX_PFDS || srv->nfds == MAX_PFDS) {
+			close(socket);
+			continue;
 		}
+
+		// Waits for the connection packet
+		handshake_t *hs = calloc(1, sizeof(handshake_t));
+		DIE(!hs, "handshake calloc() failed");
+		mem_charge(srv, NULL, MEM_CLIENTS, sizeof(handshake_t));
+		hs->socket = socket;
+		hs->addr = new_tcp;
+		timer_init(&hs->timeout, handshake_timeout, hs);
+		timer_arm(&srv->wheel, &hs->timeout, now_ms() + HANDSHAKE_TIMEOUT);
+
+		watch_socket(srv, socket, FD_HANDSHAKE, hs);
+	}
+}
+
+// Handles a complete connection packet
+static void handshake_done(server_t *srv, handshake_t *hs) {
+	int socket = hs->socket;
+	struct sockaddr_in new_tcp = hs->addr;
+	conn_packet_t conn = hs->conn;
+
+	// A resume vector only makes sense to the server that numbered its
+	// messages
+	resume_entry_t *resume = hs->resume;
+	unsigned int nresume = ntohs(hs->hdr.count);
+	if (!resume || ntohl(hs->hdr.epoch) != srv->epoch) {
+		free(resume);
+		resume = NULL;
+		nresume = 0;
+	}
+
+	handshake_uncharge(srv, hs);
+	timer_cancel(&srv->wheel, &hs->timeout);
+	free(hs);
+
+	conn.id[IDSIZ - 1] = '\0';
+
+	// Federated servers are not clients (their links stay non-blocking too,
+	// what does not fit waiting in their transmit queue)
+	if (conn.flags & CONN_PEER) {
+		free(resume);
+		fed_accept(srv, socket);
+		return;
+	}
+
+	// Checks if the client already exists in the clients list
+	client_ref_t key;
+	strcpy(key.id, conn.id);
+	client_ref_t *ref = ht_get(srv->ids, &key);
+	client_t *found = ref ? ref->client : NULL;
+
+	// New clients are turned away once memory runs low
+	if (!found && !mem_admit(srv)) {
+		unwatch_socket(srv, socket);
+		close(socket);
+		free(resume);
+		++srv->mem.rejected_clients;
+		printf("Client %s rejected: memory cap reached.\n", conn.id);
+		return;
+	}
+
+	// If the client does not exist, adds it to the clients list and
+	// sets up its fields
+	if (!found) {
+		client_t *new = calloc(1, sizeof(client_t));
+		DIE(!new, "new client calloc() failed");
+
+		strcpy(new->id, conn.id);
+		new->topics = ht_create(sizeof(topic_t), topic_hash, topic_equal);
+		new->dict = ht_create(sizeof(dict_entry_t), dict_hash, dict_equal);
+
+		list_add_head(srv->clients, new);
+		free(new);
+
+		// The stored copy is indexed by its ID, and its timers point to it
+		found = srv->clients->head->data;
+		key.client = found;
+		size_t before = ht_mem(srv->ids);
+		ht_put(srv->ids, &key);
+
+		mem_charge(srv, found, MEM_CLIENTS, sizeof(node_t) + sizeof(client_t));
+		mem_charge_ht(srv, found, MEM_CLIENTS, before, srv->ids);
+		mem_charge(srv, found, MEM_SUBS, ht_mem(found->topics));
+		mem_charge(srv, found, MEM_BUFFERS, ht_mem(found->dict));
+		timer_init(&found->expiry, backlog_expire, found);
+		timer_init(&found->heartbeat, client_heartbeat, found);
 	}
 	// If the client exists and is already online, closes the connection
-	else {
+	else if (found->online) {
+		unwatch_socket(srv, socket);
 		close(socket);
+		free(resume);
 		printf("Client %s already connected.\n", found->id);
+		return;
 	}
+
+	// Prints a message indicating a new client has connected
+	printf("New client %s connected from %s:%hu.\n", found->id,
+		inet_ntoa(new_tcp.sin_addr), ntohs(new_tcp.sin_port));
+
+	if (srv->capture)
+		cap_event(srv->capture, CAP_CONNECT, &new_tcp, found->id, &conn.flags,
+					sizeof(uint8_t));
+
+	client_connect(srv, found, socket, &conn, resume, nresume);
+	free(resume);
 }
 
-void udp(list_t *clients, sockets_t *socks, char *buffer) {
-	// Clears the buffer
-	memset(buffer, 0, BUFSIZ);
+void client_connect(server_t *srv, client_t *client, int socket,
+					conn_packet_t *conn, const resume_entry_t *resume,
+					unsigned int nresume) {
+	// Is online, with a new connection (and an empty dictionary)
+	srv->fds[socket].kind = FD_CLIENT;
+	srv->fds[socket].ptr = client;
+	client->socket = socket;
+	client->online = true;
+	client->flags = conn->flags;
+	client->rx_len = 0;
+	dict_clear(srv, client);
+	client->ring = attach_ring(socket, conn);
+	client->zerocopy = srv->zc_min && zc_enable(socket);
+
+	// Watches the connection's liveness
+	client->last_rx = client->last_tx = now_ms();
+	timer_arm(&srv->wheel, &client->heartbeat,
+				client->last_rx + HEARTBEAT_INTERVAL);
+
+	// The resume vector acknowledges the messages the client processed
+	for (unsigned int i = 0; i < nresume; ++i) {
+		topic_key_t name;
+		key_set(&name, resume[i].topic, TOPICSIZ - 1);
+
+		topic_t *topic = client_topic(client, &name);
+		uint32_t seq = ntohl(resume[i].seq);
+		if (topic && seq_after(seq, topic->acked))
+			topic->acked = seq;
+	}
 
-	struct sockaddr_in new_udp;
+	// Resuming clients learn which numbering the messages follow first, then
+	// get the messages stored for them that they did not process
+	if ((client->flags & CONN_RESUME && !send_epoch(srv, client)) ||
+		!backlog_replay(srv, client))
+		client_disconnect(srv, client);
+}
 
-	// Receives a UDP message from the socket and store it in the buffer
-	int ret = recvfrom(socks->udp_sock, buffer, sizeof(udp_msg_t), 0,
-						(struct sockaddr *)&new_udp, &socks->len);
-	DIE(ret < 0, "udp recvfrom() failed");
+// Finds where the next bytes of a handshake go: the connection packet, then
+// (with CONN_RESUME) the resume vector's header and entries
+// Returns the number of bytes expected there, 0 once everything was received.
+static size_t handshake_next(handshake_t *hs, uint8_t **dst) {
+	size_t got = hs->got;
 
-	// Declares variables to store the received UDP message and the
-	// TCP message to be sent
-	tcp_msg_t tcp_send;
-	memset(&tcp_send, 0, sizeof(tcp_msg_t));
-	udp_msg_t *udp_recv;
-	udp_recv = (udp_msg_t *)buffer;
+	if (got < CONNLEN) {
+		*dst = (uint8_t *)&hs->conn + got;
+		return CONNLEN - got;
+	}
 
-	// Copies the UDP client's IP and port (in network order)
-	strcpy(tcp_send.ip, inet_ntoa(new_udp.sin_addr));
-	tcp_send.port = new_udp.sin_port;
+	if (!(hs->conn.flags & CONN_RESUME))
+		return 0;
 
-	// Extracts the topic and ensures that it is null-terminated
-	strcpy(tcp_send.topic, udp_recv->topic);
-	tcp_send.topic[50] = '\0';
+	got -= CONNLEN;
+	if (got < sizeof(resume_hdr_t)) {
+		*dst = (uint8_t *)&hs->hdr + got;
+		return sizeof(resume_hdr_t) - got;
+	}
 
-	// Depending on the message type, extracts the message's content
-	// and stores it in the TCP message structure
-	if (udp_recv->type == INT) {
-		// Converts to host order
-		uint32_t int_num = ntohl(*(uint32_t *)(udp_recv->content + 1));
+	got -= sizeof(resume_hdr_t);
+	size_t len = ntohs(hs->hdr.count) * sizeof(resume_entry_t);
+	*dst = (uint8_t *)hs->resume + got;
+	return len - got;
+}
 
-		// Changes the sign, if necessary
-		if (udp_recv->content[0] == 1)
-			int_num = int_num * (-1);
+void handshake_recv(server_t *srv, handshake_t *hs) {
+	while (true) {
+		uint8_t *dst;
+		size_t want = handshake_next(hs, &dst);
+		if (!want) {
+			handshake_done(srv, hs);
+			return;
+		}
 
-		sprintf(tcp_send.content, "%d", int_num);
+		// Receives the next part of the handshake
+		int ret = recv(hs->socket, dst, want, 0);
+		if (ret < 0 &&
+			(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return;
 
-		strcpy(tcp_send.type, "INT");
-	} else if (udp_recv->type == SHORT_REAL) {
-		// Converts to host order
-		double short_real = ntohs(*(uint16_t *)(udp_recv->content));
+		// The client left before identifying itself
+		if (ret <= 0) {
+			handshake_drop(srv, hs);
+			return;
+		}
 
-		// Converts the number to a short real
-		// Also shifts the decimal point two places
-		short_real = short_real / 100;
+		hs->got += ret;
 
-		strcpy(tcp_send.type, "SHORT_REAL");
+		// Makes room for the resume vector's entries, once their number is
+		// known
+		if (hs->conn.flags & CONN_RESUME &&
+			hs->got == CONNLEN + sizeof(resume_hdr_t)) {
+			unsigned int count = ntohs(hs->hdr.count);
+			if (count > RESUME_MAX) {
+				handshake_drop(srv, hs);
+				return;
+			}
 
-		sprintf(tcp_send.content, "%.2f", short_real);
-	} else if (udp_recv->type == FLOAT) {
-		// Converts to host order
-		double float_num = ntohl(*(uint32_t *)(udp_recv->content + 1));
+			hs->resume = malloc(count * sizeof(resume_entry_t) + 1);
+			DIE(!hs->resume, "resume vector malloc() failed");
+			mem_charge(srv, NULL, MEM_CLIENTS,
+						count * sizeof(resume_entry_t) + 1);
+		}
+	}
+}
 
-		// Gets the decimal point's position
-		int floating_point = 1;
-		for (int i = 0; i < udp_recv->content[5]; ++i)
-			floating_point *= 10;
+bool parse_msg(char *buffer, int len, struct sockaddr_in *addr, msg_t *msg) {
+	// The datagram must contain at least the topic and the type
+	if (len < (int)offsetof(udp_msg_t, content))
+		return false;
 
-		// Converts the number to a float, also shifts the decimal point
-		float_num = float_num / floating_point;
+	udp_msg_t *udp_recv = (udp_msg_t *)buffer;
+	size_t avail = len - offsetof(udp_msg_t, content);
 
-		strcpy(tcp_send.type, "FLOAT");
+	int content = content_len(udp_recv->type, udp_recv->content, avail);
+	if (content < 0)
+		return false;
 
-		// Changes the sign, if necessary
-		if (udp_recv->content[0] == 1)
-			float_num = float_num * (-1);
+	msg->addr = *addr;
 
-		sprintf(tcp_send.content, "%lf", float_num);
-	} else if (udp_recv->type == STRING) {
-		strcpy(tcp_send.type, "STRING");
-		strcpy(tcp_send.content, udp_recv->content);
-	}
+	// Extracts the topic, which is not null-terminated if it fills its field
+	// (the datagram is in a buffer of at least TOPIC_KEY_SIZE bytes)
+	key_load(&msg->topic, udp_recv->topic, TOPICSIZ - 1);
+
+	msg->type = udp_recv->type;
+	msg->len = content;
+	memcpy(msg->content, udp_recv->content, content);
+
+	return true;
+}
+
+// Sends a message to the clients subscribed to its topic
+static void deliver_msg(server_t *srv, const msg_t *msg) {
+	// The encodings are built when the first client needs them
+	msg_cache_t cache;
+	cache_init(&cache);
 
-	// Loops through all clients in the list of clients and sends the TCP
+	// Loops through all clients in the list of clients and sends the
 	// message to clients that have subscribed to the message's topic
-	node_t *client_node = clients->head;
+	node_t *client_node = srv->clients->head;
 	while (client_node) {
 		client_t *client = (client_t *)client_node->data;
-
-		// Loops through all topics subscribed to by the client and checks if
-		// the topic of the received message matches any of them
-		node_t *topic_node = client->topics->head;
-		while (topic_node) {
-			topic_t *topic = (topic_t *)topic_node->data;
-
-			if (!strcmp(topic->name, tcp_send.topic)) {
-				// If the client is online, sends the message
-				if (client->online) {
-					int ret = send(client->socket, &tcp_send,
-						sizeof(tcp_msg_t), 0);
-					DIE(ret < 0, "send() failed");
-				}
-				// If not, it stores the message for when the client
-				// comes back online
-				else {
-					if (topic->sf == 1) {
-						tcp_msg_t *new_tcp_struct = malloc(sizeof(tcp_msg_t));
-						memcpy(new_tcp_struct, &tcp_send, sizeof(tcp_msg_t));
-						list_add_head(client->unsent, new_tcp_struct);
-						free(new_tcp_struct);
-					}
-				}
-				break;
+		topic_t *topic = client_topic(client, &msg->topic);
+
+		if (topic) {
+			// During a replay, the new messages of the topic follow its
+			// stored ones, unless they are urgent
+			bool behind = client->replay && topic->prio != PRIO_URGENT;
+
+			// If the client is offline, it stores the message for when it
+			// comes back online, and so does it until a resuming client
+			// acknowledges it
+			stored_msg_t *stored = NULL;
+			if (topic->sf == 1 &&
+				(!client->online || client->flags & CONN_RESUME || behind))
+				stored = backlog_add(srv, client, msg);
+
+			// If the client is online, sends the message, unless the replay
+			// does (a failed send means the connection is gone)
+			if (client->online && !(stored && behind)) {
+				if (!send_msg(srv, client, msg, topic->prio, &cache))
+					client_disconnect(srv, client);
+				else if (stored)
+					stored->early = true;
 			}
-			topic_node = topic_node->next;
 		}
 		client_node = client_node->next;
 	}
+
+	cache_free(&cache);
 }
 
-void subscriber_protocol(struct pollfd *pfds, int *nfds, list_t *clients, int i,
-							char *buffer) {
-	// Clears the buffer
-	memset(buffer, 0, BUFSIZ);
+void route_msg(server_t *srv, msg_t *msg, bool from_peer) {
+	// Only the messages some client here is subscribed to are numbered
+	interest_t key;
+	key.topic = msg->topic;
+	if (ht_get(srv->interest, &key)) {
+		msg->seq = next_seq(srv, &msg->topic);
+		deliver_msg(srv, msg);
+	}
 
-	// Gets the file descriptor associated with the client
-	int fd = pfds[i].fd;
+	// Only messages published to this server are forwarded, so they never
+	// loop between federated servers
+	if (!from_peer)
+		fed_forward(srv, msg);
+}
+
+void udp(server_t *srv, char *buffer) {
+	struct sockaddr_in new_udp;
+
+	// Reads the datagrams that are already queued, up to a limit, so that the
+	// ones forwarded to federated servers are batched together
+	for (int n = 0; n < UDP_BATCH; ++n) {
+		// Receives a UDP message from the socket and store it in the buffer
+		int ret = recvfrom(srv->socks->udp_sock, buffer, sizeof(udp_msg_t),
+							n ? MSG_DONTWAIT : 0, (struct sockaddr *)&new_udp,
+							&srv->socks->len);
+		if (ret < 0 && n && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		DIE(ret < 0, "udp recvfrom() failed");
+
+		if (srv->capture)
+			cap_datagram(srv->capture, &new_udp, buffer, ret);
+
+		// Decodes the datagram, dropping it if it is malformed
+		msg_t msg;
+		if (parse_msg(buffer, ret, &new_udp, &msg))
+			route_msg(srv, &msg, false);
+	}
+}
+
+void client_disconnect(server_t *srv, client_t *client) {
+	printf("Client %s disconnected.\n", client->id);
+
+	if (srv->capture)
+		cap_event(srv->capture, CAP_DISCONNECT, NULL, client->id, NULL, 0);
+
+	// Is now offline
+	timer_cancel(&srv->wheel, &client->heartbeat);
+	unwatch_socket(srv, client->socket);
+	zc_linger(srv, client->socket, &client->zc);
+	client->online = false;
+	client->socket = EMPTY;
+	ring_detach(&client->ring);
+
+	// What was waiting is lost with the connection (the stored messages are
+	// replayed on the next one)
+	lanes_clear(srv, client);
+}
+
+void topic_subscribe(server_t *srv, client_t *client,
+						const topic_key_t *name, uint8_t sf, uint8_t prio) {
+	topic_t topic;
+	topic.name = *name;
+
+	if (prio >= PRIO_CLASSES)
+		prio = PRIO_NORMAL;
+
+	if (srv->capture) {
+		uint8_t extra[TOPICSIZ] = {(sf == 1) | prio << BULK_PRIO_SHIFT};
+		size_t len = key_len(name);
+		memcpy(extra + 1, name->str, len);
+		cap_event(srv->capture, CAP_SUBSCRIBE, NULL, client->id, extra,
+					1 + len);
+	}
+
+	// Already subscribed
+	if (ht_get(client->topics, &topic))
+		return;
+
+	// New subscriptions are refused once memory runs low
+	if (!mem_admit(srv)) {
+		++srv->mem.rejected_subs;
+		if (!send_reject(srv, client, name))
+			client_disconnect(srv, client);
+		return;
+	}
+
+	// Starts from the next message of the topic (older ones still stored were
+	// sent before an unsubscription)
+	topic.sf = sf;
+	topic.prio = prio;
+	topic.acked = last_seq(srv, name);
+	size_t before = ht_mem(client->topics);
+	ht_put(client->topics, &topic);
+	mem_charge_ht(srv, client, MEM_SUBS, before, client->topics);
+	client->urgent += prio == PRIO_URGENT;
+
+	interest_add(srv, name);
+}
+
+void topic_unsubscribe(server_t *srv, client_t *client,
+						const topic_key_t *name) {
+	topic_t key;
+	key.name = *name;
+
+	if (srv->capture)
+		cap_event(srv->capture, CAP_UNSUBSCRIBE, NULL, client->id, name->str,
+					key_len(name));
+
+	topic_t *topic = ht_get(client->topics, &key);
+	if (!topic)
+		return;
+
+	client->urgent -= topic->prio == PRIO_URGENT;
+
+	size_t before = ht_mem(client->topics);
+	ht_remove(client->topics, &key);
+	mem_charge_ht(srv, client, MEM_SUBS, before, client->topics);
+	interest_del(srv, name);
+}
+
+// Handles the entries of a bulk packet
+// Returns false if they are malformed.
+static bool bulk_packet(server_t *srv, client_t *client, bool subscribe,
+						const uint8_t *body, size_t len) {
+	size_t pos = 0;
+
+	// Stops if the client is disconnected, when a refusal cannot be sent
+	while (client->online && pos < len) {
+		if (len - pos < 2)
+			return false;
+
+		uint8_t sf = body[pos] & BULK_SF;
+		uint8_t prio = body[pos] >> BULK_PRIO_SHIFT;
+		size_t topic_len = body[pos + 1];
+		pos += 2;
+
+		if (!topic_len || topic_len > TOPICSIZ - 1 || len - pos < topic_len)
+			return false;
+
+		topic_key_t name;
+		key_set(&name, (const char *)body + pos, topic_len);
+		pos += topic_len;
+
+		if (subscribe)
+			topic_subscribe(srv, client, &name, sf, prio);
+		else
+			topic_unsubscribe(srv, client, &name);
+	}
+
+	return true;
+}
+
+// Handles a single subscription packet
+static void sub_packet(server_t *srv, client_t *client, sub_packet_t *input) {
+	topic_key_t name;
+	key_set(&name, input->topic, TOPICSIZ - 1);
+
+	// Handles the subscription request
+	if (input->type == SUBSCRIBE) {
+		topic_subscribe(srv, client, &name, input->sf, input->prio);
+	}
+	// Handles the unsubscription request
+	else if (input->type == UNSUBSCRIBE) {
+		topic_unsubscribe(srv, client, &name);
+	}
+	// Handles the acknowledgement of the messages of a topic, freeing the
+	// stored ones
+	else if (input->type == ACK) {
+		topic_t *topic = client_topic(client, &name);
+		uint32_t seq = ntohl(input->seq);
+
+		if (topic && seq_after(seq, topic->acked)) {
+			topic->acked = seq;
+			backlog_trim(srv, client);
+		}
+	}
+	// Handles the client's exit request
+	else if (input->type == EXIT) {
+		client_disconnect(srv, client);
+	}
+}
+
+void subscriber_protocol(server_t *srv, client_t *client) {
+	// Makes room for at least one more read
+	if (client->rx_cap - client->rx_len < BUFSIZ) {
+		size_t cap = client->rx_cap ? 2 * client->rx_cap : BUFSIZ;
+		mem_charge(srv, client, MEM_BUFFERS, cap - client->rx_cap);
+		client->rx_cap = cap;
+		client->rx = realloc(client->rx, client->rx_cap);
+		DIE(!client->rx, "client rx realloc() failed");
+	}
 
 	// Receives data from the client
-	int ret = recv(fd, buffer, PACKLEN, 0);
-	DIE(ret < 0, "subscriber recv() failed");
-
-	// Checks if data was received
-	if (ret) {
-		// Casts the received data to a subscription packet
-		sub_packet_t *input = (sub_packet_t *)buffer;
-
-		// Searches for the client in the list of clients
-		node_t *client_node = clients->head;
-		client_t *found = NULL;
-		while (client_node) {
-			client_t *client = (client_t *)client_node->data;
-			if (fd == client->socket) {
-				found = client;
+	int ret = recv(client->socket, client->rx + client->rx_len,
+					client->rx_cap - client->rx_len, 0);
+
+	// Nothing to read after all (the connection is non-blocking)
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+
+	// The connection was closed (or reset) without an exit request
+	if (ret <= 0) {
+		client_disconnect(srv, client);
+		return;
+	}
+
+	// Any packet shows that the client is alive
+	client->last_rx = now_ms();
+	client->rx_len += ret;
+
+	// Handles all complete packets, until the client exits
+	size_t pos = 0;
+	while (client->online && pos < client->rx_len) {
+		const uint8_t *packet = client->rx + pos;
+		size_t avail = client->rx_len - pos;
+
+		if (packet[0] == SUBSCRIBE_BULK || packet[0] == UNSUBSCRIBE_BULK) {
+			if (avail < BULK_HDR)
 				break;
-			}
-			client_node = client_node->next;
-		}
 
-		// Handles the subscription request
-		if (input->type == SUBSCRIBE) {
-			topic_t *topic_found = NULL;
-
-			// Searches for the topic in the client's list of subscribed topics
-			node_t *topic_node = found->topics->head;
-			while (topic_node) {
-				topic_t *topic = (topic_t *)topic_node->data;
-				if (!strcmp(topic->name, input->topic)) {
-					topic_found = topic;
-					break;
-				}
-				topic_node = topic_node->next;
-			}
+			uint32_t len;
+			memcpy(&len, packet + 1, sizeof(uint32_t));
+			len = ntohl(len);
 
-			// Adds the topic to the client's list of subscribed topics,
-			// if not found
-			if (!topic_found) {
-				topic_t *new_topic = malloc(sizeof(topic_t));
-				strcpy(new_topic->name, input->topic);
-				new_topic->sf = input->sf;
-				list_add_head(found->topics, new_topic);
-				free(new_topic);
+			if (len > BULK_MAX) {
+				client_disconnect(srv, client);
+				return;
 			}
-		}
-		// Handles the unsubscription request 
-		else if (input->type == UNSUBSCRIBE) {
-			node_t *topic_node = found->topics->head;
-			topic_t *topic = (topic_t *)topic_node->data;
-
-			// Removes the topic from the client's list of subscribed topics
-			// Has two cases: if the head must or any other node must be removed
-			if (!strcmp(topic->name, input->topic)) {
-				found->topics->head = found->topics->head->next;
-				free(topic_node->data);
-				free(topic_node);
-			} else {
-				node_t *pred = topic_node;
-				topic_node = topic_node->next;
-				while (topic_node) {
-					topic_t *topic = (topic_t *)topic_node->data;
-					if (!strcmp(topic->name, input->topic)) {
-						pred->next = topic_node->next;
-						free(topic_node->data);
-						free(topic_node);
-						break;
-					}
-					pred = topic_node;
-					topic_node = topic_node->next;
-				}
+			if (avail < BULK_HDR + len)
+				break;
+
+			if (!bulk_packet(srv, client, packet[0] == SUBSCRIBE_BULK,
+								packet + BULK_HDR, len)) {
+				client_disconnect(srv, client);
+				return;
 			}
+			pos += BULK_HDR + len;
+		} else {
+			if (avail < PACKLEN)
+				break;
+
+			sub_packet_t input;
+			memcpy(&input, packet, PACKLEN);
+			sub_packet(srv, client, &input);
+			pos += PACKLEN;
 		}
-		// Handles the client's exit request
-		else if (input->type == EXIT) {
-			// Finds the client and sets them as offline
-			node_t *client_node = clients->head;
-			while (client_node) {
-				client_t *client = (client_t *)client_node->data;
-				if (fd == client->socket) {
-					printf("Client %s disconnected.\n", client->id);
-
-					// Is now offline
-					client->online = false;
-					client->socket = EMPTY;
-					close(fd);
-					remove_socket(pfds, nfds, i);
-
-					break;
-				}
-			client_node = client_node->next;
-			}
+	}
+
+	if (!client->online)
+		return;
+
+	// Keeps the incomplete packet for the next call
+	memmove(client->rx, client->rx + pos, client->rx_len - pos);
+	client->rx_len -= pos;
+
+	// Grows the buffer if the incomplete bulk packet does not fit
+	if (client->rx_len >= BULK_HDR && (client->rx[0] == SUBSCRIBE_BULK ||
+		client->rx[0] == UNSUBSCRIBE_BULK)) {
+		uint32_t len;
+		memcpy(&len, client->rx + 1, sizeof(uint32_t));
+		size_t need = BULK_HDR + ntohl(len);
+		if (need > client->rx_cap) {
+			mem_charge(srv, client, MEM_BUFFERS, need - client->rx_cap);
+			client->rx_cap = need;
+			client->rx = realloc(client->rx, client->rx_cap);
+			DIE(!client->rx, "client rx realloc() failed");
 		}
 	}
 }
 
 int main(int argc, char **argv) {
-	// Checks if there are enough arguments
-	// (at least 2, including the program name)
-	DIE(argc < 2, "Not enough arguments (argv).");
+	// Creates the server state
+	server_t *srv = calloc(1, sizeof(server_t));
+	DIE(!srv, "server calloc() failed");
+	fed_init(srv);
+	wheel_init(&srv->wheel, now_ms());
+	srv->ttl = DEFAULT_TTL * 1000;
+
+	// Any value that differs between starts will do, except 0, which the
+	// subscribers use when they know none
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	srv->epoch = ((uint32_t)ts.tv_sec ^ (uint32_t)ts.tv_nsec ^
+					(uint32_t)getpid() << 16) | 1;
+
+	// Parses the options
+	// -P <IP>:<PORT>: federates with the server at the given address
+	// -T <SECONDS>: time unsent messages are stored (0 to keep them forever)
+	// -b <US>: busy-poll mode, spinning for up to the given time when idle
+	// -B <US>: sets SO_BUSY_POLL on the sockets (may need CAP_NET_ADMIN)
+	// -C <CPU>: runs on the given CPU only
+	// -z <BYTES>: sends STRING messages of at least that size with
+	// MSG_ZEROCOPY
+	// -w <FILE>: records the datagrams and subscriber events to a capture
+	// file
+	// -M <BYTES>: caps the memory used (K, M or G suffixes allowed)
+	// -m <POLICY>: what to do with messages to store at the cap, "shed" (drop
+	// the oldest stored messages, the default) or "refuse" (drop the new one)
+	int opt, busy_poll = 0, cpu = EMPTY;
+	while ((opt = getopt(argc, argv, "P:T:b:B:C:z:w:M:m:")) != -1) {
+		DIE(opt == '?', "Invalid option (argv).");
+		if (opt == 'P')
+			fed_add_peer(srv, optarg);
+		else if (opt == 'T')
+			srv->ttl = (uint64_t)atoi(optarg) * 1000;
+		else if (opt == 'b')
+			srv->busy.max = atoi(optarg);
+		else if (opt == 'B')
+			busy_poll = atoi(optarg);
+		else if (opt == 'C')
+			cpu = atoi(optarg);
+		else if (opt == 'z')
+			srv->zc_min = atoi(optarg);
+		else if (opt == 'w')
+			srv->capture = cap_create(optarg);
+		else if (opt == 'M')
+			DIE(!(srv->mem.cap = mem_parse(optarg)), "Invalid cap (argv).");
+		else if (opt == 'm') {
+			DIE(strcmp(optarg, "shed") && strcmp(optarg, "refuse"),
+				"Invalid policy (argv).");
+			srv->mem.policy = strcmp(optarg, "shed") ? MEM_REFUSE : MEM_SHED;
+		}
+	}
+
+	// Starts spinning as long as possible, then adapts to the traffic
+	srv->busy.spin = srv->busy.max;
+
+	// Pins the server to a CPU, so that spinning does not migrate it
+	if (cpu != EMPTY) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		DIE(sched_setaffinity(0, sizeof(cpu_set_t), &set) < 0,
+			"sched_setaffinity() failed");
+	}
+
+	// Checks if there are enough arguments (the port)
+	DIE(argc - optind < 1, "Not enough arguments (argv).");
 
 	// Sets stdout to unbuffered mode
 	setvbuf(stdout, NULL, _IONBF, BUFSIZ);
 
-	// Creates an array of pollfd structs and initialize the number of fds to 0
-	struct pollfd pfds[MAX_PFDS];
-	int nfds = 0;
+	// Allows as many open files as the pollfd array can hold
+	struct rlimit lim;
+	if (!getrlimit(RLIMIT_NOFILE, &lim)) {
+		lim.rlim_cur = lim.rlim_max < MAX_PFDS ? lim.rlim_max : MAX_PFDS;
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
 
 	// Sets up the server sockets and add them to the pollfd array
-	sockets_t *socks = setup_server(pfds, &nfds, argv[1]);
+	srv->socks = setup_server(srv->pfds, &srv->nfds, argv[optind]);
+	timer_init(&srv->accept_retry, accept_resume, NULL);
+
+	// Lets the kernel poll the device queues of the UDP socket and of the
+	// accepted connections (which inherit it from the listening socket)
+	// Without CAP_NET_ADMIN, this fails above net.core.busy_poll, which is
+	// fine: the sockets are simply not busy-polled
+	if (busy_poll) {
+		setsockopt(srv->socks->udp_sock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll,
+					sizeof(int));
+		setsockopt(srv->socks->tcp_sock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll,
+					sizeof(int));
+	}
+
+	// Creats a linked list of clients, indexed by ID
+	srv->clients = list_create(sizeof(client_t));
+	srv->closing = list_create(sizeof(zc_closing_t));
+	srv->ids = ht_create(sizeof(client_ref_t), id_hash, id_equal);
+
+	// Creates the set of topics the clients are subscribed to
+	srv->interest = ht_create(sizeof(interest_t), interest_hash,
+								interest_equal);
+
+	// Creates the numbering of the topics' messages
+	srv->seqs = ht_create(sizeof(topic_seq_t), seq_hash, seq_equal);
 
-	// Creats a linked list of clients
-	list_t *clients = list_create(sizeof(client_t));
+	// The tables shared by all clients are accounted for as well
+	mem_charge(srv, NULL, MEM_CLIENTS, sizeof(list_t) + ht_mem(srv->ids));
+	mem_charge(srv, NULL, MEM_SUBS, ht_mem(srv->interest) + ht_mem(srv->seqs));
+
+	if (srv->capture) {
+		timer_init(&srv->cap_flush, capture_flush, NULL);
+		timer_arm(&srv->wheel, &srv->cap_flush, now_ms() + CAP_FLUSH_INTERVAL);
+	}
+
+	// Drops the datagrams for topics nobody is subscribed to in the kernel
+	// (unless capturing)
+	filter_init(srv);
 
 	// Main loop of the program, runs until an 'exit' command from stdin is met
 	while (true) {
-		// Waits for events on the pollfd array
-		int ret = poll(pfds, nfds, -1);
+		// Connects to the federated servers that are not linked yet
+		fed_tick(srv);
+
+		// Waits for events on the pollfd array (or for the next reconnection
+		// or timer)
+		int timeout = wheel_timeout(&srv->wheel, now_ms());
+		int fed = fed_timeout(srv);
+		if (fed >= 0 && (timeout < 0 || fed < timeout))
+			timeout = fed;
+
+		int ret = wait_events(srv, timeout);
 
 		// Checks if poll failed and exit the program if it did
 		DIE(ret < 0, "poll() failed");
@@ -422,45 +1607,108 @@ int main(int argc, char **argv) {
 
 		// Handles input from stdin
 		// When receiving "exit", it breaks the loop
-		if (pfds[0].revents & POLLIN)
-			if (!stdin_cmd(buffer))
+		if (srv->pfds[0].revents & POLLIN)
+			if (!stdin_cmd(srv, buffer))
 				break;
 
-		// Handles packets from subscriber TCP clients
-		for (int i = 3; i < nfds; ++i)
-			if (pfds[i].revents & POLLIN)
-				subscriber_protocol(pfds, &nfds, clients, i, buffer);
+		// Handles packets from new connections, subscriber TCP clients and
+		// federated servers
+		// Sockets removed on the way are replaced by the last one, which is
+		// then handled on the next wakeup
+		for (int i = 3; i < srv->nfds; ++i) {
+			short revents = srv->pfds[i].revents;
+			if (!revents)
+				continue;
+
+			fd_info_t *info = &srv->fds[srv->pfds[i].fd];
+			if (info->kind == FD_PEER) {
+				fed_event(srv, info->ptr, revents);
+			} else if (info->kind == FD_CLIENT) {
+				client_t *client = info->ptr;
+
+				// Sends what waits in the lanes, once there is room for it
+				if (revents & POLLOUT && !lanes_flush(srv, client)) {
+					client_disconnect(srv, client);
+					continue;
+				}
+
+				// Zero-copy completions are reported as errors
+				if (revents & POLLERR && zc_drain(client))
+					revents &= ~POLLERR;
+				if (revents & (POLLIN | POLLHUP | POLLERR))
+					subscriber_protocol(srv, client);
+			} else if (info->kind == FD_HANDSHAKE &&
+						revents & (POLLIN | POLLHUP | POLLERR)) {
+				handshake_recv(srv, info->ptr);
+			}
+		}
 
 		// Handles new TCP connections (TCP clients)
-		if (pfds[1].revents & POLLIN)
-			tcp(pfds, &nfds, clients, socks, buffer);
+		if (srv->pfds[1].revents & POLLIN)
+			tcp(srv);
 
 		// Handles UDP connections and sends messages to the TCP clients that are
 		// interested in what the UDP client posted about
-		if (pfds[2].revents & POLLIN)
-			udp(clients, socks, buffer);
+		if (srv->pfds[2].revents & POLLIN)
+			udp(srv, buffer);
+
+		// Fires the expired timers: handshake timeouts, heartbeats and
+		// unsent messages' expiry
+		wheel_run(&srv->wheel, now_ms(), srv);
+
+		// Sends the batches built during this wakeup to the federated servers
+		fed_flush(srv);
 	}
 
 	// Closes all file descriptors in the pollfd array
-	for (int i = 0; i < nfds; ++i) {
-		close(pfds[i].fd);
+	for (int i = 0; i < srv->nfds; ++i) {
+		close(srv->pfds[i].fd);
 	}
 
 	// Frees all resources used by each client
-	node_t *client_node = clients->head;
+	node_t *client_node = srv->clients->head;
 	while (client_node) {
 		client_t *client = (client_t *)client_node->data;
 		client_node = client_node->next;
 
-		list_free(&client->unsent);
-		list_free(&client->topics);
+		backlog_clear(srv, client);
+		ht_free(&client->topics);
+		free(client->rx);
+		ht_free(&client->dict);
+		ring_detach(&client->ring);
+		lanes_clear(srv, client);
+		zc_release(&client->zc);
 	}
 
+	// Closes the connections whose zero-copy sends did not complete
+	while (srv->closing->head)
+		zc_close(srv, srv->closing->head->data);
+	list_free(&srv->closing);
+
 	// Frees the linked list of clients
-	list_free(&clients);
+	list_free(&srv->clients);
+	ht_free(&srv->ids);
+
+	// Frees the pending handshakes (their sockets were closed above)
+	for (int fd = 0; fd < MAX_PFDS; ++fd) {
+		if (srv->fds[fd].kind == FD_HANDSHAKE) {
+			free(((handshake_t *)srv->fds[fd].ptr)->resume);
+			free(srv->fds[fd].ptr);
+		}
+	}
+
+	// Frees the federation state and the set of topics
+	fed_free(srv);
+	ht_free(&srv->interest);
+	ht_free(&srv->seqs);
+
+	// Writes the rest of the capture
+	if (srv->capture)
+		fclose(srv->capture);
 
 	// Frees the server sockets
-	free(socks);
+	free(srv->socks);
+	free(srv);
 
 	return 0;
 }
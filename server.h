@@ -4,8 +4,98 @@
 #ifndef _SERVER_H_
 #define _SERVER_H_
 
+#include <stdio.h>
+#include <poll.h>
+
 #include "structs.h"
 
+// Maximum number of datagrams read from the UDP socket per wakeup
+#define UDP_BATCH 64
+
+// Maximum number of connections accepted per wakeup, so that a connection
+// storm does not delay the other sockets
+#define ACCEPT_BATCH 1024
+
+// Time the listening socket is not watched for after running out of file
+// descriptors or memory, instead of spinning on the pending connection (ms)
+#define ACCEPT_RETRY 100
+
+// Time a new connection has to send its connection packet (ms)
+#define HANDSHAKE_TIMEOUT 5000
+
+// Time a closed connection is kept for the kernel to finish its zero-copy
+// sends, and time between two checks (ms)
+#define ZC_LINGER 10000
+#define ZC_LINGER_CHECK 100
+
+// Default time an unsent message is stored for an offline client (s)
+#define DEFAULT_TTL 3600
+
+// Minimum spin time of the busy-poll mode (us)
+#define BUSY_MIN 50
+
+// What a socket in the pollfd array is used for
+#define FD_NONE 0
+#define FD_HANDSHAKE 1 // a new connection, identifying itself
+#define FD_CLIENT 2
+#define FD_PEER 3 // a federation link
+
+// The encodings of a message shared by all the clients it is sent to, built
+// when the first one needs them
+typedef struct msg_cache_t {
+	tcp_msg_t tcp; // the default wire mode encoding (empty type until built)
+	zc_buf_t *zc_tcp; // the same, for zero-copy sends
+	zc_buf_t *zc_content; // the content, for zero-copy sends in compact mode
+	uint64_t due; // when the message was ready to be sent (monotonic us)
+} msg_cache_t;
+
+// The owner of a socket, indexed by its file descriptor
+typedef struct fd_info_t {
+	uint8_t kind;
+	int idx; // the socket's position in the pollfd array
+	void *ptr; // the handshake_t, client_t or peer_t
+} fd_info_t;
+
+// A closed client's connection, kept open until the kernel no longer reads
+// the buffers of its zero-copy sends
+typedef struct zc_closing_t {
+	int socket;
+	zc_queue_t zc;
+	uint64_t deadline; // when it is reset instead (monotonic ms)
+	wtimer_t check;
+} zc_closing_t;
+
+// An entry of the index of clients by ID
+typedef struct client_ref_t {
+	char id[IDSIZ];
+	client_t *client;
+} client_ref_t;
+
+// The server state
+typedef struct server_t {
+	struct pollfd pfds[MAX_PFDS];
+	int nfds;
+	fd_info_t fds[MAX_PFDS];
+	list_t *clients;
+	htable_t *ids; // the clients, by ID
+	sockets_t *socks;
+	htable_t *interest; // topics subscribed to by at least one client
+	htable_t *seqs; // the numbering of the topics' messages
+	uint32_t epoch; // changes on every start, voiding older resume vectors
+	wheel_t wheel; // timers of the clients and pending handshakes
+	wtimer_t accept_retry; // watches the listening socket again, if paused
+	list_t *closing; // closed connections with zero-copy sends (zc_closing_t)
+	uint64_t ttl; // time unsent messages are stored (ms), 0 if forever
+	federation_t fed;
+	filter_t filter; // drops datagrams for topics nobody is subscribed to
+	busy_t busy;
+	size_t zc_min; // STRING size from which MSG_ZEROCOPY is used, 0 if never
+	FILE *capture; // records the datagrams and subscriber events, if set
+	wtimer_t cap_flush; // writes the capture's buffer periodically
+	mem_t mem; // memory accounting and cap
+	lane_stats_t lanes[PRIO_CLASSES]; // delivery latency, per priority class
+} server_t;
+
 /**
  * @brief Sets up a TCP and UDP server on the specified port and returns a
  * struct containing the socket file descriptors and socket addresses.
@@ -17,51 +107,412 @@
  */
 sockets_t *setup_server(struct pollfd *pfds, int *nfds, char *port);
 
+/**
+ * @brief Gets the current time (monotonic, in ms).
+ */
+uint64_t now_ms(void);
+
+/**
+ * @brief Gets the current time (monotonic, in us).
+ */
+uint64_t now_us(void);
+
+/**
+ * @brief Waits for events on the pollfd array. In busy-poll mode, polls
+ * without sleeping as long as events keep coming (the spin time grows when an
+ * event comes soon after the server went to sleep, and shrinks after long idle
+ * periods), then sleeps.
+ *
+ * @param srv Pointer to the server state
+ * @param timeout How long to wait at most (ms), or -1 to wait for an event
+ *
+ * @return The result of poll
+ */
+int wait_events(server_t *srv, int timeout);
+
+/**
+ * @brief Adds a socket to the pollfd array (waiting for POLLIN) and records
+ * its owner.
+ *
+ * @param srv Pointer to the server state
+ * @param socket The socket
+ * @param kind What the socket is used for (FD_*)
+ * @param ptr The socket's owner
+ */
+void watch_socket(server_t *srv, int socket, uint8_t kind, void *ptr);
+
+/**
+ * @brief Removes a socket from the pollfd array, without closing it. The last
+ * socket in the array takes its place.
+ *
+ * @param srv Pointer to the server state
+ * @param socket The socket
+ */
+void unwatch_socket(server_t *srv, int socket);
+
 /**
  * @brief Reads user input from standard input and checks if it is the "exit"
- * command.
+ * command. The "mem" command prints the memory accounting, and the "prio"
+ * command the delivery latency of each priority class.
  *
+ * @param srv Pointer to the server state
  * @param buffer The buffer to store the user input in
  *
  * @return True if the input is not "exit", false otherwise
  */
-bool stdin_cmd(char *buffer);
+bool stdin_cmd(server_t *srv, char *buffer);
+
+/**
+ * @brief Builds the TCP message sent to clients using the default wire mode.
+ *
+ * @param msg The received message
+ * @param tcp_msg Where to store the TCP message
+ */
+void build_tcp_msg(const msg_t *msg, tcp_msg_t *tcp_msg);
+
+/**
+ * @brief Encodes a message for a client using the compact wire mode. If the
+ * message's topic and publisher pair is not in the client's dictionary yet,
+ * it is added and a dictionary frame is prepended to the data frame.
+ *
+ * @param srv Pointer to the server state
+ * @param client The client the message is sent to
+ * @param msg The received message
+ * @param out Where to store the frames (DICT_FRAME_MAX + FRAME_MAX bytes)
+ *
+ * @return The number of bytes written
+ */
+size_t encode_compact(server_t *srv, client_t *client, const msg_t *msg,
+						uint8_t *out);
+
+/**
+ * @brief Prepares an empty cache of the encodings of a message, ready to be
+ * sent from now on.
+ *
+ * @param cache The cache
+ */
+void cache_init(msg_cache_t *cache);
+
+/**
+ * @brief Drops the references to the zero-copy buffers of a message, once it
+ * was sent to all clients. The pending sends keep their own references.
+ *
+ * @param cache The cache
+ */
+void cache_free(msg_cache_t *cache);
+
+/**
+ * @brief Sends a message to an online client, encoded according to the wire
+ * mode of its connection. STRING messages of at least zc_min bytes are sent
+ * with MSG_ZEROCOPY, if the client's connection supports it and nothing is
+ * waiting in its lanes. Messages written to a shared memory ring do not go
+ * through the lanes.
+ *
+ * @param srv Pointer to the server state
+ * @param client The client the message is sent to
+ * @param msg The received message
+ * @param prio The priority class of the message's topic
+ * @param cache The encodings of the message, reused for other clients
+ *
+ * @return False if the connection failed
+ */
+bool send_msg(server_t *srv, client_t *client, const msg_t *msg, uint8_t prio,
+				msg_cache_t *cache);
+
+/**
+ * @brief Handles the completion notifications of a client's zero-copy sends.
+ * If the kernel had to copy the data, the client stops using them.
+ *
+ * @param client The client
+ *
+ * @return Whether any notification was read
+ */
+bool zc_drain(client_t *client);
+
+/**
+ * @brief Sends a heartbeat to a client, in the urgent class: an empty TCP
+ * message, or a single byte in compact mode.
+ *
+ * @param srv Pointer to the server state
+ * @param client The client
+ *
+ * @return False if the connection failed
+ */
+bool send_heartbeat(server_t *srv, client_t *client);
+
+/**
+ * @brief Sends the server's epoch to a resuming client, before any message:
+ * an epoch frame in compact mode, or a TCP message without a type whose
+ * sequence number is the epoch. It goes in the urgent class.
+ *
+ * @param srv Pointer to the server state
+ * @param client The client
+ *
+ * @return False if the connection failed
+ */
+bool send_epoch(server_t *srv, client_t *client);
+
+/**
+ * @brief Tells a client that its subscription to a topic was refused, in the
+ * urgent class: a reject frame in compact mode, or a TCP message without a
+ * type that carries the topic.
+ *
+ * @param srv Pointer to the server state
+ * @param client The client
+ * @param name The topic
+ *
+ * @return False if the connection failed
+ */
+bool send_reject(server_t *srv, client_t *client, const topic_key_t *name);
+
+/**
+ * @brief Gives the next sequence number of a topic.
+ *
+ * @param srv Pointer to the server state
+ * @param topic The topic
+ *
+ * @return The sequence number (never 0)
+ */
+uint32_t next_seq(server_t *srv, const topic_key_t *topic);
+
+/**
+ * @brief Gets the last sequence number given to a message of a topic.
+ *
+ * @param srv Pointer to the server state
+ * @param topic The topic
+ *
+ * @return The sequence number, 0 if no message was numbered yet
+ */
+uint32_t last_seq(server_t *srv, const topic_key_t *topic);
 
 /**
- * @brief Handles TCP connections by accepting a new client and adding it to the
- * clients list if it does not already exist.
+ * @brief Stores a message for an offline client, until it comes back or the
+ * message expires. Resuming clients also keep the messages sent to them
+ * until they acknowledge them.
+ *
+ * @param srv Pointer to the server state
+ * @param client The client
+ * @param msg The message
+ *
+ * @return The stored message, or NULL if there was no room for it
+ */
+stored_msg_t *backlog_add(server_t *srv, client_t *client, const msg_t *msg);
+
+/**
+ * @brief Frees the oldest stored messages of a client that it acknowledged
+ * (or whose topic it is not subscribed to anymore).
+ *
+ * @param srv Pointer to the server state
+ * @param client The client
+ */
+void backlog_trim(server_t *srv, client_t *client);
+
+/**
+ * @brief Frees the oldest stored message of a client, if any.
+ *
+ * @param srv Pointer to the server state
+ * @param client The client
+ */
+void backlog_pop(server_t *srv, client_t *client);
+
+/**
+ * @brief Starts sending the stored messages a client did not acknowledge.
+ * Those of urgent topics are sent at once, the others follow oldest first,
+ * in batches moved to the lanes as the connection drains. Resuming clients
+ * keep them until they are acknowledged, while the others have them freed
+ * once sent.
+ *
+ * @param srv Pointer to the server state
+ * @param client The client
+ *
+ * @return False if the connection failed
+ */
+bool backlog_replay(server_t *srv, client_t *client);
+
+/**
+ * @brief Sends the next REPLAY_BATCH stored messages of a client's replay.
+ * Ends the replay after the last one.
+ *
+ * @param srv Pointer to the server state
+ * @param client The client
+ *
+ * @return False if the connection failed
+ */
+bool backlog_feed(server_t *srv, client_t *client);
+
+/**
+ * @brief Frees all messages stored for a client.
+ *
+ * @param srv Pointer to the server state
+ * @param client The client
+ */
+void backlog_clear(server_t *srv, client_t *client);
+
+/**
+ * @brief Adds a reference to a topic of the server's interest, when a client
+ * subscribes to it.
+ *
+ * @param srv Pointer to the server state
+ * @param topic The topic
+ */
+void interest_add(server_t *srv, const topic_key_t *topic);
+
+/**
+ * @brief Drops a reference to a topic of the server's interest, when a client
+ * unsubscribes from it.
+ *
+ * @param srv Pointer to the server state
+ * @param topic The topic
+ */
+void interest_del(server_t *srv, const topic_key_t *topic);
+
+/**
+ * @brief Hashes the topic of an interest entry.
+ */
+unsigned int interest_hash(const void *data);
+
+/**
+ * @brief Compares the topics of two interest entries.
+ */
+bool interest_equal(const void *a, const void *b);
+
+/**
+ * @brief Maps the shared memory ring requested by a client, if any. Rings are
+ * only used by clients on the same host as the server.
+ *
+ * @param socket The client's connection
+ * @param conn The client's connection packet
+ *
+ * @return A pointer to the mapped ring, or NULL if the client uses TCP only
+ */
+shm_ring_t *attach_ring(int socket, conn_packet_t *conn);
+
+/**
+ * @brief Accepts the pending TCP connections (up to ACCEPT_BATCH), without
+ * blocking. Each of them starts a handshake, which ends when its connection
+ * packet is received.
+ *
+ * @param srv Pointer to the server state
+ */
+void tcp(server_t *srv);
+
+/**
+ * @brief Receives the available part of a connection packet and of the
+ * resume vector that may follow it. Once they are complete, adds the client to the clients list if it does not already exist.
  * If the client already exists, it reconnects the client and sends any unsent
- * messages.
+ * messages. Connections from federated servers are handed over to the
+ * federation.
  *
- * @param pfds Pointer to an array of pollfd structs
- * @param nfds Pointer to the number of file descriptors in the pfds array
- * @param clients Pointer to the list of connected clients
- * @param socks Pointer to the struct containing the socket fds and addrs
- * @param buffer The buffer to store incoming data in
+ * @param srv Pointer to the server state
+ * @param hs The handshake
+ */
+void handshake_recv(server_t *srv, handshake_t *hs);
+
+/**
+ * @brief Connects a client, after its connection packet was received. Sends
+ * the messages stored while it was offline, skipping those its resume vector
+ * shows it already processed.
+ *
+ * @param srv Pointer to the server state
+ * @param client The client
+ * @param socket The client's connection
+ * @param conn The client's connection packet
+ * @param resume The client's resume vector (NULL if it has none, or if it
+ * refers to another epoch)
+ * @param nresume The number of entries of the resume vector
+ */
+void client_connect(server_t *srv, client_t *client, int socket,
+					conn_packet_t *conn, const resume_entry_t *resume,
+					unsigned int nresume);
+
+/**
+ * @brief Decodes a datagram received from a UDP client.
+ *
+ * @param buffer The datagram
+ * @param len The length of the datagram
+ * @param addr The address of the UDP client
+ * @param msg Where to store the decoded message
+ *
+ * @return True if the datagram is valid, false otherwise
+ */
+bool parse_msg(char *buffer, int len, struct sockaddr_in *addr, msg_t *msg);
+
+/**
+ * @brief Numbers a message in its topic and forwards it to the subscribed
+ * clients, storing it for the offline ones with sf set. Messages published to
+ * this server are also forwarded to the federated servers interested in their
+ * topic.
+ *
+ * @param srv Pointer to the server state
+ * @param msg The message
+ * @param from_peer Whether the message was forwarded by a federated server
  */
-void tcp(struct pollfd *pfds, int *nfds, list_t *clients, sockets_t *socks,
-			char *buffer);
+void route_msg(server_t *srv, msg_t *msg, bool from_peer);
 
 /**
  * @brief Handles incoming UDP messages by forwarding them to subscribed
- * clients.
+ * clients. Reads up to UDP_BATCH datagrams per call.
  *
- * @param clients Pointer to the list of connected clients
- * @param socks Pointer to the struct containing the socket fds and addrs
+ * @param srv Pointer to the server state
  * @param buffer The buffer to store incoming data in
  */
-void udp(list_t *clients, sockets_t *socks, char *buffer);
+void udp(server_t *srv, char *buffer);
 
 /**
- * @brief Handles packets from subscribers.
+ * @brief Sets a client as offline, closing its connection. Also used when
+ * the client sends nothing for IDLE_TIMEOUT ms or a send fails.
  *
- * @param pfds Pointer to an array of pollfd structs
- * @param nfds Pointer to the number of file descriptors in the pfds array
- * @param clients Pointer to the list of connected clients
- * @param i The client's fd's position relative to the array of pollfd structs
- * @param buffer The buffer to store incoming data in
+ * @param srv Pointer to the server state
+ * @param client The client
+ */
+void client_disconnect(server_t *srv, client_t *client);
+
+/**
+ * @brief Closes a client's connection once the kernel no longer reads the
+ * buffers of its zero-copy sends. Until their completions arrive, the
+ * connection is shut down but kept open (off the pollfd array), and it is
+ * reset after ZC_LINGER ms.
+ *
+ * @param srv Pointer to the server state
+ * @param socket The connection's socket, no longer watched
+ * @param zc Its pending zero-copy sends, taken over (and emptied)
+ */
+void zc_linger(server_t *srv, int socket, zc_queue_t *zc);
+
+/**
+ * @brief Subscribes a client to a topic, unless it already is. Once memory
+ * runs low, the subscription is refused and the client is told so (it is
+ * disconnected if that fails).
+ *
+ * @param srv Pointer to the server state
+ * @param client The client
+ * @param name The topic
+ * @param sf Whether messages are stored while the client is offline
+ * @param prio The priority class of its messages (PRIO_NORMAL if invalid)
+ */
+void topic_subscribe(server_t *srv, client_t *client,
+						const topic_key_t *name, uint8_t sf, uint8_t prio);
+
+/**
+ * @brief Unsubscribes a client from a topic, if it is subscribed to it.
+ *
+ * @param srv Pointer to the server state
+ * @param client The client
+ * @param name The topic
+ */
+void topic_unsubscribe(server_t *srv, client_t *client,
+						const topic_key_t *name);
+
+/**
+ * @brief Handles packets from subscribers, which may arrive in several parts
+ * or many at once. A closed connection counts as an exit request, heartbeats
+ * only mark the client as alive, acknowledgements free the stored messages
+ * the client processed and bulk packets subscribe to (or unsubscribe from)
+ * many topics at once. Malformed bulk packets close the connection.
+ *
+ * @param srv Pointer to the server state
+ * @param client The client
  */
-void subscriber_protocol(struct pollfd *pfds, int *nfds, list_t *clients,
-							int i, char *buffer);
+void subscriber_protocol(server_t *srv, client_t *client);
 
 #endif /* _SERVER_H_ */
@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: EUPL-1.2
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shm_ring.h"
+
+// Lets the sibling hyperthread run while spinning
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+// Sleeps while a shared futex word still holds the given value
+static void futex_wait(_Atomic uint32_t *word, uint32_t val) {
+	syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+// Wakes up the process sleeping on a shared futex word
+static void futex_wake(_Atomic uint32_t *word) {
+	syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// Copies bytes between a linear buffer and the ring's data area, starting
+// at a free-running position and wrapping around the end
+// The size is never read from the ring, which the other process may write.
+static void ring_copy(shm_ring_t *ring, uint32_t pos, void *buf, size_t len,
+						bool to_ring) {
+	uint32_t off = pos & (SHM_RING_SIZE - 1);
+	size_t first = SHM_RING_SIZE - off < len ? SHM_RING_SIZE - off : len;
+
+	if (to_ring) {
+		memcpy(ring->data + off, buf, first);
+		memcpy(ring->data, (uint8_t *)buf + first, len - first);
+	} else {
+		memcpy(buf, ring->data + off, first);
+		memcpy((uint8_t *)buf + first, ring->data, len - first);
+	}
+}
+
+shm_ring_t *ring_create(const char *name) {
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0)
+		return NULL;
+
+	size_t len = sizeof(shm_ring_t) + SHM_RING_SIZE;
+	if (ftruncate(fd, len) < 0) {
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+
+	shm_ring_t *ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+							fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED) {
+		shm_unlink(name);
+		return NULL;
+	}
+
+	// The object is zero-filled, so only the constants are set
+	ring->size = SHM_RING_SIZE;
+	atomic_store(&ring->head, 0);
+	atomic_store(&ring->tail, 0);
+	ring->magic = SHM_MAGIC;
+
+	return ring;
+}
+
+shm_ring_t *ring_attach(const char *name) {
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return NULL;
+
+	// The object must hold a whole ring
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size != sizeof(shm_ring_t) + SHM_RING_SIZE) {
+		close(fd);
+		return NULL;
+	}
+
+	shm_ring_t *ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+							MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED)
+		return NULL;
+
+	if (ring->magic != SHM_MAGIC || ring->size != SHM_RING_SIZE) {
+		munmap(ring, st.st_size);
+		return NULL;
+	}
+
+	return ring;
+}
+
+void ring_detach(shm_ring_t **ring) {
+	if (!(*ring))
+		return;
+
+	munmap(*ring, sizeof(shm_ring_t) + SHM_RING_SIZE);
+	*ring = NULL;
+}
+
+bool ring_write(shm_ring_t *ring, const void *buf, size_t len) {
+	if (len > SHM_RING_SIZE)
+		return false;
+
+	// The server never waits for the reader, since it serves the other
+	// clients meanwhile
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (SHM_RING_SIZE - (head - tail) < len)
+		return false;
+
+	ring_copy(ring, head, (void *)buf, len, true);
+
+	// Publishes the message, then wakes up the reader if it went to sleep
+	atomic_store(&ring->head, head + len);
+	if (atomic_load(&ring->reader_sleeping))
+		futex_wake(&ring->head);
+
+	return true;
+}
+
+size_t ring_read(shm_ring_t *ring, void *buf, size_t len) {
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint32_t head;
+
+	// Spins while the ring is empty, then sleeps until the writer wakes it up
+	for (unsigned int spin = 0; ; ++spin) {
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		if (head != tail)
+			break;
+
+		if (spin < SHM_SPIN) {
+			cpu_relax();
+			continue;
+		}
+
+		atomic_store(&ring->reader_sleeping, 1);
+
+		// Checks again, in case the writer published before seeing the flag
+		head = atomic_load(&ring->head);
+		if (head == tail)
+			futex_wait(&ring->head, head);
+
+		atomic_store(&ring->reader_sleeping, 0);
+
+		// Woken up with nothing to read, by ring_wake()
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		if (head == tail)
+			return 0;
+		break;
+	}
+
+	size_t avail = head - tail;
+	if (avail > len)
+		avail = len;
+
+	ring_copy(ring, tail, buf, avail, false);
+
+	// Frees the space
+	atomic_store(&ring->tail, tail + avail);
+
+	return avail;
+}
+
+void ring_wake(shm_ring_t *ring) {
+	futex_wake(&ring->head);
+}
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: EUPL-1.2 */
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#ifndef _SHM_RING_H_
+#define _SHM_RING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// Magic number at the start of every ring
+#define SHM_MAGIC 0x70636f6d
+
+// Size of the data area of a ring (a power of two)
+#define SHM_RING_SIZE (1 << 20)
+
+// Number of empty checks before the reader sleeps
+#define SHM_SPIN 4096
+
+// A single-producer single-consumer byte ring in shared memory. The server
+// writes whole messages and publishes them by advancing head, the subscriber
+// reads them and advances tail. Both positions run freely and are masked.
+typedef struct shm_ring_t {
+	uint32_t magic;
+	uint32_t size; // size of the data area (checked once, never used)
+	_Alignas(64) _Atomic uint32_t head; // write position (futex word)
+	_Atomic uint32_t reader_sleeping;
+	_Alignas(64) _Atomic uint32_t tail; // read position
+	_Alignas(64) uint8_t data[];
+} shm_ring_t;
+
+/**
+ * @brief Creates a ring in a new POSIX shared memory object.
+ *
+ * @param name The object's name (starting with '/').
+ *
+ * @return A pointer to the mapped ring, or NULL if it could not be created.
+ */
+shm_ring_t *ring_create(const char *name);
+
+/**
+ * @brief Maps an existing ring, created by another process.
+ *
+ * @param name The object's name.
+ *
+ * @return A pointer to the mapped ring, or NULL if it is missing or invalid.
+ */
+shm_ring_t *ring_attach(const char *name);
+
+/**
+ * @brief Unmaps a ring.
+ *
+ * @param ring A pointer to the pointer to the ring.
+ */
+void ring_detach(shm_ring_t **ring);
+
+/**
+ * @brief Writes a message to a ring and wakes up the reader, if it sleeps.
+ * Never waits for the reader: fails at once if the ring is full.
+ *
+ * @param ring The ring.
+ * @param buf The message.
+ * @param len The message's length.
+ *
+ * @return True if the message was written, false if the ring is full.
+ */
+bool ring_write(shm_ring_t *ring, const void *buf, size_t len);
+
+/**
+ * @brief Reads the bytes available in a ring. If the ring is empty, spins for
+ * a while and then sleeps until some bytes are written, or until ring_wake()
+ * is called.
+ *
+ * @param ring The ring.
+ * @param buf Where to copy the bytes.
+ * @param len The size of the buffer.
+ *
+ * @return The number of bytes read, 0 if woken up with nothing to read.
+ */
+size_t ring_read(shm_ring_t *ring, void *buf, size_t len);
+
+/**
+ * @brief Wakes up the reader of a ring if it sleeps, e.g. so that it stops.
+ * A wakeup may be missed if the reader is about to sleep, so it should be
+ * repeated until the reader is seen to stop.
+ *
+ * @param ring The ring.
+ */
+void ring_wake(shm_ring_t *ring);
+
+#endif /* _SHM_RING_H_ */
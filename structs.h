@@ -10,10 +10,15 @@
 #include <sys/socket.h>
 
 #include "list.h"
+#include "htable.h"
+#include "shm_ring.h"
+#include "timer.h"
+#include "zerocopy.h"
+#include "topic_key.h"
 
 // Maximum number of file descriptors and clients allowed (used for listen)
-#define MAX_PFDS 1000
-#define MAX_CLIENTS 1000
+#define MAX_PFDS 65536
+#define MAX_CLIENTS 4096
 
 // Sizes of various fields
 #define IDSIZ 10
@@ -21,11 +26,64 @@
 #define TOPICSIZ 51
 #define CONTENTSIZ 1501
 #define IPV4_LEN 16
+#define SHMNAMSIZ 32
 
 // Constants for message types
 #define SUBSCRIBE 0
 #define UNSUBSCRIBE 1
 #define EXIT 2
+#define HEARTBEAT 3
+#define ACK 4 // the last sequence number of a topic the client processed
+#define SUBSCRIBE_BULK 5 // many topics at once, in a bulk packet
+#define UNSUBSCRIBE_BULK 6
+
+// A bulk packet starts with its type and the length of its entries (4 bytes,
+// network order), each entry being a flags byte (the sf flag, and the
+// priority class from BULK_PRIO_SHIFT), the topic's length (1 byte) and the
+// topic
+#define BULK_HDR 5
+#define BULK_SF 0x01
+#define BULK_PRIO_SHIFT 1
+
+// Maximum length of the entries of a bulk packet
+#define BULK_MAX 65536
+
+// A subscriber sends a heartbeat when it sent nothing else for this long, and
+// so does the server (ms)
+#define HEARTBEAT_INTERVAL 5000
+
+// Time without any packet after which a subscriber is disconnected (ms)
+#define IDLE_TIMEOUT 15000
+
+// Flags for the connection packet
+#define CONN_COMPACT 0x01 // topic dictionary wire mode
+#define CONN_PEER 0x02 // a federated server instead of a subscriber
+#define CONN_SHM 0x04 // shared memory transport (same host only)
+#define CONN_RESUME 0x08 // a resume vector follows the connection packet
+
+// Maximum number of topics in a resume vector
+#define RESUME_MAX 4096
+
+// The subsystems whose memory is accounted for
+#define MEM_CLIENTS 0 // the clients' structures and their index by ID
+#define MEM_SUBS 1 // the clients' topics, the interest and the numbering
+#define MEM_BACKLOG 2 // stored messages
+#define MEM_BUFFERS 3 // receive buffers, topic dictionaries and lanes
+#define MEM_KINDS 4
+
+// What happens to a message to store once the memory cap is reached
+#define MEM_SHED 0 // the oldest messages of the largest backlogs are dropped
+#define MEM_REFUSE 1 // the message is not stored
+
+// Priority classes of the subscriptions, which decide the order in which
+// the messages waiting for a client's connection are sent
+#define PRIO_NORMAL 0 // the default
+#define PRIO_URGENT 1 // also sent ahead of the stored messages on reconnection
+#define PRIO_BULK 2
+#define PRIO_CLASSES 3
+
+// Number of buckets of the latency histograms (powers of two, in us)
+#define LAT_BUCKETS 32
 
 // Constants for message content types
 #define INT 0
@@ -33,11 +91,34 @@
 #define FLOAT 2
 #define STRING 3
 
+// The connection packet structure (the first packet sent by a subscriber)
+typedef struct conn_packet_t {
+	char id[IDSIZ];
+	uint8_t flags;
+	char shm[SHMNAMSIZ]; // name of the subscriber's ring (with CONN_SHM)
+} conn_packet_t;
+
+// The header of a resume vector (sent after the connection packet, with
+// CONN_RESUME), followed by its entries
+typedef struct resume_hdr_t {
+	uint32_t epoch; // the server's epoch the entries refer to (network order)
+	uint16_t count; // number of entries (network order)
+} resume_hdr_t;
+
+// An entry of a resume vector: the last message of a topic the subscriber
+// processed
+typedef struct resume_entry_t {
+	char topic[TOPICSIZ];
+	uint32_t seq; // network order
+} resume_entry_t;
+
 // The subscription packet structure
 typedef struct sub_packet_t {
 	uint8_t type;
 	char topic[TOPICSIZ];
 	uint8_t sf;
+	uint8_t prio; // the priority class (SUBSCRIBE only)
+	uint32_t seq; // the acknowledged sequence number (ACK only, network order)
 } sub_packet_t;
 
 // The TCP message structure
@@ -47,6 +128,9 @@ typedef struct tcp_msg_t {
 	char content[CONTENTSIZ];
 	char ip[IPV4_LEN];
 	uint16_t port;
+	// The message's number in its topic (network order), or the server's
+	// epoch in a message without a type
+	uint32_t seq;
 } tcp_msg_t;
 
 // The UDP message structure
@@ -56,21 +140,170 @@ typedef struct udp_msg_t {
 	char content[CONTENTSIZ - 1];
 } udp_msg_t;
 
+// A connection whose connection packet was not fully received yet
+typedef struct handshake_t {
+	int socket;
+	struct sockaddr_in addr; // the client's address
+	size_t got; // number of bytes of the connection packet received
+	conn_packet_t conn;
+	resume_hdr_t hdr; // the resume vector (with CONN_RESUME)
+	resume_entry_t *resume;
+	wtimer_t timeout; // drops the connection
+} handshake_t;
+
+// A received datagram, decoded once and kept in binary form
+typedef struct msg_t {
+	struct sockaddr_in addr; // the publisher's address
+	topic_key_t topic;
+	uint8_t type;
+	uint16_t len; // length of the content
+	uint32_t seq; // the message's number in its topic, given by this server
+	char content[CONTENTSIZ - 1];
+} msg_t;
+
+// A message stored for an offline client, allocated with only the used part
+// of its content
+typedef struct stored_msg_t {
+	struct stored_msg_t *next;
+	uint64_t expires; // when it is dropped (monotonic ms), 0 if never
+	bool early; // already sent on this connection, ahead of the replay
+	msg_t msg;
+} stored_msg_t;
+
+// A message waiting for a client's connection, copied whole
+typedef struct out_msg_t {
+	struct out_msg_t *next;
+	uint64_t due; // when it was ready to be sent (monotonic us)
+	size_t len;
+	size_t sent; // bytes already sent, only ever set for the oldest message
+	uint8_t data[];
+} out_msg_t;
+
+// The messages of a priority class waiting for a client's connection
+typedef struct out_lane_t {
+	out_msg_t *head; // oldest first
+	out_msg_t *tail;
+} out_lane_t;
+
+// A topic dictionary entry (a topic and publisher pair sent to a client)
+typedef struct dict_entry_t {
+	topic_key_t topic;
+	uint32_t ip; // network order
+	uint16_t port; // network order
+	uint32_t id;
+} dict_entry_t;
+
 // The client structure
 typedef struct client_t {
 	char id[IDSIZ];
 	int socket;
-	list_t *unsent; // unsent messages
-	list_t *topics; // topics subscribed to
+	stored_msg_t *unsent; // unsent messages, oldest first
+	stored_msg_t *unsent_tail;
+	wtimer_t expiry; // drops the oldest unsent messages when they expire
+	htable_t *topics; // topics subscribed to (topic_t), by name
+	unsigned int urgent; // number of them in the urgent class
+	uint8_t *rx; // bytes received but not yet handled
+	size_t rx_len;
+	size_t rx_cap;
 	bool online;
+	uint8_t flags; // flags of the current connection
+	htable_t *dict; // topic dictionary of the current connection
+	shm_ring_t *ring; // shared memory ring of the current connection, if any
+	uint64_t last_rx; // when the last packet was received (monotonic ms)
+	uint64_t last_tx; // when the last packet was sent over TCP
+	wtimer_t heartbeat; // checks the connection's liveness
+	bool zerocopy; // large messages are sent with MSG_ZEROCOPY
+	zc_queue_t zc; // zero-copy sends waiting for completion
+	size_t mem[MEM_KINDS]; // bytes used by the client, per subsystem
+	out_lane_t lanes[PRIO_CLASSES]; // messages the connection had no room for
+	size_t out_len; // bytes waiting in the lanes
+	uint8_t lane; // position of the lane being drained in the drain order
+	unsigned int quota; // messages it may still send before the next one
+	stored_msg_t *replay; // the next stored message to replay, if any
 } client_t;
 
 // The topic structure
 typedef struct topic_t {
-	char name[TOPICSIZ];
+	topic_key_t name;
 	uint8_t sf;
+	uint8_t prio; // the priority class of its messages
+	uint32_t acked; // the last sequence number the client processed
 } topic_t;
 
+// The numbering of the messages of a topic
+typedef struct topic_seq_t {
+	topic_key_t topic;
+	uint32_t last; // the last sequence number given
+} topic_seq_t;
+
+// A topic subscribed to by at least one client
+typedef struct interest_t {
+	topic_key_t topic;
+	unsigned int refs; // number of clients subscribed to it
+} interest_t;
+
+// A federated server (peer) and the link to it
+typedef struct peer_t {
+	struct sockaddr_in addr; // the peer's address (outgoing links only)
+	bool outgoing; // the link was initiated by this server
+	bool connecting; // a non-blocking connect() is in progress
+	int socket; // EMPTY while the link is down
+	uint32_t node; // the peer's node ID (0 until its hello is received)
+	uint64_t retry; // when to reconnect (monotonic ms, outgoing links only)
+	htable_t *interest; // topics subscribed to by the peer's clients
+	uint8_t *rx; // bytes received but not yet decoded
+	size_t rx_len;
+	size_t rx_cap;
+	uint8_t *tx; // data batch being built
+	size_t tx_len;
+	uint16_t tx_count; // number of messages in the batch
+	uint8_t *out; // frames waiting for room on the link
+	size_t out_pos; // bytes of out already sent
+	size_t out_len;
+	size_t out_cap;
+} peer_t;
+
+// The federation state
+typedef struct federation_t {
+	uint32_t node; // this server's node ID
+	list_t *peers;
+	bool dirty; // the local interest changed since it was last sent
+} federation_t;
+
+// The memory accounting of the server
+typedef struct mem_t {
+	size_t used[MEM_KINDS]; // bytes used, per subsystem
+	size_t cap; // maximum number of bytes used, 0 if unlimited
+	uint8_t policy; // MEM_SHED or MEM_REFUSE
+	unsigned long shed; // stored messages dropped to make room
+	unsigned long refused; // messages not stored
+	unsigned long rejected_clients; // new clients turned away
+	unsigned long rejected_subs; // new subscriptions refused
+} mem_t;
+
+// The delivery statistics of a priority class
+typedef struct lane_stats_t {
+	unsigned long sent; // messages written to the clients' connections
+	unsigned long queued; // the part of them that waited in a lane
+	uint64_t total_us; // sum of their latencies
+	uint64_t max_us;
+	unsigned long hist[LAT_BUCKETS]; // their latencies, by power of two
+} lane_stats_t;
+
+// The state of the busy-poll mode
+typedef struct busy_t {
+	uint32_t max; // maximum time spent spinning (us), 0 if the mode is off
+	uint32_t spin; // current spin time, adapted to the gaps between events
+	uint64_t last; // when events were last seen (monotonic us)
+} busy_t;
+
+// The state of the UDP socket filter
+typedef struct filter_t {
+	bool open; // accepts all datagrams until the next rebuild
+	uint64_t last; // when it was last rebuilt (monotonic ms)
+	wtimer_t rebuild; // the delayed rebuild, if any
+} filter_t;
+
 // The sockets structure
 typedef struct sockets_t {
 	int tcp_sock;
@@ -83,4 +316,7 @@ typedef struct sockets_t {
 // The size of the subscription packet structure
 #define PACKLEN sizeof(sub_packet_t)
 
+// The size of the connection packet structure
+#define CONNLEN sizeof(conn_packet_t)
+
 #endif /* _STRUCTS_H */
@@ -0,0 +1,621 @@
+// SPDX-License-Identifier: EUPL-1.2
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+// Needed for pthread_timedjoin_np()
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+
+#include "codec.h"
+#include "utils.h"
+#include "sub_client.h"
+
+// Time the ring's reader is given to stop between two wakeups (ns)
+#define STOP_WAIT 10000000
+
+// Names of the content types, indexed by type
+static const char *type_names[] = {"INT", "SHORT_REAL", "FLOAT", "STRING"};
+
+// Gets the current time (monotonic, in ms)
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Hands the batched messages to the callback
+static void rx_flush(rx_t *rx) {
+	if (rx->count && rx->cb)
+		rx->cb(rx->ctx, rx->batch, rx->count);
+	rx->count = 0;
+}
+
+// Adds a message to the batch, unless it was processed before a reconnection
+static void rx_deliver(rx_t *rx, const sub_msg_t *msg) {
+	if (rx->resume && resume_seen(rx->resume, msg->topic, msg->seq))
+		return;
+
+	rx->batch[rx->count++] = *msg;
+	if (rx->count == SUB_BATCH)
+		rx_flush(rx);
+}
+
+// Hands a refused subscription to its callback, after the messages before it
+static void rx_reject(rx_t *rx, const char *topic) {
+	rx_flush(rx);
+	if (rx->reject)
+		rx->reject(rx->ctx, topic);
+}
+
+// Handles a TCP message of the default wire mode, in place
+static void tcp_message(rx_t *rx, uint8_t *raw) {
+	tcp_msg_t *msg = (tcp_msg_t *)raw;
+	uint32_t seq;
+	uint16_t port;
+	memcpy(&seq, raw + offsetof(tcp_msg_t, seq), sizeof(uint32_t));
+	memcpy(&port, raw + offsetof(tcp_msg_t, port), sizeof(uint16_t));
+
+	// Heartbeats have no type, and neither has the epoch nor a refused
+	// subscription, the only one with a topic
+	if (!msg->type[0]) {
+		msg->topic[TOPICSIZ - 1] = '\0';
+		if (msg->topic[0])
+			rx_reject(rx, msg->topic);
+		else if (rx->resume && seq)
+			resume_epoch(rx->resume, ntohl(seq));
+		return;
+	}
+
+	// The strings are terminated in place, whatever the server sent
+	msg->type[TYPESIZ - 1] = '\0';
+	msg->topic[TOPICSIZ - 1] = '\0';
+	msg->content[CONTENTSIZ - 1] = '\0';
+	msg->ip[IPV4_LEN - 1] = '\0';
+
+	sub_msg_t out;
+	out.topic = msg->topic;
+	out.ip = msg->ip;
+	out.port = ntohs(port);
+	out.seq = ntohl(seq);
+	out.text = true;
+	out.kind = STRING;
+	for (uint8_t kind = INT; kind < STRING; ++kind)
+		if (!strcmp(msg->type, type_names[kind]))
+			out.kind = kind;
+	out.type = msg->type;
+	out.content = msg->content;
+	out.len = strlen(msg->content);
+
+	rx_deliver(rx, &out);
+}
+
+// Decodes one compact mode frame, delivering it if it is a data frame
+// Returns the length of the frame, 0 if it is incomplete or -1 if it is
+// malformed.
+static int compact_frame(rx_t *rx, const uint8_t *frame, size_t len) {
+	uint32_t id;
+	size_t pos = 1;
+
+	// A heartbeat, which only keeps the connection alive
+	if (len && frame[0] == FRAME_HEARTBEAT)
+		return 1;
+
+	// The server's epoch, which resuming subscribers get first
+	if (len && frame[0] == FRAME_EPOCH) {
+		if (len < EPOCH_FRAME_LEN)
+			return 0;
+
+		uint32_t epoch;
+		memcpy(&epoch, frame + 1, sizeof(epoch));
+		if (rx->resume)
+			resume_epoch(rx->resume, ntohl(epoch));
+		return EPOCH_FRAME_LEN;
+	}
+
+	// A subscription refused by the server
+	if (len && frame[0] == FRAME_REJECT) {
+		if (len < 2)
+			return 0;
+
+		size_t topic_len = frame[1];
+		if (topic_len > TOPICSIZ - 1)
+			return -1;
+		if (len - 2 < topic_len)
+			return 0;
+
+		char topic[TOPICSIZ];
+		memcpy(topic, frame + 2, topic_len);
+		topic[topic_len] = '\0';
+		rx_reject(rx, topic);
+		return 2 + topic_len;
+	}
+
+	// Every other frame starts with its kind and a dictionary ID
+	if (len < 2)
+		return 0;
+
+	int ret = varint_decode(frame + pos, len - pos, &id);
+	if (ret <= 0)
+		return ret;
+	pos += ret;
+
+	uint8_t kind = frame[0];
+
+	// A new dictionary entry: the topic and the publisher's address
+	if (kind == FRAME_DICT) {
+		if (pos == len)
+			return 0;
+
+		size_t topic_len = frame[pos++];
+		if (topic_len > TOPICSIZ - 1 || id != rx->ndict)
+			return -1;
+		if (len - pos < topic_len + sizeof(uint32_t) + sizeof(uint16_t))
+			return 0;
+
+		// Grows the dictionary, if necessary, once the batched messages that
+		// point into it were handed over
+		if (rx->ndict == rx->cap) {
+			rx_flush(rx);
+			rx->cap = rx->cap ? 2 * rx->cap : 64;
+			rx->dict = realloc(rx->dict, rx->cap * sizeof(sub_dict_t));
+			DIE(!rx->dict, "dictionary realloc() failed");
+		}
+
+		sub_dict_t *entry = &rx->dict[rx->ndict++];
+		memcpy(entry->topic, frame + pos, topic_len);
+		entry->topic[topic_len] = '\0';
+		pos += topic_len;
+
+		struct in_addr addr;
+		memcpy(&addr.s_addr, frame + pos, sizeof(uint32_t));
+		strcpy(entry->ip, inet_ntoa(addr));
+		pos += sizeof(uint32_t);
+
+		memcpy(&entry->port, frame + pos, sizeof(uint16_t));
+		pos += sizeof(uint16_t);
+
+		return pos;
+	}
+
+	// A data frame for a known dictionary entry
+	if (kind > STRING || id >= rx->ndict)
+		return -1;
+
+	uint32_t seq;
+	ret = varint_decode(frame + pos, len - pos, &seq);
+	if (ret <= 0)
+		return ret;
+	pos += ret;
+
+	uint32_t content;
+	if (kind == INT) {
+		content = INT_LEN;
+	} else if (kind == SHORT_REAL) {
+		content = SHORT_REAL_LEN;
+	} else if (kind == FLOAT) {
+		content = FLOAT_LEN;
+	} else {
+		ret = varint_decode(frame + pos, len - pos, &content);
+		if (ret <= 0)
+			return ret;
+		if (content > CONTENTSIZ - 1)
+			return -1;
+		pos += ret;
+	}
+
+	if (len - pos < content)
+		return 0;
+
+	// The content stays in the receive buffer, in binary form
+	sub_dict_t *entry = &rx->dict[id];
+	sub_msg_t out;
+	out.topic = entry->topic;
+	out.ip = entry->ip;
+	out.port = ntohs(entry->port);
+	out.seq = seq;
+	out.text = false;
+	out.kind = kind;
+	out.type = type_names[kind];
+	out.content = (const char *)frame + pos;
+	out.len = content;
+
+	rx_deliver(rx, &out);
+
+	return pos + content;
+}
+
+// Delivers all complete messages in a receive buffer, keeping the bytes of an
+// incomplete one for later
+// Returns false if the server sent a malformed frame.
+static bool rx_decode(rx_t *rx) {
+	size_t pos = 0;
+	bool ok = true;
+
+	if (rx->compact) {
+		while (pos < rx->len) {
+			int frame = compact_frame(rx, rx->buf + pos, rx->len - pos);
+			if (frame <= 0) {
+				ok = !frame;
+				break;
+			}
+			pos += frame;
+		}
+	} else {
+		while (rx->len - pos >= sizeof(tcp_msg_t)) {
+			tcp_message(rx, rx->buf + pos);
+			pos += sizeof(tcp_msg_t);
+		}
+	}
+
+	// The messages point into the buffer, so they are handed over before
+	// the incomplete one is moved
+	rx_flush(rx);
+
+	memmove(rx->buf, rx->buf + pos, rx->len - pos);
+	rx->len -= pos;
+
+	return ok;
+}
+
+// Reads messages from the shared memory ring, without system calls while
+// they keep coming, sleeping on the ring's futex only when it stays empty
+static void *ring_reader(void *arg) {
+	reader_t *reader = arg;
+	rx_t *rx = &reader->rx;
+
+	while (!reader->stop) {
+		rx->len += ring_read(reader->ring, rx->buf + rx->len, RXSIZ - rx->len);
+		if (!rx_decode(rx))
+			break;
+	}
+
+	return NULL;
+}
+
+// Prepares a receive state
+static void rx_init(rx_t *rx, const sub_config_t *cfg, resume_t *resume) {
+	rx->compact = cfg->flags & CONN_COMPACT;
+	rx->resume = resume;
+	rx->cb = cfg->cb;
+	rx->reject = cfg->reject;
+	rx->ctx = cfg->ctx;
+}
+
+// Sends a packet to the server
+static bool sub_send(sub_client_t *client, const void *buf, size_t len) {
+	client->last_tx = now_ms();
+
+	return send(client->socket, buf, len, MSG_NOSIGNAL) == (ssize_t)len;
+}
+
+// Stops the ring's reader, then removes the ring
+static void reader_stop(sub_client_t *client) {
+	reader_t *reader = client->reader;
+
+	// A wakeup is missed if the reader was not asleep yet
+	reader->stop = true;
+	while (true) {
+		ring_wake(reader->ring);
+
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += STOP_WAIT;
+		if (ts.tv_nsec >= 1000000000) {
+			++ts.tv_sec;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		if (pthread_timedjoin_np(reader->thread, NULL, &ts) != ETIMEDOUT)
+			break;
+	}
+
+	// Removes the ring, unless the server already did
+	ring_detach(&reader->ring);
+	shm_unlink(client->shm);
+
+	free(reader->rx.dict);
+	free(reader);
+	client->reader = NULL;
+}
+
+// Frees a client, whose connection is closed
+static void sub_free(sub_client_t *client) {
+	if (client->reader)
+		reader_stop(client);
+
+	// Saves the last positions
+	if (client->resume) {
+		resume_flush(client->resume, -1);
+		resume_free(client->resume);
+	}
+
+	free(client->rx.dict);
+	free(client);
+}
+
+sub_client_t *sub_connect(const sub_config_t *cfg) {
+	sub_client_t *client = calloc(1, sizeof(sub_client_t));
+	DIE(!client, "client calloc() failed");
+	client->flags = cfg->flags;
+	client->socket = -1;
+
+	if (cfg->flags & CONN_RESUME)
+		client->resume = resume_load(cfg->state);
+	rx_init(&client->rx, cfg, client->resume);
+
+	// Sets up the server's address
+	struct sockaddr_in server_addr;
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(atoi(cfg->port));
+	if (!inet_aton(cfg->ip, &server_addr.sin_addr)) {
+		sub_free(client);
+		return NULL;
+	}
+
+	// Connects to the server, with the Nagle algorithm disabled
+	client->socket = socket(AF_INET, SOCK_STREAM, 0);
+	DIE(client->socket < 0, "socket() failed");
+
+	int optval = 1;
+	setsockopt(client->socket, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(int));
+
+	if (connect(client->socket, (struct sockaddr *)&server_addr,
+				sizeof(server_addr)) < 0) {
+		close(client->socket);
+		sub_free(client);
+		return NULL;
+	}
+
+	// Creates the shared memory ring, which the server maps if it runs on
+	// the same host (otherwise, the messages keep coming through TCP)
+	if (cfg->flags & CONN_SHM) {
+		snprintf(client->shm, SHMNAMSIZ, "/pcom-%s-%d", cfg->id, getpid());
+
+		reader_t *reader = calloc(1, sizeof(reader_t));
+		DIE(!reader, "reader calloc() failed");
+		reader->ring = ring_create(client->shm);
+		DIE(!reader->ring, "ring_create() failed");
+		rx_init(&reader->rx, cfg, client->resume);
+
+		int ret = pthread_create(&reader->thread, NULL, ring_reader, reader);
+		DIE(ret, "pthread_create() failed");
+		client->reader = reader;
+	}
+
+	// Sends the client ID and the connection flags, then tells the server
+	// which messages were already processed
+	conn_packet_t conn;
+	memset(&conn, 0, CONNLEN);
+	strncpy(conn.id, cfg->id, IDSIZ - 1);
+	conn.flags = cfg->flags;
+	memcpy(conn.shm, client->shm, SHMNAMSIZ);
+
+	if (!sub_send(client, &conn, CONNLEN)) {
+		close(client->socket);
+		sub_free(client);
+		return NULL;
+	}
+
+	if (client->resume)
+		resume_send(client->resume, client->socket);
+
+	return client;
+}
+
+int sub_fd(const sub_client_t *client) {
+	return client->socket;
+}
+
+int sub_timeout(const sub_client_t *client) {
+	uint64_t now = now_ms();
+	uint64_t due = client->last_tx + HEARTBEAT_INTERVAL;
+	if (client->resume && client->resume->last_save + RESUME_INTERVAL < due)
+		due = client->resume->last_save + RESUME_INTERVAL;
+
+	return due > now ? (int)(due - now) : 0;
+}
+
+int sub_process(sub_client_t *client) {
+	rx_t *rx = &client->rx;
+	int result = SUB_MORE;
+
+	for (int n = 0; n < SUB_READS; ++n) {
+		// Receives as many bytes as fit after the undecoded ones
+		size_t room = RXSIZ - rx->len;
+		ssize_t ret = recv(client->socket, rx->buf + rx->len, room,
+							MSG_DONTWAIT);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			result = SUB_DRAINED;
+			break;
+		}
+		if (ret <= 0)
+			return SUB_CLOSED;
+
+		rx->len += ret;
+		if (!rx_decode(rx))
+			return SUB_CLOSED;
+
+		// The socket was emptied, and what comes next raises a new event
+		if ((size_t)ret < room) {
+			result = SUB_DRAINED;
+			break;
+		}
+	}
+
+	// Tells the server that this client is alive, if nothing else did
+	if (now_ms() - client->last_tx >= HEARTBEAT_INTERVAL) {
+		sub_packet_t pack;
+		memset(&pack, 0, PACKLEN);
+		pack.type = HEARTBEAT;
+		if (!sub_send(client, &pack, PACKLEN))
+			return SUB_CLOSED;
+	}
+
+	// Saves the positions and acknowledges them, so that the server frees
+	// the messages it kept
+	if (client->resume &&
+		now_ms() - client->resume->last_save >= RESUME_INTERVAL &&
+		!resume_flush(client->resume, client->socket))
+		return SUB_CLOSED;
+
+	return result;
+}
+
+void sub_run(sub_client_t *client) {
+	struct pollfd pfd;
+	pfd.fd = client->socket;
+	pfd.events = POLLIN;
+
+	while (true) {
+		if (poll(&pfd, 1, sub_timeout(client)) < 0 && errno != EINTR)
+			return;
+
+		if (sub_process(client) == SUB_CLOSED)
+			return;
+	}
+}
+
+bool sub_subscribe(sub_client_t *client, const char *topic, uint8_t sf,
+					uint8_t prio) {
+	sub_packet_t pack;
+	memset(&pack, 0, PACKLEN);
+	pack.type = SUBSCRIBE;
+	strncpy(pack.topic, topic, TOPICSIZ - 1);
+	pack.sf = sf;
+	pack.prio = prio;
+
+	return sub_send(client, &pack, PACKLEN);
+}
+
+bool sub_unsubscribe(sub_client_t *client, const char *topic) {
+	sub_packet_t pack;
+	memset(&pack, 0, PACKLEN);
+	pack.type = UNSUBSCRIBE;
+	strncpy(pack.topic, topic, TOPICSIZ - 1);
+
+	return sub_send(client, &pack, PACKLEN);
+}
+
+int sub_topic_file(sub_client_t *client, const char *path, bool subscribe,
+					int *skipped) {
+	if (skipped)
+		*skipped = 0;
+
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return -1;
+
+	uint8_t *packet = malloc(BULK_HDR + BULK_MAX);
+	DIE(!packet, "bulk packet malloc() failed");
+
+	int count = 0, bad = 0;
+	size_t len = 0;
+	char line[BUFSIZ];
+	bool more = true;
+
+	while (more) {
+		// Reads the next topic, its sf flag (0 if missing) and its priority
+		// class (normal if missing), ignoring empty lines and comments
+		char topic[BUFSIZ], prio[BUFSIZ] = "";
+		int sf = 0;
+		more = fgets(line, sizeof(line), file);
+
+		// A line too long for the buffer is skipped whole, instead of being
+		// read as several lines
+		if (more && !strchr(line, '\n') && !feof(file)) {
+			int ch;
+			while ((ch = fgetc(file)) != EOF && ch != '\n')
+				;
+			++bad;
+			continue;
+		}
+
+		if (more && (sscanf(line, "%s %d %s", topic, &sf, prio) < 1 ||
+			topic[0] == '#'))
+			continue;
+
+		size_t topic_len = more ? strlen(topic) : 0;
+		if (topic_len > TOPICSIZ - 1) {
+			++bad;
+			continue;
+		}
+
+		// Sends the packet once full, or after the last topic
+		if (len && (!more || len + 2 + topic_len > BULK_MAX)) {
+			uint32_t body = htonl(len);
+			packet[0] = subscribe ? SUBSCRIBE_BULK : UNSUBSCRIBE_BULK;
+			memcpy(packet + 1, &body, sizeof(uint32_t));
+
+			if (!sub_send(client, packet, BULK_HDR + len)) {
+				count = -1;
+				break;
+			}
+			len = 0;
+		}
+
+		if (!more)
+			break;
+
+		uint8_t *entry = packet + BULK_HDR + len;
+		entry[0] = (sf == 1) | sub_prio(prio) << BULK_PRIO_SHIFT;
+		entry[1] = topic_len;
+		memcpy(entry + 2, topic, topic_len);
+		len += 2 + topic_len;
+		++count;
+	}
+
+	free(packet);
+	fclose(file);
+
+	if (skipped)
+		*skipped = bad;
+	return count;
+}
+
+uint8_t sub_prio(const char *str) {
+	if (!str)
+		return PRIO_NORMAL;
+
+	if (!strcmp(str, "urgent") || !strcmp(str, "1"))
+		return PRIO_URGENT;
+
+	if (!strcmp(str, "bulk") || !strcmp(str, "2"))
+		return PRIO_BULK;
+
+	return PRIO_NORMAL;
+}
+
+void sub_format(const sub_msg_t *msg, char *type, char *text) {
+	if (!msg->text) {
+		format_content(msg->kind, msg->content, msg->len, type, text);
+		return;
+	}
+
+	strcpy(type, msg->type);
+	memcpy(text, msg->content, msg->len);
+	text[msg->len] = '\0';
+}
+
+void sub_close(sub_client_t *client) {
+	// The server may be gone already
+	sub_packet_t pack;
+	memset(&pack, 0, PACKLEN);
+	pack.type = EXIT;
+	sub_send(client, &pack, PACKLEN);
+
+	close(client->socket);
+	sub_free(client);
+}
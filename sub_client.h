@@ -0,0 +1,239 @@
+/* SPDX-License-Identifier: EUPL-1.2 */
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#ifndef _SUB_CLIENT_H_
+#define _SUB_CLIENT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "structs.h"
+#include "shm_ring.h"
+#include "resume.h"
+
+// Size of the receive buffer of a connection (and of the ring's reader)
+#define RXSIZ 65536
+
+// Maximum number of messages handed to the callback at once
+#define SUB_BATCH 64
+
+// Maximum number of reads per call to sub_process(), so that a busy
+// connection does not starve the caller's other file descriptors
+#define SUB_READS 16
+
+// Results of sub_process()
+#define SUB_CLOSED -1 // the connection was closed, or sent malformed data
+#define SUB_DRAINED 0 // everything available was read
+#define SUB_MORE 1 // more may be available already
+
+// A message received from the server. Its strings and content point into the
+// client's receive buffer (or its topic dictionary), so they are only valid
+// during the callback.
+typedef struct sub_msg_t {
+	const char *topic;
+	const char *ip; // the publisher's address
+	uint16_t port; // the publisher's port (host order)
+	uint32_t seq; // the message's number in its topic
+	bool text; // the content was formatted by the server (default wire mode)
+	uint8_t kind; // the content type (INT to STRING), with the binary payload
+	const char *type; // the content type's name, with the formatted content
+	const char *content; // the binary payload, or the formatted content
+	size_t len; // the content's length
+} sub_msg_t;
+
+/**
+ * @brief Handles a batch of messages, in the order they were received.
+ *
+ * @param ctx The context given in the configuration
+ * @param msgs The messages
+ * @param count The number of messages
+ */
+typedef void (*sub_cb_t)(void *ctx, const sub_msg_t *msgs, size_t count);
+
+/**
+ * @brief Handles a subscription refused by the server (when its memory runs
+ * low). The messages received before it were handed to the callback.
+ *
+ * @param ctx The context given in the configuration
+ * @param topic The topic
+ */
+typedef void (*sub_reject_t)(void *ctx, const char *topic);
+
+// How to connect to a server
+typedef struct sub_config_t {
+	const char *id;
+	const char *ip;
+	const char *port;
+	uint8_t flags; // CONN_COMPACT, CONN_SHM and CONN_RESUME are honored
+	const char *state; // the resume state file (with CONN_RESUME)
+	sub_cb_t cb;
+	sub_reject_t reject; // optional
+	void *ctx;
+} sub_config_t;
+
+// A topic dictionary entry, as known by the subscriber
+typedef struct sub_dict_t {
+	char topic[TOPICSIZ];
+	char ip[IPV4_LEN];
+	uint16_t port; // network order
+} sub_dict_t;
+
+// The receive state of a connection, or of the shared memory ring
+typedef struct rx_t {
+	uint8_t buf[RXSIZ]; // bytes received but not yet decoded
+	size_t len;
+	bool compact; // the bytes are compact frames, or else TCP messages
+	sub_dict_t *dict; // topic dictionary, indexed by ID
+	uint32_t ndict;
+	uint32_t cap;
+	resume_t *resume; // the positions in the topics, if resuming
+	sub_cb_t cb;
+	sub_reject_t reject;
+	void *ctx;
+	sub_msg_t batch[SUB_BATCH]; // the messages not handed to cb yet
+	size_t count;
+} rx_t;
+
+// The state of the thread reading the shared memory ring
+typedef struct reader_t {
+	shm_ring_t *ring;
+	rx_t rx;
+	pthread_t thread;
+	_Atomic bool stop;
+} reader_t;
+
+// A subscriber's connection to a server
+typedef struct sub_client_t {
+	int socket;
+	uint8_t flags;
+	rx_t rx;
+	resume_t *resume; // the positions in the topics, if resuming
+	uint64_t last_tx; // when the last packet was sent (monotonic ms)
+	char shm[SHMNAMSIZ]; // the name of the ring, if any
+	reader_t *reader; // reads the ring on its own thread, if any
+} sub_client_t;
+
+/**
+ * @brief Connects to a server and identifies the subscriber. With
+ * CONN_RESUME, the positions are loaded from the state file and sent. With
+ * CONN_SHM, a shared memory ring is created and read on its own thread, which
+ * then calls the callback too.
+ *
+ * @param cfg The configuration
+ *
+ * @return A pointer to the client, or NULL if the connection failed
+ */
+sub_client_t *sub_connect(const sub_config_t *cfg);
+
+/**
+ * @brief Gets the client's socket, to wait for it with poll() or epoll
+ * (readable events only).
+ *
+ * @param client The client
+ *
+ * @return The socket
+ */
+int sub_fd(const sub_client_t *client);
+
+/**
+ * @brief Gets the time until sub_process() must be called even if nothing
+ * was received, to send a heartbeat or save the resume state.
+ *
+ * @param client The client
+ *
+ * @return The time (ms)
+ */
+int sub_timeout(const sub_client_t *client);
+
+/**
+ * @brief Reads what the server sent, without blocking, and hands the decoded
+ * messages to the callback straight from the receive buffer. Then sends a
+ * heartbeat or saves the resume state, if due. With edge-triggered epoll, it
+ * must be called again as long as it returns SUB_MORE.
+ *
+ * @param client The client
+ *
+ * @return SUB_DRAINED, SUB_MORE or SUB_CLOSED
+ */
+int sub_process(sub_client_t *client);
+
+/**
+ * @brief Handles the connection until it is closed, blocking.
+ *
+ * @param client The client
+ */
+void sub_run(sub_client_t *client);
+
+/**
+ * @brief Subscribes to a topic.
+ *
+ * @param client The client
+ * @param topic The topic
+ * @param sf Whether messages are stored while the client is offline
+ * @param prio The priority class of its messages
+ *
+ * @return False if the connection failed
+ */
+bool sub_subscribe(sub_client_t *client, const char *topic, uint8_t sf,
+					uint8_t prio);
+
+/**
+ * @brief Unsubscribes from a topic.
+ *
+ * @param client The client
+ * @param topic The topic
+ *
+ * @return False if the connection failed
+ */
+bool sub_unsubscribe(sub_client_t *client, const char *topic);
+
+/**
+ * @brief Subscribes to (or unsubscribes from) the topics listed in a file, one
+ * per line and optionally followed by their sf flag and priority class, using
+ * bulk packets. Empty lines and comments (starting with '#') are ignored.
+ * Lines whose topic is longer than TOPICSIZ - 1 bytes, or which do not fit in
+ * BUFSIZ bytes, are skipped and counted in skipped: the other topics are
+ * still sent.
+ *
+ * @param client The client
+ * @param path The topic file
+ * @param subscribe Whether to subscribe or unsubscribe
+ * @param skipped Where to store the number of skipped lines, or NULL
+ *
+ * @return The number of topics sent, or -1 if the file cannot be read (or the
+ * connection failed)
+ */
+int sub_topic_file(sub_client_t *client, const char *path, bool subscribe,
+					int *skipped);
+
+/**
+ * @brief Parses a priority class, given by its name (urgent, normal or bulk)
+ * or number.
+ *
+ * @param str The string, or NULL
+ *
+ * @return The priority class, PRIO_NORMAL if it is missing or invalid
+ */
+uint8_t sub_prio(const char *str);
+
+/**
+ * @brief Formats a message's content like the server does in the default
+ * wire mode.
+ *
+ * @param msg The message
+ * @param type Where to store the type's name (TYPESIZ bytes)
+ * @param text Where to store the formatted content (CONTENTSIZ bytes)
+ */
+void sub_format(const sub_msg_t *msg, char *type, char *text);
+
+/**
+ * @brief Tells the server the client exits, closes the connection, stops the
+ * ring's reader and saves the resume state, then frees the client.
+ *
+ * @param client The client
+ */
+void sub_close(sub_client_t *client);
+
+#endif /* _SUB_CLIENT_H_ */
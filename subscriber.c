@@ -5,9 +5,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <arpa/inet.h>
 #include <unistd.h>
-#include <netinet/tcp.h>
 #include <poll.h>
 
 #include "structs.h"
@@ -15,37 +13,6 @@
 #include "poll_funcs.h"
 #include "subscriber.h"
 
-int setup(struct pollfd *pfds, int *nfds, char *id, char *ip, char *port) {
-	// Creates a TCP socket
-	int tcp_sock = socket(AF_INET, SOCK_STREAM, 0);
-	DIE(tcp_sock < 0, "socket");
-
-	// Sets TCP_NODELAY socket option to disable the Nagle algorithm
-	int optval = 1;
-	setsockopt(tcp_sock, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(int));
-
-	// Sets up server address
-	struct sockaddr_in server_addr;
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_port = htons(atoi(port));
-	inet_aton(ip, &server_addr.sin_addr);
-
-	// Adds the standard input and the TCP socket to the polling file descriptors
-	add_socket(pfds, nfds, STDIN_FILENO);
-	add_socket(pfds, nfds, tcp_sock);
-
-	// Connects to the server
-	int conn_ret = connect(tcp_sock, (struct sockaddr *)&server_addr,
-							sizeof(server_addr));
-	DIE(conn_ret < 0, "connect() failed");
-
-	// Sends the client ID to the server
-	int send_ret = send(tcp_sock, id, IDSIZ, 0);
-	DIE(send_ret < 0, "send() failed");
-
-	return tcp_sock;
-}
-
 void create_packet(sub_packet_t *pack, char *buffer, uint8_t type) {
 	// "subscribe" or "unsubscribe"
 	char *token = strtok(buffer, " ");
@@ -58,9 +25,13 @@ void create_packet(sub_packet_t *pack, char *buffer, uint8_t type) {
 	// "0" or "1"
 	token = strtok(NULL, " ");
 	pack->sf = token[0] - '0';
+
+	// "urgent", "normal" or "bulk" (optional)
+	if (type == SUBSCRIBE)
+		pack->prio = sub_prio(strtok(NULL, " \n"));
 }
 
-bool stdin_cmd(int tcp_sock, char *buffer) {
+bool stdin_cmd(sub_client_t *client, char *buffer) {
 	// Clears the buffer
 	memset(buffer, 0, BUFSIZ);
 
@@ -71,26 +42,42 @@ bool stdin_cmd(int tcp_sock, char *buffer) {
 	sub_packet_t pack;
 	memset(&pack, 0, PACKLEN);
 
-	// Creates a packet and sends it to the server
+	// The exit packet is sent when the connection is closed
 	if (!strncmp(buffer, "exit", 4)) {
-		pack.type = EXIT;
-		int ret = send(tcp_sock, &pack, PACKLEN, 0);
-		DIE(ret < 0, "send() failed");
-
 		// Returns in order to break the main loop
 		return false;
+	} else if (!strncmp(buffer, "subscribe_file ", 15) ||
+				!strncmp(buffer, "unsubscribe_file ", 17)) {
+		// Subscribes to (or unsubscribes from) the topics listed in a file
+		bool subscribe = buffer[0] == 's';
+		char path[BUFSIZ];
+		if (sscanf(strchr(buffer, ' '), "%s", path) != 1) {
+			printf("Invalid command.\n");
+			return true;
+		}
+
+		int skipped;
+		int count = sub_topic_file(client, path, subscribe, &skipped);
+		if (count < 0)
+			printf("Cannot read %s.\n", path);
+		else if (skipped)
+			printf("%s %d topics, skipped %d invalid lines.\n", subscribe ?
+					"Subscribed to" : "Unsubscribed from", count, skipped);
+		else
+			printf("%s %d topics.\n", subscribe ? "Subscribed to" :
+					"Unsubscribed from", count);
 	} else if (!strncmp(buffer, "subscribe", 9)) {
 		create_packet(&pack, buffer, SUBSCRIBE);
 
-		int ret = send(tcp_sock, &pack, PACKLEN, 0);
-		DIE(ret < 0, "send() failed");
+		bool ret = sub_subscribe(client, pack.topic, pack.sf, pack.prio);
+		DIE(!ret, "send() failed");
 
 		printf("Subscribed to topic.\n");
 	} else if (!strncmp(buffer, "unsubscribe", 11)) {
 		create_packet(&pack, buffer, UNSUBSCRIBE);
 
-		int ret = send(tcp_sock, &pack, PACKLEN, 0);
-		DIE (ret < 0, "send() failed");
+		bool ret = sub_unsubscribe(client, pack.topic);
+		DIE(!ret, "send() failed");
 
 		printf("Unsubscribed to topic.\n");
 	} else {
@@ -102,67 +89,107 @@ bool stdin_cmd(int tcp_sock, char *buffer) {
 	return true;
 }
 
-bool server_cmd(int tcp_sock, char *buffer) {
-	// Clears the buffer
-	memset(buffer, 0, BUFSIZ);
+void print_msgs(void *ctx, const sub_msg_t *msgs, size_t count) {
+	(void)ctx;
 
-	// Receives message from server
-	int ret = recv(tcp_sock, buffer, sizeof(tcp_msg_t), 0);
-	DIE(ret < 0, "receive() failed");
+	for (size_t i = 0; i < count; ++i) {
+		// Formats the binary content exactly like the server does in the
+		// default mode
+		char type[TYPESIZ], text[CONTENTSIZ];
+		sub_format(&msgs[i], type, text);
 
-	// If there was no data received, returns in order to break the main loop
-	if (!ret)
-		return false;
+		printf("%s:%hu - %s - %s - %s\n", msgs[i].ip, msgs[i].port,
+			msgs[i].topic, type, text);
+	}
+}
 
-	// Casts buffer to a tcp_msg_t struct and prints its content
-	tcp_msg_t *msg_recv = (tcp_msg_t *)buffer;
-	printf("%s:%hu - %s - %s - %s\n", msg_recv->ip, ntohs(msg_recv->port),
-		msg_recv->topic, msg_recv->type, msg_recv->content);
+void print_reject(void *ctx, const char *topic) {
+	(void)ctx;
 
-	// Returns in order to continue the main loop
-	return true;
+	printf("Subscription to %s refused.\n", topic);
 }
 
 int main(int argc, char **argv) {
+	// Parses the options
+	// -c: uses the compact (topic dictionary) wire mode
+	// -s: receives the messages through shared memory (same host only)
+	// -r <FILE>: resumes from the positions saved in the given state file
+	// -f <FILE>: subscribes to the topics listed in the given file
+	sub_config_t cfg = { .cb = print_msgs, .reject = print_reject };
+	char *topic_file = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "csr:f:")) != -1) {
+		DIE(opt == '?', "Invalid option (argv).");
+		if (opt == 'c') {
+			cfg.flags |= CONN_COMPACT;
+		} else if (opt == 's') {
+			cfg.flags |= CONN_SHM;
+		} else if (opt == 'r') {
+			cfg.flags |= CONN_RESUME;
+			cfg.state = optarg;
+		} else if (opt == 'f') {
+			topic_file = optarg;
+		}
+	}
+
 	// Checks if there are enough arguments
-	// (at least 4, including the program name)
-	DIE(argc < 4, "Not enough arguments (argv).");
+	// (the ID, the server's IP and the server's port)
+	DIE(argc - optind < 3, "Not enough arguments (argv).");
+	argv += optind - 1;
+	cfg.id = argv[1];
+	cfg.ip = argv[2];
+	cfg.port = argv[3];
 
 	// Sets stdout to unbuffered mode
 	setvbuf(stdout, NULL, _IONBF, BUFSIZ);
 
+	// Connects to the server
+	sub_client_t *client = sub_connect(&cfg);
+	DIE(!client, "connect() failed");
+
+	// Subscribes to the topics of the topic file, in as few packets as
+	// possible
+	if (topic_file) {
+		int skipped;
+		DIE(sub_topic_file(client, topic_file, true, &skipped) < 0,
+			"Cannot read the topic file");
+		if (skipped)
+			fprintf(stderr, "Skipped %d invalid lines of the topic file.\n",
+					skipped);
+	}
+
 	// Creates an array of pollfd structs and initialize the number of fds to 0
-	struct pollfd pfds[MAX_PFDS];
+	// Adds the standard input and the TCP socket to the polling file descriptors
+	struct pollfd pfds[SUB_PFDS];
 	int nfds = 0;
-	
-	// Sets up a TCP connection
-	int tcp_sock = setup(pfds, &nfds, argv[1], argv[2], argv[3]);
+	add_socket(pfds, &nfds, STDIN_FILENO);
+	add_socket(pfds, &nfds, sub_fd(client));
 
 	// Main loop of the program, runs until an 'exit' command from stdin is met
 	while (true) {
-		// Waits for events on the pollfd array
-		int ret = poll(pfds, nfds, -1);
+		// Waits for events on the pollfd array, or until a heartbeat (or the
+		// next save of the state file) is due
+		int ret = poll(pfds, nfds, sub_timeout(client));
 
 		// Checks if poll failed and exit the program if it did
 		DIE(ret < 0, "poll() failed");
 
 		// Multipurpose buffer
 		char buffer[BUFSIZ];
-	
+
 		// If there is input on standard input, handles the command
 		// When receiving "exit", it breaks the loop
-		if (pfds[0].revents & POLLIN)
-			if (!stdin_cmd(tcp_sock, buffer))
-				break;
-
-		// If there is input from the server, handles the message
-		if (pfds[1].revents & POLLIN)
-			if (!server_cmd(tcp_sock, buffer))
-				break;
+		if (pfds[0].revents & POLLIN && !stdin_cmd(client, buffer))
+			break;
+
+		// Handles the messages from the server, as well as the heartbeats
+		// and the saves of the state file that are due
+		if (sub_process(client) == SUB_CLOSED)
+			break;
 	}
 
-	// Closes the TCP socket
-	close(tcp_sock);
+	// Closes the connection
+	sub_close(client);
 
 	return 0;
 }
@@ -5,29 +5,20 @@
 #define _SUBSCRIBER_H_
 
 #include "structs.h"
+#include "sub_client.h"
 
-/**
- * @brief Sets up a connection to a server and sends the client's ID.
- *
- * @param pfds Pointer to an array of pollfd structs
- * @param nfds Pointer to the number of file descriptors in the pfds array
- * @param id The client's ID.
- * @param ip The IP address of the server to connect to.
- * @param port The port number to connect to on the server.
- *
- * @return The TCP socket file descriptor.
- */
-int setup(struct pollfd *pfds, int *nfds, char *id, char *ip, char *port);
+// Number of file descriptors polled: the standard input and the connection
+#define SUB_PFDS 2
 
 /**
  * @brief Processes a command entered by the user on standard input.
  *
- * @param tcp_sock The TCP socket file descriptor.
+ * @param client The connection to the server.
  * @param buffer The buffer to store the command.
  *
  * @return Whether the program should continue running.
  */
-bool stdin_cmd(int tcp_sock, char *buffer);
+bool stdin_cmd(sub_client_t *client, char *buffer);
 
 /**
  * @brief Takes a pointer to a sub_packet_t struct, the buffer and the packet's
@@ -35,19 +26,28 @@ bool stdin_cmd(int tcp_sock, char *buffer);
  * buffer and the type.
  *
  * @param pack - A pointer to the sub_packet_t struct to be filled in.
- * @param buffer - A string buffer to be parsed for topic and sf fields.
+ * @param buffer - A string buffer to be parsed for topic, sf and priority
+ * class (optional) fields.
  * @param type - The type of the packet to be created.
  */
 void create_packet(sub_packet_t *pack, char *buffer, uint8_t type);
 
 /**
- * @brief Processes a message received from the server.
+ * @brief Prints a batch of messages in the format specified in the homework
+ * description. Called by the client library, from the ring's reader too.
  *
- * @param tcp_sock The TCP socket file descriptor.
- * @param buffer The buffer to store the message.
+ * @param ctx Unused.
+ * @param msgs The messages.
+ * @param count The number of messages.
+ */
+void print_msgs(void *ctx, const sub_msg_t *msgs, size_t count);
+
+/**
+ * @brief Prints a subscription refused by the server.
  *
- * @return Whether the program should continue running.
+ * @param ctx Unused.
+ * @param topic The topic.
  */
-bool server_cmd(int tcp_sock, char *buffer);
+void print_reject(void *ctx, const char *topic);
 
 #endif /* _SUBSCRIBER_H_ */
@@ -5,6 +5,8 @@ import time
 import os
 import pprint
 import json
+import socket
+import struct
 
 from contextlib import contextmanager
 from subprocess import Popen, PIPE, STDOUT
@@ -46,7 +48,17 @@ tests = {
   "data_sf_2": "not executed",
   "c2_restart_sf": "not executed",
   "quick_flow": "not executed",
+  "resume_start": "not executed",
+  "resume_ack": "not executed",
+  "resume_gap": "not executed",
+  "topic_file": "not executed",
+  "subscribe_file": "not executed",
+  "split_packets": "not executed",
+  "malformed_bulk": "not executed",
+  "unsubscribe_empty": "not executed",
+  "client_lib": "not executed",
   "server_stop": "not executed",
+  "memory_refused": "not executed",
 }
 
 def pass_test(test):
@@ -241,6 +253,127 @@ def set_procfs_values(rmem, values):
 
   return True
 
+####### Raw protocol helpers #######
+# port of the server with a memory cap
+mem_port = "12346"
+
+# state file of the resuming subscriber
+resume_state = "resume_test.state"
+
+def publish_int(topic, value):
+  """Publishes an INT message on a topic, without the UDP client."""
+  udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+  sign = 1 if value < 0 else 0
+  datagram = topic.encode().ljust(50, b"\0") + bytes([0, sign]) + struct.pack("!I", abs(value))
+  udp.sendto(datagram, (ip, int(port)))
+  udp.close()
+
+def drain_output(proc):
+  """Reads the output of a process until it prints nothing for a second."""
+  lines = []
+  while True:
+    out = proc.get_output_timeout(1)
+    if out == "timeout" or out == "":
+      return lines
+    lines.append(out)
+
+def get_backlog(server, id):
+  """Gets the number of bytes the server stores for a client ("mem" command)."""
+  server.send_input("mem")
+  backlog = -1
+  for line in drain_output(server):
+    if line.startswith("mem client=" + id + " "):
+      backlog = int(line.split("backlog=")[1].split()[0])
+
+  return backlog
+
+def start_resuming_client(server, id):
+  """Starts a subscriber resuming from the positions in its state file."""
+  client = Process(["./subscriber", "-r", resume_state, id, ip, port])
+  client.start()
+  sleep(1)
+  outs = server.get_output_timeout(2)
+  if not client.is_alive() or not outs.startswith("New client " + id + " connected from"):
+    print("Error: subscriber " + id + " is not up")
+    return client, False
+
+  return client, True
+
+def check_int_outputs(c, id, messages):
+  """Checks that a subscriber prints exactly the given INT messages, as
+  (topic, value) pairs in order."""
+  success = True
+  for topic, value in messages:
+    target = topic + " - INT - " + str(value)
+    outc = c.get_output_timeout(1)
+    if target not in outc:
+      print("Error: " + id + " output should contain [" + target + "], is actually [" + outc.rstrip() + "]")
+      success = False
+
+  outc = c.get_output_timeout(1)
+  if outc != "timeout":
+    print("Error: " + id + " printing [" + outc.rstrip() + "]")
+    success = False
+
+  return success
+
+# topic file of the bulk subscriptions
+topic_file = "bulk_test.topics"
+
+# the subscriber's packet types (structs.h)
+SUBSCRIBE = 0
+EXIT = 2
+SUBSCRIBE_BULK = 5
+
+# size of a message in the default wire mode (tcp_msg_t)
+TCP_MSG_LEN = 1588
+
+def raw_connect(server, id):
+  """Connects to the server with a raw TCP socket, sending the connection packet split in single bytes."""
+  sock = socket.create_connection((ip, int(port)))
+  sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+  conn = id.encode().ljust(10, b"\0") + bytes([0]) + bytes(32)
+  for i in range(len(conn)):
+    sock.sendall(conn[i:i + 1])
+    sleep(0.01)
+
+  outs = server.get_output_timeout(2)
+  if not outs.startswith("New client " + id + " connected from"):
+    print("Error: server did not print that " + id + " is connected")
+    sock.close()
+    return None
+
+  return sock
+
+def sub_packet(type, topic, sf=0):
+  """Builds a subscription packet (sub_packet_t)."""
+  return struct.pack("=B51sBBxxI", type, topic.encode(), sf, 0, 0)
+
+def bulk_packet(type, topics):
+  """Builds a bulk packet, from (topic, flags) pairs."""
+  body = b"".join(bytes([flags, len(topic)]) + topic.encode() for topic, flags in topics)
+  return bytes([type]) + struct.pack("!I", len(body)) + body
+
+def raw_recv_topics(sock, count):
+  """Receives messages in the default wire mode, returning their topics."""
+  sock.settimeout(2)
+  data = b""
+  try:
+    while len(data) < count * TCP_MSG_LEN:
+      chunk = sock.recv(count * TCP_MSG_LEN - len(data))
+      if not chunk:
+        break
+      data += chunk
+  except socket.timeout:
+    pass
+
+  topics = []
+  for i in range(len(data) // TCP_MSG_LEN):
+    field = data[i * TCP_MSG_LEN + 11:i * TCP_MSG_LEN + 62]
+    topics.append(field.split(b"\0")[0].decode())
+
+  return topics
+
 ####### Test helper functions #######
 def run_udp_client(mode=True, type="0"):
   """Runs a UDP client which generates messages on one or multiple topics."""
@@ -598,6 +731,264 @@ def run_test_quick_flow(c1, topics):
   set_procfs_values(True, rmem)
   set_procfs_values(False, wmem)
 
+def run_test_resume_start(server):
+  """Tests that a resuming subscriber R1 receives messages on an SF topic."""
+  fail_test("resume_start")
+  print("Starting resuming subscriber R1")
+
+  if path.exists(resume_state):
+    os.remove(resume_state)
+
+  r1, success = start_resuming_client(server, "R1")
+  if not success:
+    return r1, False
+
+  r1.send_input("subscribe resume_topic 1")
+  if not r1.get_output_timeout(1).startswith("Subscribed to topic."):
+    print("Error: R1 not subscribed to resume_topic")
+    return r1, False
+
+  # the socket filter drops datagrams that arrive before the server read the
+  # subscription, which the subscriber does not wait for
+  sleep(0.2)
+
+  print("Generating three messages for topic resume_topic")
+  for i in range(3):
+    publish_int("resume_topic", i)
+
+  if not check_int_outputs(r1, "R1", [("resume_topic", i) for i in range(3)]):
+    return r1, False
+
+  pass_test("resume_start")
+  return r1, True
+
+def run_test_resume_ack(server, r1):
+  """Tests that the messages sent to R1 stay stored until it acknowledges them."""
+  fail_test("resume_ack")
+
+  # a stopped subscriber acknowledges nothing
+  print("Generating three messages for topic resume_topic while R1 is stopped")
+  r1.proc.send_signal(signal.SIGSTOP)
+  for i in range(3, 6):
+    publish_int("resume_topic", i)
+  sleep(0.5)
+  stored = get_backlog(server, "R1")
+  r1.proc.send_signal(signal.SIGCONT)
+
+  success = check_int_outputs(r1, "R1", [("resume_topic", i) for i in range(3, 6)])
+
+  # the positions are saved, then acknowledged, every second
+  sleep(2)
+  freed = get_backlog(server, "R1")
+
+  if stored <= 0:
+    print("Error: the messages sent to R1 were not kept until acknowledged")
+    success = False
+
+  if freed != 0:
+    print("Error: the server still stores " + str(freed) + " bytes for R1 after its ACKs")
+    success = False
+
+  if success:
+    pass_test("resume_ack")
+
+def run_test_resume_gap(server, r1):
+  """Tests that R1 only gets the messages it missed after a crash."""
+  fail_test("resume_gap")
+
+  print("Crashing R1, then generating two messages for topic resume_topic")
+  r1.proc.kill()
+  r1.proc.wait()
+  r1.started = False
+  drain_output(server)
+
+  for i in range(6, 8):
+    publish_int("resume_topic", i)
+  sleep(0.5)
+
+  # only the messages after the saved positions are printed
+  print("Restarting R1 from its state file")
+  r1, success = start_resuming_client(server, "R1")
+  if success and check_int_outputs(r1, "R1", [("resume_topic", i) for i in range(6, 8)]):
+    pass_test("resume_gap")
+
+  r1.send_input("exit")
+  sleep(1)
+  drain_output(server)
+  r1.finish()
+
+  if path.exists(resume_state):
+    os.remove(resume_state)
+
+def run_test_topic_file(server):
+  """Tests that a subscriber B1 subscribes to the topics of a file (-f)."""
+  fail_test("topic_file")
+
+  with open(topic_file, "w") as f:
+    f.write("# bulk subscriptions\n")
+    f.write("bulk_a 0\n")
+    f.write("bulk_b 1 urgent\n")
+    f.write("\n")
+    f.write("bulk_c\n")
+    f.write("bulk_" + "x" * 50 + " 0\n")
+
+  print("Starting subscriber B1 with a topic file")
+  b1 = Process(["./subscriber", "-f", topic_file, "B1", ip, port])
+  b1.start()
+  sleep(1)
+  outs = server.get_output_timeout(2)
+  if not b1.is_alive() or not outs.startswith("New client B1 connected from"):
+    print("Error: subscriber B1 is not up")
+    return b1, False
+
+  print("Generating one message for each topic of the file, and for another one")
+  for i, topic in enumerate(["bulk_a", "bulk_b", "bulk_c", "bulk_d"]):
+    publish_int(topic, i)
+
+  if check_int_outputs(b1, "B1", [("bulk_a", 0), ("bulk_b", 1), ("bulk_c", 2)]):
+    pass_test("topic_file")
+
+  return b1, True
+
+def run_test_subscribe_file(b1):
+  """Tests the unsubscribe_file and subscribe_file commands of subscriber B1."""
+  fail_test("subscribe_file")
+  success = True
+
+  print("Unsubscribing B1 from the topics of the file")
+  b1.send_input("unsubscribe_file " + topic_file)
+  outc = b1.get_output_timeout(1)
+  if not outc.startswith("Unsubscribed from 3 topics, skipped 1 invalid lines."):
+    print("Error: B1 printed [" + outc.rstrip() + "] on unsubscribe_file")
+    success = False
+
+  publish_int("bulk_a", 10)
+  success = check_int_outputs(b1, "B1", []) and success
+
+  print("Subscribing B1 to the topics of the file")
+  b1.send_input("subscribe_file " + topic_file)
+  outc = b1.get_output_timeout(1)
+  if not outc.startswith("Subscribed to 3 topics, skipped 1 invalid lines."):
+    print("Error: B1 printed [" + outc.rstrip() + "] on subscribe_file")
+    success = False
+  sleep(0.2)
+
+  publish_int("bulk_c", 11)
+  success = check_int_outputs(b1, "B1", [("bulk_c", 11)]) and success
+
+  if success:
+    pass_test("subscribe_file")
+
+def run_test_split_packets(server):
+  """Tests packets split across reads, and several packets in a single read."""
+  fail_test("split_packets")
+  print("Connecting a raw client B2, sending its packets in pieces")
+
+  sock = raw_connect(server, "B2")
+  if not sock:
+    return
+
+  # two subscriptions and the start of a bulk packet at once, then the rest
+  bulk = bulk_packet(SUBSCRIBE_BULK, [("split_c", 0), ("split_d", 0)])
+  sock.sendall(sub_packet(SUBSCRIBE, "split_a") + sub_packet(SUBSCRIBE, "split_b") + bulk[:3])
+  sleep(0.2)
+  sock.sendall(bulk[3:9])
+  sleep(0.2)
+  sock.sendall(bulk[9:])
+  sleep(0.2)
+
+  topics = ["split_a", "split_b", "split_c", "split_d"]
+  for i, topic in enumerate(topics):
+    publish_int(topic, i)
+
+  received = raw_recv_topics(sock, len(topics))
+  if received == topics:
+    pass_test("split_packets")
+  else:
+    print("Error: B2 received messages on " + str(received) + " instead of " + str(topics))
+
+  sock.sendall(sub_packet(EXIT, ""))
+  sock.close()
+  drain_output(server)
+
+def run_test_malformed_bulk(server):
+  """Tests that a malformed bulk packet closes the connection."""
+  fail_test("malformed_bulk")
+  print("Connecting a raw client B3, sending a malformed bulk packet")
+
+  sock = raw_connect(server, "B3")
+  if not sock:
+    return
+
+  # the topic's length is larger than the rest of the packet, and than a topic
+  body = bytes([0, 200]) + b"malformed"
+  sock.sendall(bytes([SUBSCRIBE_BULK]) + struct.pack("!I", len(body)) + body)
+
+  sock.settimeout(2)
+  try:
+    closed = sock.recv(TCP_MSG_LEN) == b""
+  except (socket.timeout, ConnectionResetError):
+    closed = False
+  sock.close()
+
+  outs = server.get_output_timeout(2)
+  if closed and outs.rstrip() == "Client B3 disconnected." and server.is_alive():
+    pass_test("malformed_bulk")
+  else:
+    print("Error: the server did not close B3's connection")
+
+def run_test_unsubscribe_empty(server, b1):
+  """Tests that a client without topics can unsubscribe (it used to crash the server)."""
+  fail_test("unsubscribe_empty")
+  print("Unsubscribing B4, which has no topics")
+
+  b4 = Process(["./subscriber", "B4", ip, port])
+  b4.start()
+  sleep(1)
+  drain_output(server)
+
+  b4.send_input("unsubscribe bulk_a 0")
+  outc = b4.get_output_timeout(1)
+  sleep(0.5)
+
+  success = outc.startswith("Unsubscribed to topic.") and server.is_alive()
+  if not success:
+    print("Error: unsubscribing B4 failed")
+
+  # the server keeps delivering messages
+  publish_int("bulk_c", 12)
+  success = check_int_outputs(b1, "B1", [("bulk_c", 12)]) and success
+
+  if success:
+    pass_test("unsubscribe_empty")
+
+  b4.send_input("exit")
+  sleep(1)
+  drain_output(server)
+  b4.finish()
+
+def run_test_client_lib(server):
+  """Tests the client library in both wire modes, with poll, epoll and
+  sub_run(), built with AddressSanitizer."""
+  fail_test("client_lib")
+  print("Running the client library test")
+
+  if not make_target("test_client"):
+    print("Error: test_client could not be built")
+    return
+
+  proc = subprocess.run(["./test_client", ip, port], stdout=PIPE, stderr=STDOUT,
+                        universal_newlines=True, timeout=60)
+  drain_output(server)
+
+  results = proc.stdout.splitlines()
+  if proc.returncode == 0 and len(results) == 6 and \
+    all(line.startswith("ok ") for line in results):
+    pass_test("client_lib")
+  else:
+    print("Error: the client library test failed")
+    print(proc.stdout)
+
 def run_test_server_stop(server, c1):
   """Tests that the server stops correctly."""
   fail_test("server_stop")
@@ -619,6 +1010,49 @@ def run_test_server_stop(server, c1):
   if success:
     pass_test("server_stop")
 
+def run_test_memory_refused():
+  """Tests that subscriptions refused by a server low on memory are reported
+  to the subscriber, in both wire modes."""
+  fail_test("memory_refused")
+
+  with open(topic_file, "w") as f:
+    for i in range(200):
+      f.write("mem_" + str(i) + " 0\n")
+
+  success = True
+  for mode in [[], ["-c"]]:
+    print("Starting a server with a memory cap, and subscriber M1 " + " ".join(mode))
+    server = Process(["./server", mem_port, "-M", "12K"])
+    server.start()
+    sleep(1)
+
+    m1 = Process(["./subscriber"] + mode + ["-f", topic_file, "M1", ip, mem_port])
+    m1.start()
+    sleep(1)
+
+    refused = [line.rstrip() for line in drain_output(m1) if line.rstrip().endswith(" refused.")]
+    server.send_input("mem")
+    rejected = -1
+    for line in drain_output(server):
+      if line.startswith("mem total="):
+        rejected = int(line.split("rejected_subs=")[1].split()[0])
+
+    # the first topics fit, and each refused one is reported once
+    if not refused or len(refused) != rejected or not m1.is_alive() or \
+      refused[-1] != "Subscription to mem_199 refused.":
+      print("Error: M1 reported " + str(len(refused)) + " refused subscriptions, the server " + str(rejected))
+      success = False
+
+    m1.send_input("exit")
+    server.send_input("exit")
+    sleep(1)
+    m1.finish()
+    server.finish()
+
+  os.remove(topic_file)
+  if success:
+    pass_test("memory_refused")
+
 def h2_test():
   """Runs all the tests."""
 
@@ -693,9 +1127,51 @@ def h2_test():
     # send all types of message 30 times in quick succesion and check
     run_test_quick_flow(c1, topics)
 
+    # start a resuming subscriber R1 and check that it receives SF messages
+    r1, success = run_test_resume_start(server)
+
+    if success:
+      # check that the messages are stored until R1 acknowledges them
+      run_test_resume_ack(server, r1)
+
+      # crash R1 and check that it only gets the missed messages on restart
+      run_test_resume_gap(server, r1)
+    else:
+      r1.finish()
+
+    # start a subscriber B1 with a topic file and check its subscriptions
+    b1, success = run_test_topic_file(server)
+
+    if success:
+      # unsubscribe B1 from the file's topics, subscribe it again and check
+      run_test_subscribe_file(b1)
+
+      # send packets split and batched by a raw client and check
+      run_test_split_packets(server)
+
+      # send a malformed bulk packet and check the connection is closed
+      run_test_malformed_bulk(server)
+
+      # unsubscribe a client without topics and check the server survives
+      run_test_unsubscribe_empty(server, b1)
+
+    b1.send_input("exit")
+    sleep(1)
+    drain_output(server)
+    b1.finish()
+
+    if path.exists(topic_file):
+      os.remove(topic_file)
+
+  # receive batches through the client library in every mode and check
+  run_test_client_lib(server)
+
   # close the server and check that C1 also closes
   run_test_server_stop(server, c1)
 
+  # subscribe beyond a memory cap and check the refusals are reported
+  run_test_memory_refused()
+
   # clean up
   make_clean()
 
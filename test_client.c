@@ -0,0 +1,245 @@
+// SPDX-License-Identifier: EUPL-1.2
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#include "utils.h"
+#include "sub_client.h"
+
+// Number of topics per client, more than the topic dictionary first holds
+#define TEST_TOPICS 100
+
+// Number of messages published per client
+#define TEST_MSGS 500
+
+// How long to wait for all the messages (ms)
+#define TEST_TIMEOUT 5000
+
+// Ways of driving a client
+#define DRIVE_POLL 0 // poll() and sub_process()
+#define DRIVE_EPOLL 1 // edge-triggered epoll, sub_process() until drained
+#define DRIVE_RUN 2 // sub_run() on its own thread
+
+static const char *drive_names[] = {"poll", "epoll", "run"};
+
+// What a client received, checked as it arrives
+typedef struct check_t {
+	const char *id;
+	_Atomic size_t received;
+	size_t max_batch;
+	bool ok;
+} check_t;
+
+// Gets the current time (monotonic, in ms)
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Gets the topic of the k-th message published for a client
+// The first topic gets one more message, so that a batch is still pending
+// when the dictionary grows.
+static void test_topic(const char *id, size_t k, char *topic) {
+	snprintf(topic, TOPICSIZ, "%s_%zu", id, k ? (k - 1) % TEST_TOPICS : 0);
+}
+
+// Checks a batch against the messages published, in order
+static void check_msgs(void *ctx, const sub_msg_t *msgs, size_t count) {
+	check_t *check = ctx;
+
+	if (count > check->max_batch)
+		check->max_batch = count;
+
+	for (size_t i = 0; i < count; ++i) {
+		size_t k = check->received++;
+		char topic[TOPICSIZ], type[TYPESIZ], text[CONTENTSIZ], value[32];
+		test_topic(check->id, k, topic);
+		snprintf(value, sizeof(value), "%zu", k);
+		sub_format(&msgs[i], type, text);
+
+		if (k >= TEST_MSGS || strcmp(msgs[i].topic, topic) ||
+			strcmp(msgs[i].ip, "127.0.0.1") || !msgs[i].port ||
+			strcmp(type, "INT") || strcmp(text, value)) {
+			fprintf(stderr, "%s: message %zu is %s - %s - %s\n", check->id, k,
+					msgs[i].topic, type, text);
+			check->ok = false;
+		}
+	}
+}
+
+// Publishes the messages of a client, as a UDP client would
+static void publish(const struct sockaddr_in *addr, const char *id) {
+	int udp = socket(AF_INET, SOCK_DGRAM, 0);
+	DIE(udp < 0, "socket() failed");
+
+	for (size_t k = 0; k < TEST_MSGS; ++k) {
+		// A positive INT: the sign byte, then the value
+		udp_msg_t msg;
+		char topic[TOPICSIZ];
+		memset(&msg, 0, sizeof(msg));
+		test_topic(id, k, topic);
+		memcpy(msg.topic, topic, strlen(topic));
+		msg.type = INT;
+		uint32_t value = htonl(k);
+		memcpy(msg.content + 1, &value, sizeof(uint32_t));
+
+		size_t len = offsetof(udp_msg_t, content) + 1 + sizeof(uint32_t);
+		int ret = sendto(udp, &msg, len, 0, (const struct sockaddr *)addr,
+							sizeof(*addr));
+		DIE(ret < 0, "sendto() failed");
+
+		// Leaves the server time to read them, so that none is dropped
+		if (k % 50 == 49)
+			usleep(5000);
+	}
+
+	close(udp);
+}
+
+// Handles the connection with poll() until everything arrived
+static void drive_poll(sub_client_t *client, check_t *check) {
+	struct pollfd pfd;
+	pfd.fd = sub_fd(client);
+	pfd.events = POLLIN;
+	uint64_t end = now_ms() + TEST_TIMEOUT;
+
+	while (check->received < TEST_MSGS && now_ms() < end) {
+		int ret = poll(&pfd, 1, sub_timeout(client));
+		DIE(ret < 0 && errno != EINTR, "poll() failed");
+
+		if (sub_process(client) == SUB_CLOSED)
+			return;
+	}
+}
+
+// Handles the connection with edge-triggered epoll until everything arrived
+static void drive_epoll(sub_client_t *client, check_t *check) {
+	int epfd = epoll_create1(0);
+	DIE(epfd < 0, "epoll_create1() failed");
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = sub_fd(client);
+	int ret = epoll_ctl(epfd, EPOLL_CTL_ADD, sub_fd(client), &ev);
+	DIE(ret < 0, "epoll_ctl() failed");
+
+	uint64_t end = now_ms() + TEST_TIMEOUT;
+	while (check->received < TEST_MSGS && now_ms() < end) {
+		ret = epoll_wait(epfd, &ev, 1, sub_timeout(client));
+		DIE(ret < 0 && errno != EINTR, "epoll_wait() failed");
+
+		// Nothing is reported again until the socket is drained
+		int result;
+		do {
+			result = sub_process(client);
+		} while (result == SUB_MORE);
+
+		if (result == SUB_CLOSED)
+			break;
+	}
+
+	close(epfd);
+}
+
+static void *run_thread(void *arg) {
+	sub_run(arg);
+
+	return NULL;
+}
+
+// Handles the connection with sub_run() until everything arrived, then stops
+// it by closing the receiving side
+static void drive_run(sub_client_t *client, check_t *check) {
+	pthread_t thread;
+	int ret = pthread_create(&thread, NULL, run_thread, client);
+	DIE(ret, "pthread_create() failed");
+
+	uint64_t end = now_ms() + TEST_TIMEOUT;
+	while (check->received < TEST_MSGS && now_ms() < end)
+		usleep(10000);
+
+	shutdown(sub_fd(client), SHUT_RD);
+	pthread_join(thread, NULL);
+}
+
+// Subscribes a client to its topics, publishes its messages while it does not
+// read them yet, then receives them all at once
+// Returns whether they all arrived, in order and in batches.
+static bool test_client(const struct sockaddr_in *addr, const char *ip,
+						const char *port, const char *id, uint8_t flags,
+						int drive) {
+	check_t check = {.id = id, .ok = true};
+	sub_config_t cfg = {.id = id, .ip = ip, .port = port, .flags = flags,
+						.cb = check_msgs, .ctx = &check};
+
+	sub_client_t *client = sub_connect(&cfg);
+	DIE(!client, "sub_connect() failed");
+
+	for (size_t i = 0; i < TEST_TOPICS; ++i) {
+		char topic[TOPICSIZ];
+		test_topic(id, i + 1, topic);
+		DIE(!sub_subscribe(client, topic, 0, PRIO_NORMAL),
+			"sub_subscribe() failed");
+	}
+
+	// The subscriptions come before the messages, on another socket
+	usleep(200000);
+	publish(addr, id);
+	usleep(200000);
+
+	if (drive == DRIVE_POLL)
+		drive_poll(client, &check);
+	else if (drive == DRIVE_EPOLL)
+		drive_epoll(client, &check);
+	else
+		drive_run(client, &check);
+
+	sub_close(client);
+
+	bool ok = check.ok && check.received == TEST_MSGS && check.max_batch > 1;
+	printf("%s %s %s: %zu messages, batches of up to %zu\n", ok ? "ok" : "FAIL",
+			flags & CONN_COMPACT ? "compact" : "default", drive_names[drive],
+			(size_t)check.received, check.max_batch);
+
+	return ok;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <IP> <PORT>\n", argv[0]);
+		return 1;
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(argv[2]));
+	DIE(!inet_aton(argv[1], &addr.sin_addr), "inet_aton() failed");
+
+	// Every wire mode with every way of driving the client, each with its
+	// own ID and topics
+	bool ok = true;
+	char id[IDSIZ] = "L0";
+	for (uint8_t flags = 0; flags <= CONN_COMPACT; flags += CONN_COMPACT) {
+		for (int drive = DRIVE_POLL; drive <= DRIVE_RUN; ++drive) {
+			++id[1];
+			ok = test_client(&addr, argv[1], argv[2], id, flags, drive) && ok;
+		}
+	}
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: EUPL-1.2
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "timer.h"
+
+// Number of ticks covered by one slot of a level
+#define LEVEL_SHIFT(level) ((level) ? WHEEL_BITS0 + WHEEL_BITS * ((level) - 1) : 0)
+
+// Number of slots of a level
+#define LEVEL_SLOTS(level) ((level) ? 1 << WHEEL_BITS : 1 << WHEEL_BITS0)
+
+// Number of ticks covered by the whole wheel
+#define WHEEL_SPAN ((uint64_t)1 << LEVEL_SHIFT(WHEEL_LEVELS))
+
+// Links a timer in the slot matching its expiry tick
+static void wheel_add(wheel_t *wheel, wtimer_t *timer) {
+	uint64_t delta = timer->expires - wheel->now;
+
+	// Timers beyond the wheel's span fire at its end
+	if (delta >= WHEEL_SPAN) {
+		timer->expires = wheel->now + WHEEL_SPAN - 1;
+		delta = WHEEL_SPAN - 1;
+	}
+
+	// The first level whose revolution covers the expiry
+	int level = 0;
+	while (delta >= (uint64_t)1 << LEVEL_SHIFT(level + 1))
+		++level;
+
+	unsigned int slot = (timer->expires >> LEVEL_SHIFT(level)) &
+						(LEVEL_SLOTS(level) - 1);
+	wtimer_t **head = &wheel->slots[level][slot];
+
+	timer->next = *head;
+	if (*head)
+		(*head)->pprev = &timer->next;
+	timer->pprev = head;
+	*head = timer;
+}
+
+// Unlinks a timer from its slot (or from the list being run)
+static void wheel_unlink(wtimer_t *timer) {
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+// Moves the timers of a slot of an upper level to the levels below
+static void cascade(wheel_t *wheel, int level, unsigned int slot) {
+	wtimer_t *timer = wheel->slots[level][slot];
+	wheel->slots[level][slot] = NULL;
+
+	while (timer) {
+		wtimer_t *next = timer->next;
+		wheel_add(wheel, timer);
+		timer = next;
+	}
+}
+
+void wheel_init(wheel_t *wheel, uint64_t now) {
+	memset(wheel, 0, sizeof(wheel_t));
+	wheel->start = now;
+}
+
+void timer_init(wtimer_t *timer, timer_fn_t fn, void *data) {
+	memset(timer, 0, sizeof(wtimer_t));
+	timer->fn = fn;
+	timer->data = data;
+}
+
+bool timer_pending(const wtimer_t *timer) {
+	return timer->pprev;
+}
+
+void timer_arm(wheel_t *wheel, wtimer_t *timer, uint64_t when) {
+	if (timer_pending(timer))
+		wheel_unlink(timer);
+	else
+		++wheel->count;
+
+	// Rounds up to the next tick, so that timers never fire early
+	uint64_t tick = when > wheel->start ?
+					(when - wheel->start + WHEEL_TICK - 1) / WHEEL_TICK : 0;
+	timer->expires = tick > wheel->now ? tick : wheel->now + 1;
+
+	wheel_add(wheel, timer);
+}
+
+void timer_cancel(wheel_t *wheel, wtimer_t *timer) {
+	if (!timer_pending(timer))
+		return;
+
+	wheel_unlink(timer);
+	--wheel->count;
+}
+
+void wheel_run(wheel_t *wheel, uint64_t now, void *ctx) {
+	uint64_t target = (now - wheel->start) / WHEEL_TICK;
+
+	// Nothing can fire, so the ticks are skipped
+	if (!wheel->count) {
+		if (target > wheel->now)
+			wheel->now = target;
+		return;
+	}
+
+	while (wheel->now < target) {
+		++wheel->now;
+
+		// At the end of a revolution, brings the timers of the next slot of
+		// the level above closer, and so on
+		for (int level = 1; level < WHEEL_LEVELS; ++level) {
+			if (wheel->now & ((1 << LEVEL_SHIFT(level)) - 1))
+				break;
+			cascade(wheel, level, (wheel->now >> LEVEL_SHIFT(level)) &
+									(LEVEL_SLOTS(level) - 1));
+		}
+
+		// Takes the expired timers out of the wheel, so that they can be
+		// armed again by their functions
+		wtimer_t *expired = wheel->slots[0][wheel->now & (LEVEL_SLOTS(0) - 1)];
+		wheel->slots[0][wheel->now & (LEVEL_SLOTS(0) - 1)] = NULL;
+		if (expired)
+			expired->pprev = &expired;
+
+		while (expired) {
+			wtimer_t *timer = expired;
+			wheel_unlink(timer);
+			--wheel->count;
+
+			timer->fn(ctx, timer);
+		}
+	}
+}
+
+int wheel_timeout(wheel_t *wheel, uint64_t now) {
+	if (!wheel->count)
+		return -1;
+
+	// The first non-empty slot of the first level, or else the next
+	// revolution, when the upper levels are cascaded
+	uint64_t tick = wheel->now + 1;
+	while (tick & (LEVEL_SLOTS(0) - 1) &&
+			!wheel->slots[0][tick & (LEVEL_SLOTS(0) - 1)])
+		++tick;
+
+	uint64_t when = wheel->start + tick * WHEEL_TICK;
+
+	return when > now ? (int)(when - now) : 0;
+}
@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: EUPL-1.2 */
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Resolution of the timer wheel (ms)
+#define WHEEL_TICK 10
+
+// Number of levels of the wheel. The first one has 2^WHEEL_BITS0 slots of one
+// tick, each of the others has 2^WHEEL_BITS slots, each slot covering a whole
+// revolution of the level below. Timers further away than the last level
+// (about 7.7 days) fire at its end.
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS0 8
+#define WHEEL_BITS 6
+
+struct wtimer_t;
+
+// Called when a timer fires, with the context given to wheel_run()
+typedef void (*timer_fn_t)(void *ctx, struct wtimer_t *timer);
+
+// A timer, embedded in the structure it belongs to
+typedef struct wtimer_t {
+	uint64_t expires; // the tick it fires at
+	timer_fn_t fn;
+	void *data; // the structure the timer belongs to
+	struct wtimer_t *next;
+	struct wtimer_t **pprev; // the link pointing to this timer, NULL if idle
+} wtimer_t;
+
+// A hierarchical timer wheel
+typedef struct wheel_t {
+	uint64_t start; // time of tick 0 (ms)
+	uint64_t now; // the last tick that was run
+	unsigned int count; // number of armed timers
+	wtimer_t *slots[WHEEL_LEVELS][1 << WHEEL_BITS0];
+} wheel_t;
+
+/**
+ * @brief Initializes an empty timer wheel.
+ *
+ * @param wheel The wheel.
+ * @param now The current time (monotonic, in ms).
+ */
+void wheel_init(wheel_t *wheel, uint64_t now);
+
+/**
+ * @brief Initializes an idle timer.
+ *
+ * @param timer The timer.
+ * @param fn The function called when it fires.
+ * @param data The structure the timer belongs to.
+ */
+void timer_init(wtimer_t *timer, timer_fn_t fn, void *data);
+
+/**
+ * @brief Arms a timer, or moves it if it is already armed. O(1).
+ *
+ * @param wheel The wheel.
+ * @param timer The timer.
+ * @param when When the timer fires (monotonic, in ms). It fires on the first
+ * tick at or after this time.
+ */
+void timer_arm(wheel_t *wheel, wtimer_t *timer, uint64_t when);
+
+/**
+ * @brief Disarms a timer, if it is armed. O(1).
+ *
+ * @param wheel The wheel.
+ * @param timer The timer.
+ */
+void timer_cancel(wheel_t *wheel, wtimer_t *timer);
+
+/**
+ * @brief Checks whether a timer is armed.
+ */
+bool timer_pending(const wtimer_t *timer);
+
+/**
+ * @brief Runs the ticks up to the current time, firing the expired timers. A
+ * timer is idle when its function is called, which may arm or cancel any
+ * timer, including itself.
+ *
+ * @param wheel The wheel.
+ * @param now The current time (monotonic, in ms).
+ * @param ctx The context passed to the timers' functions.
+ */
+void wheel_run(wheel_t *wheel, uint64_t now, void *ctx);
+
+/**
+ * @brief Computes how long poll may wait before wheel_run() has work to do.
+ *
+ * @param wheel The wheel.
+ * @param now The current time (monotonic, in ms).
+ *
+ * @return The timeout in ms, or -1 if no timer is armed.
+ */
+int wheel_timeout(wheel_t *wheel, uint64_t now);
+
+#endif /* _TIMER_H_ */
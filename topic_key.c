@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: EUPL-1.2
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "topic_key.h"
+
+// Multipliers of the hash: two 32-bit ones for each half of a 64-bit word
+// (as _mm_mul_epu32 uses), and a 64-bit one for the final mix
+#define HASH_K1 0x9e3779b1u
+#define HASH_K2 0x85ebca77u
+#define HASH_K3 0xc2b2ae3d27d4eb4fULL
+
+void key_set(topic_key_t *key, const char *topic, size_t max) {
+	size_t len = strnlen(topic, max);
+
+	memset(key, 0, sizeof(topic_key_t));
+	memcpy(key->str, topic, len);
+}
+
+size_t key_load(topic_key_t *key, const char *field, size_t max) {
+#if defined(__AVX2__)
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i lo = _mm256_loadu_si256((const __m256i *)field);
+	__m256i hi = _mm256_loadu_si256((const __m256i *)(field + 32));
+
+	// The topic ends at the first null byte, or at the end of the field
+	uint64_t nul = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, zero)) |
+					(uint64_t)(uint32_t)_mm256_movemask_epi8(
+						_mm256_cmpeq_epi8(hi, zero)) << 32;
+	size_t len = __builtin_ctzll(nul | (uint64_t)1 << max);
+
+	// Clears the bytes after it
+	const __m256i idx = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+											12, 13, 14, 15, 16, 17, 18, 19, 20,
+											21, 22, 23, 24, 25, 26, 27, 28, 29,
+											30, 31);
+	const __m256i end = _mm256_set1_epi8((char)len);
+	lo = _mm256_and_si256(lo, _mm256_cmpgt_epi8(end, idx));
+	hi = _mm256_and_si256(hi, _mm256_cmpgt_epi8(end,
+							_mm256_add_epi8(idx, _mm256_set1_epi8(32))));
+
+	_mm256_storeu_si256((__m256i *)key->str, lo);
+	_mm256_storeu_si256((__m256i *)(key->str + 32), hi);
+
+	return len;
+#elif defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v[TOPIC_KEY_SIZE / 16];
+	uint64_t nul = 0;
+
+	// The topic ends at the first null byte, or at the end of the field
+	for (int i = 0; i < TOPIC_KEY_SIZE / 16; ++i) {
+		v[i] = _mm_loadu_si128((const __m128i *)(field + 16 * i));
+		nul |= (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], zero)) <<
+				(16 * i);
+	}
+	size_t len = __builtin_ctzll(nul | (uint64_t)1 << max);
+
+	// Clears the bytes after it
+	const __m128i idx = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+										12, 13, 14, 15);
+	const __m128i end = _mm_set1_epi8((char)len);
+	for (int i = 0; i < TOPIC_KEY_SIZE / 16; ++i) {
+		__m128i pos = _mm_add_epi8(idx, _mm_set1_epi8((char)(16 * i)));
+		_mm_storeu_si128((__m128i *)(key->str + 16 * i),
+							_mm_and_si128(v[i], _mm_cmpgt_epi8(end, pos)));
+	}
+
+	return len;
+#else
+	key_set(key, field, max);
+
+	return strlen(key->str);
+#endif
+}
+
+#if !defined(__SSE2__)
+// Mixes a 64-bit word, like the vector version does with each of its lanes
+static uint64_t mix(uint64_t word) {
+	return (word & 0xffffffff) * HASH_K1 ^ (word >> 32) * HASH_K2;
+}
+#endif
+
+unsigned int key_hash(const topic_key_t *key) {
+	uint64_t lanes[2];
+
+	// Mixes the key 16 bytes at a time, as two 64-bit lanes
+#if defined(__SSE2__)
+	const __m128i k1 = _mm_set1_epi64x(HASH_K1);
+	const __m128i k2 = _mm_set1_epi64x(HASH_K2);
+
+	__m128i acc = _mm_loadu_si128((const __m128i *)key->str);
+	for (int i = 1; i < TOPIC_KEY_SIZE / 16; ++i) {
+		acc = _mm_xor_si128(_mm_mul_epu32(acc, k1),
+							_mm_mul_epu32(_mm_srli_epi64(acc, 32), k2));
+		acc = _mm_xor_si128(acc,
+							_mm_loadu_si128((const __m128i *)(key->str +
+																16 * i)));
+	}
+	acc = _mm_xor_si128(_mm_mul_epu32(acc, k1),
+						_mm_mul_epu32(_mm_srli_epi64(acc, 32), k2));
+
+	_mm_storeu_si128((__m128i *)lanes, acc);
+#else
+	memcpy(lanes, key->str, sizeof(lanes));
+	for (int i = 1; i < TOPIC_KEY_SIZE / 16; ++i) {
+		uint64_t words[2];
+		memcpy(words, key->str + 16 * i, sizeof(words));
+
+		lanes[0] = mix(lanes[0]) ^ words[0];
+		lanes[1] = mix(lanes[1]) ^ words[1];
+	}
+	lanes[0] = mix(lanes[0]);
+	lanes[1] = mix(lanes[1]);
+#endif
+
+	// Folds the lanes, so that the low bits depend on the whole key
+	uint64_t hash = (lanes[0] ^ (lanes[1] << 31 | lanes[1] >> 33)) * HASH_K3;
+	hash ^= hash >> 29;
+
+	return (unsigned int)(hash ^ hash >> 32);
+}
+
+bool key_equal(const topic_key_t *a, const topic_key_t *b) {
+#if defined(__AVX2__)
+	__m256i diff = _mm256_or_si256(
+		_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)a->str),
+							_mm256_loadu_si256((const __m256i *)b->str)),
+		_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a->str + 32)),
+							_mm256_loadu_si256((const __m256i *)(b->str + 32))));
+
+	return _mm256_testz_si256(diff, diff);
+#elif defined(__SSE2__)
+	__m128i diff = _mm_setzero_si128();
+	for (int i = 0; i < TOPIC_KEY_SIZE / 16; ++i)
+		diff = _mm_or_si128(diff, _mm_xor_si128(
+				_mm_loadu_si128((const __m128i *)(a->str + 16 * i)),
+				_mm_loadu_si128((const __m128i *)(b->str + 16 * i))));
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) ==
+			0xffff;
+#else
+	return !memcmp(a->str, b->str, TOPIC_KEY_SIZE);
+#endif
+}
+
+size_t key_len(const topic_key_t *key) {
+	return strnlen(key->str, TOPIC_KEY_SIZE);
+}
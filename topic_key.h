@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: EUPL-1.2 */
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#ifndef _TOPIC_KEY_H_
+#define _TOPIC_KEY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Size of a topic key: the longest topic (50 bytes), its null byte and the
+// padding up to a whole number of vectors
+#define TOPIC_KEY_SIZE 64
+
+// A topic padded with null bytes to a fixed size, so that it is hashed and
+// compared a vector at a time, without looking for its end. It is also a
+// null-terminated string.
+typedef struct topic_key_t {
+	char str[TOPIC_KEY_SIZE];
+} topic_key_t;
+
+/**
+ * @brief Builds a key from a topic that may not be null-terminated.
+ *
+ * @param key Where to store the key.
+ * @param topic The topic.
+ * @param max The maximum length of the topic (less than TOPIC_KEY_SIZE).
+ */
+void key_set(topic_key_t *key, const char *topic, size_t max);
+
+/**
+ * @brief Builds a key from a fixed-size topic field (like a datagram's),
+ * finding its end with vector instructions. The field is read whole, so
+ * TOPIC_KEY_SIZE bytes must be readable from its start.
+ *
+ * @param key Where to store the key.
+ * @param field The topic field.
+ * @param max The size of the field (less than TOPIC_KEY_SIZE), which ends the
+ * topic if there is no null byte in it.
+ *
+ * @return The length of the topic.
+ */
+size_t key_load(topic_key_t *key, const char *field, size_t max);
+
+/**
+ * @brief Hashes a key. The result is the same with and without vector
+ * instructions.
+ *
+ * @param key The key.
+ *
+ * @return The hash.
+ */
+unsigned int key_hash(const topic_key_t *key);
+
+/**
+ * @brief Compares two keys.
+ *
+ * @param a The first key.
+ * @param b The second key.
+ *
+ * @return True if they hold the same topic.
+ */
+bool key_equal(const topic_key_t *a, const topic_key_t *b);
+
+/**
+ * @brief Gets the length of the topic of a key.
+ *
+ * @param key The key.
+ *
+ * @return The length.
+ */
+size_t key_len(const topic_key_t *key);
+
+#endif /* _TOPIC_KEY_H_ */
@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: EUPL-1.2
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#include "utils.h"
+#include "zerocopy.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+zc_buf_t *zc_buf_new(const void *data, size_t len) {
+	zc_buf_t *buf = malloc(sizeof(zc_buf_t) + len);
+	DIE(!buf, "zero-copy buffer malloc() failed");
+
+	buf->refs = 1;
+	buf->len = len;
+	memcpy(buf->data, data, len);
+
+	return buf;
+}
+
+void zc_buf_put(zc_buf_t *buf) {
+	if (buf && !--buf->refs)
+		free(buf);
+}
+
+bool zc_enable(int socket) {
+	int optval = 1;
+
+	return !setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &optval, sizeof(int));
+}
+
+// Adds a send to the end of the queue
+static void zc_push(zc_queue_t *queue, zc_buf_t *buf) {
+	// Grows the circular array, unrolling it
+	if (queue->count == queue->cap) {
+		unsigned int cap = queue->cap ? 2 * queue->cap : 64;
+		zc_buf_t **bufs = malloc(cap * sizeof(zc_buf_t *));
+		DIE(!bufs, "zero-copy queue malloc() failed");
+
+		for (unsigned int i = 0; i < queue->count; ++i)
+			bufs[i] = queue->bufs[(queue->head + i) % queue->cap];
+
+		free(queue->bufs);
+		queue->bufs = bufs;
+		queue->head = 0;
+		queue->cap = cap;
+	}
+
+	++buf->refs;
+	queue->bufs[(queue->head + queue->count) % queue->cap] = buf;
+	++queue->count;
+}
+
+ssize_t zc_send(zc_queue_t *queue, int socket, zc_buf_t *buf) {
+	ssize_t ret = send(socket, buf->data, buf->len,
+						MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+
+	// Too much memory is pinned already
+	if (ret < 0 && errno == ENOBUFS)
+		ret = send(socket, buf->data, buf->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	else if (ret >= 0)
+		zc_push(queue, buf);
+
+	if (ret < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+	return ret;
+}
+
+bool zc_complete(zc_queue_t *queue, int socket, bool *copied) {
+	bool read = false;
+
+	while (true) {
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+		read = true;
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		for (; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR)
+				continue;
+
+			struct sock_extended_err *err = (void *)CMSG_DATA(cmsg);
+			if (err->ee_errno || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				*copied = true;
+
+			// The sends with IDs in [ee_info, ee_data] completed, in any
+			// order relative to the other notifications
+			for (uint32_t id = err->ee_info; ; ++id) {
+				uint32_t pos = id - queue->first;
+				if (pos < queue->count) {
+					zc_buf_t **slot = &queue->bufs[(queue->head + pos) %
+													queue->cap];
+					zc_buf_put(*slot);
+					*slot = NULL;
+				}
+
+				if (id == err->ee_data)
+					break;
+			}
+		}
+
+		// Forgets the oldest sends, once completed
+		while (queue->count && !queue->bufs[queue->head]) {
+			queue->head = (queue->head + 1) % queue->cap;
+			--queue->count;
+			++queue->first;
+		}
+	}
+
+	return read;
+}
+
+void zc_release(zc_queue_t *queue) {
+	for (unsigned int i = 0; i < queue->count; ++i)
+		zc_buf_put(queue->bufs[(queue->head + i) % queue->cap]);
+
+	free(queue->bufs);
+	memset(queue, 0, sizeof(zc_queue_t));
+}
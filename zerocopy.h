@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: EUPL-1.2 */
+/* Copyright Mitran Andrei-Gabriel 2023 */
+
+#ifndef _ZEROCOPY_H_
+#define _ZEROCOPY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// A buffer sent with MSG_ZEROCOPY, shared by all the sends of a message. The
+// kernel reads it after send() returns, so it is freed only when the last
+// send using it completed.
+typedef struct zc_buf_t {
+	unsigned int refs; // the owner and the pending sends
+	size_t len;
+	uint8_t data[];
+} zc_buf_t;
+
+// The zero-copy sends of a socket, in the order they were made, waiting for
+// their completion notifications
+typedef struct zc_queue_t {
+	zc_buf_t **bufs; // a circular array, NULL for completed sends
+	unsigned int head; // position of the oldest send
+	unsigned int count;
+	unsigned int cap;
+	uint32_t first; // the kernel's ID of the oldest send
+} zc_queue_t;
+
+/**
+ * @brief Creates a buffer holding a copy of the given bytes, owned by the
+ * caller.
+ *
+ * @param data The bytes.
+ * @param len The number of bytes.
+ *
+ * @return A pointer to the buffer.
+ */
+zc_buf_t *zc_buf_new(const void *data, size_t len);
+
+/**
+ * @brief Drops a reference to a buffer, freeing it after the last one.
+ *
+ * @param buf The buffer.
+ */
+void zc_buf_put(zc_buf_t *buf);
+
+/**
+ * @brief Enables zero-copy sends on a socket.
+ *
+ * @param socket The socket.
+ *
+ * @return Whether the kernel supports them.
+ */
+bool zc_enable(int socket);
+
+/**
+ * @brief Sends a buffer without copying it, keeping a reference to it until
+ * the send completes. If the kernel cannot pin more memory, the buffer is
+ * copied instead. The socket is non-blocking, so only a part of the buffer
+ * may be sent.
+ *
+ * @param queue The socket's pending sends.
+ * @param socket The socket.
+ * @param buf The buffer.
+ *
+ * @return The number of bytes sent (0 if the socket is full), or -1 if the
+ * connection failed.
+ */
+ssize_t zc_send(zc_queue_t *queue, int socket, zc_buf_t *buf);
+
+/**
+ * @brief Reads the completion notifications from a socket's error queue,
+ * releasing the buffers of the completed sends.
+ *
+ * @param queue The socket's pending sends.
+ * @param socket The socket.
+ * @param copied Set if the kernel copied the data anyway (as it does for
+ * loopback connections), in which case zero-copy sends are useless.
+ *
+ * @return Whether any notification was read.
+ */
+bool zc_complete(zc_queue_t *queue, int socket, bool *copied);
+
+/**
+ * @brief Releases the buffers of all pending sends, when their socket is
+ * closed and no notification can come anymore.
+ *
+ * @param queue The pending sends.
+ */
+void zc_release(zc_queue_t *queue);
+
+#endif /* _ZEROCOPY_H_ */